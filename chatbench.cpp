@@ -0,0 +1,841 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "commons.hpp"
+#include "my_send_recv.hpp"
+#include "frame.hpp"
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+}
+
+#define MAX_WORKERS 64
+#define MAX_EVENTS 256
+#define OUT_HIGH (256 << 10)
+#define OUT_LOW (64 << 10)
+// Deflate level of traffic sent with -z.
+#define COMPRESS_LEVEL 6
+
+enum traffic_pattern
+{
+    TRAFFIC_UNICAST,   // one random on-line user
+    TRAFFIC_MULTICAST, // `fanout` random on-line users
+    TRAFFIC_OFFLINE    // one random off-line user
+};
+
+struct bench_options
+{
+    const char *host;
+    const char *port;
+    int connections;
+    int offline_users;
+    int threads;
+    int connect_window; // logins in progress at once, all threads
+    double duration;
+    double rate;        // messages per second, 0 for as fast as possible
+    traffic_pattern pattern;
+    int fanout;
+    size_t msg_size;
+    bool binary;
+    bool compress;
+    std::string prefix;
+};
+
+bench_options options = { "127.0.0.1", "1733", 1000, 100, 4, 8, 10, 10000, TRAFFIC_UNICAST, 5, 64, false, false, "bench" };
+
+enum bench_phase
+{
+    PHASE_CONNECT,   // connect and log in every user
+    PHASE_RUN,       // send traffic
+    PHASE_SETTLE,    // wait for messages still on their way
+    PHASE_RECONNECT, // log the off-line users back in to drain their backlog
+    PHASE_DONE
+};
+
+std::atomic<int> phase(PHASE_CONNECT);
+
+enum conn_state
+{
+    CONN_IDLE,       // not connected
+    CONN_CONNECTING, // non-blocking connect in progress
+    CONN_LOGIN,      // waiting for the welcome message
+    CONN_ONLINE
+};
+
+struct bench_conn
+{
+    my_send_recv io;
+    int user;
+    bool offline; // logs out right after login, until PHASE_RECONNECT
+    conn_state state;
+    bool framed;  // the server sends frames
+    bool out_watched;
+
+    bench_conn(int user, bool offline)
+    : io(-1), user(user), offline(offline), state(CONN_IDLE), framed(false), out_watched(false)
+    {
+
+    }
+};
+
+struct worker
+{
+    int id;
+    pthread_t tid;
+    int epollfd;
+    std::vector<bench_conn *> conns;
+    std::vector<bench_conn *> senders; // on-line connections of this worker
+    std::vector<size_t> to_connect;    // indices in `conns`
+    size_t next_connect;
+    std::mt19937 rng;
+    std::vector<uint64_t> latencies;   // nanoseconds, on-line deliveries
+    uint64_t sent_budget;              // messages due so far in PHASE_RUN
+    size_t next_sender;
+
+    std::atomic<uint64_t> logged_in;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> skipped;          // sender's queue was congested
+    std::atomic<uint64_t> expected;         // deliveries to on-line users
+    std::atomic<uint64_t> expected_offline; // deliveries to off-line users
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> received_offline;
+};
+
+struct addrinfo *server_addr;
+worker *workers[MAX_WORKERS];
+// Logins in progress. A connection is complete before the server accepts
+// it, so this also bounds what waits in the server's listen backlog.
+std::atomic<int> logins_in_flight(0);
+std::atomic<uint64_t> run_start(0);
+
+/**
+ * Descrption: Current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns();
+
+/**
+ * Descrption: Parse command line options.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int parse_options(int argc, char *argv[]);
+
+/**
+ * Descrption: Name of user `user`; the off-line users come after the on-line
+ *             ones.
+ */
+static std::string user_name(int user);
+
+/**
+ * Descrption: Event loop of a worker thread.
+ */
+static void *worker_main(void *arg);
+
+/**
+ * Descrption: Start a non-blocking connect for connection `bc`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int start_connect(worker &w, bench_conn &bc);
+
+/**
+ * Descrption: Handle readiness of `bc`.
+ */
+static void handle_event(worker &w, bench_conn &bc, uint32_t events);
+
+/**
+ * Descrption: Run every complete line or frame in the input buffer of `bc`.
+ * Return: 0 if succeed, or -1 if the connection is closed.
+ */
+static int read_messages(worker &w, bench_conn &bc);
+
+/**
+ * Descrption: Account for a chat message `msg` received by `bc`.
+ */
+static void got_message(worker &w, bench_conn &bc, bool offline, const cmd_token &msg);
+
+/**
+ * Descrption: Send the messages due by now from the connections of `w`.
+ */
+static void send_traffic(worker &w);
+
+/**
+ * Descrption: Send one chat message from `bc` to random recipients.
+ */
+static void send_one(worker &w, bench_conn &bc);
+
+/**
+ * Descrption: Close connection `bc`.
+ */
+static void drop_conn(worker &w, bench_conn &bc, bool failed);
+
+/**
+ * Descrption: Watch `bc` for writability as long as its output queue is not
+ *             empty.
+ */
+static void update_watch(worker &w, bench_conn &bc);
+
+/**
+ * Descrption: Sum counter `field` over all workers.
+ */
+static uint64_t total(std::atomic<uint64_t> worker::*field);
+
+/**
+ * Descrption: Print the results.
+ */
+static void report(double connect_time, double run_time, double drain_time);
+
+int main(int argc, char *argv[])
+{
+    using namespace std;
+
+    if (parse_options(argc, argv) < 0) {
+        return 1;
+    }
+
+    // Every connection is a file descriptor.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(options.host, options.port, &hints, &server_addr);
+    if (status != 0) {
+        cerr << gai_strerror(status) << endl;
+        return 1;
+    }
+
+    for (int i = 0; i < options.threads; ++i) {
+        worker *w = new worker();
+        w->id = i;
+        w->epollfd = epoll_create1(0);
+        if (w->epollfd < 0) {
+            perror("epoll_create1");
+            return 1;
+        }
+        w->next_connect = 0;
+        w->rng.seed(i + 1);
+        w->sent_budget = 0;
+        w->next_sender = 0;
+        workers[i] = w;
+    }
+
+    int users = options.connections + options.offline_users;
+    for (int user = 0; user < users; ++user) {
+        worker &w = *workers[user % options.threads];
+        w.to_connect.push_back(w.conns.size());
+        w.conns.push_back(new bench_conn(user, user >= options.connections));
+    }
+
+    for (int i = 0; i < options.threads; ++i) {
+        if (pthread_create(&workers[i]->tid, NULL, worker_main, workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    // Connect and log in everyone.
+    uint64_t start = now_ns();
+    while (total(&worker::logged_in) + total(&worker::failed) < static_cast<uint64_t>(users)) {
+        usleep(10000);
+    }
+    double connect_time = (now_ns() - start) / 1e9;
+    if (total(&worker::failed) > 0) {
+        cerr << total(&worker::failed) << " connections failed." << endl;
+    }
+
+    // Let the server see the off-line users leave.
+    usleep(500000);
+
+    run_start = now_ns();
+    phase = PHASE_RUN;
+    usleep(static_cast<useconds_t>(options.duration * 1e6));
+    double run_time = (now_ns() - run_start) / 1e9;
+
+    phase = PHASE_SETTLE;
+    start = now_ns();
+    uint64_t last = 0;
+    while (total(&worker::received) < total(&worker::expected) && now_ns() - start < 10000000000ull) {
+        // Give up early once nothing arrives anymore.
+        uint64_t received = total(&worker::received);
+        if (received == last && now_ns() - start > 2000000000ull) {
+            break;
+        }
+        last = received;
+        usleep(100000);
+    }
+
+    double drain_time = 0;
+    if (total(&worker::expected_offline) > 0) {
+        phase = PHASE_RECONNECT;
+        start = now_ns();
+        while (total(&worker::received_offline) < total(&worker::expected_offline) && now_ns() - start < 60000000000ull) {
+            usleep(1000);
+        }
+        drain_time = (now_ns() - start) / 1e9;
+    }
+
+    phase = PHASE_DONE;
+    for (int i = 0; i < options.threads; ++i) {
+        pthread_join(workers[i]->tid, NULL);
+    }
+
+    report(connect_time, run_time, drain_time);
+
+    freeaddrinfo(server_addr);
+    return 0;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:o:t:w:d:r:m:f:s:bzn:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'o':
+            options.offline_users = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'w':
+            options.connect_window = atoi(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "unicast") == 0) {
+                options.pattern = TRAFFIC_UNICAST;
+            }
+            else if (strcmp(optarg, "multicast") == 0) {
+                options.pattern = TRAFFIC_MULTICAST;
+            }
+            else if (strcmp(optarg, "offline") == 0) {
+                options.pattern = TRAFFIC_OFFLINE;
+            }
+            else {
+                std::cerr << "Unknown traffic pattern " << optarg << "." << std::endl;
+                return -1;
+            }
+            break;
+        case 'f':
+            options.fanout = atoi(optarg);
+            break;
+        case 's':
+            options.msg_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.binary = true;
+            break;
+        case 'z':
+            options.compress = true;
+            break;
+        case 'n':
+            options.prefix = optarg;
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-H host] [-p port] [-c connections] [-o offline_users] [-t threads]"
+                " [-w connect_window] [-d seconds] [-r rate] [-m unicast|multicast|offline] [-f fanout] [-s msg_size]"
+                " [-b] [-z] [-n name_prefix]" << std::endl;
+            return -1;
+        }
+    }
+
+    if (options.connections < 1 || options.threads < 1 || options.threads > MAX_WORKERS || options.connect_window < 1) {
+        std::cerr << "Need at least one connection, and 1 to " << MAX_WORKERS << " threads." << std::endl;
+        return -1;
+    }
+    if (options.pattern == TRAFFIC_OFFLINE && options.offline_users < 1) {
+        std::cerr << "Off-line traffic needs off-line users." << std::endl;
+        return -1;
+    }
+    if (options.fanout < 1 || options.fanout > options.connections || options.fanout >= MAX_TOKENS - 1) {
+        std::cerr << "Fan-out must be between 1 and the number of connections." << std::endl;
+        return -1;
+    }
+
+    // Room for the recipient names, and for the sender name when relayed.
+    size_t names = ((options.pattern == TRAFFIC_MULTICAST) ? options.fanout : 1) * (options.prefix.size() + 13);
+    size_t limit = options.binary ? MAX_FRAME - FRAME_HDR : MAX_CMD - 32;
+    size_t max_size = (limit > names + 24) ? limit - names : 0;
+    if (options.msg_size < 24 || options.msg_size > max_size) {
+        std::cerr << "Message size must be between 24 and " << max_size << "." << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static std::string user_name(int user)
+{
+    if (user >= options.connections) {
+        return options.prefix + "off" + std::to_string(user - options.connections);
+    }
+    return options.prefix + std::to_string(user);
+}
+
+static void *worker_main(void *arg)
+{
+    worker &w = *static_cast<worker *>(arg);
+    bool reconnecting = false;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (phase != PHASE_DONE) {
+        // Keep a bounded number of logins in progress.
+        while (w.next_connect < w.to_connect.size() && logins_in_flight < options.connect_window) {
+            bench_conn &bc = *w.conns[w.to_connect[w.next_connect++]];
+            logins_in_flight += 1;
+            if (start_connect(w, bc) < 0) {
+                logins_in_flight -= 1;
+                w.failed += 1;
+            }
+        }
+
+        if (phase == PHASE_RECONNECT && !reconnecting) {
+            reconnecting = true;
+            w.to_connect.clear();
+            w.next_connect = 0;
+            for (size_t i = 0; i < w.conns.size(); ++i) {
+                if (w.conns[i]->offline) {
+                    w.conns[i]->offline = false;
+                    w.to_connect.push_back(i);
+                }
+            }
+        }
+
+        int n = epoll_wait(w.epollfd, events, MAX_EVENTS, 1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            handle_event(w, *static_cast<bench_conn *>(events[i].data.ptr), events[i].events);
+        }
+
+        if (phase == PHASE_RUN) {
+            send_traffic(w);
+        }
+    }
+
+    for (auto bc : w.conns) {
+        if (bc->io.fd >= 0) {
+            bc->io.close();
+        }
+    }
+
+    return NULL;
+}
+
+static int start_connect(worker &w, bench_conn &bc)
+{
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype | SOCK_NONBLOCK, server_addr->ai_protocol);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Measure the server, not Nagle's algorithm.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    bc.io = my_send_recv(fd);
+    bc.io.set_nonblocking(OUT_HIGH, OUT_LOW, OVERFLOW_SPILL);
+    bc.state = CONN_CONNECTING;
+    bc.framed = false;
+    bc.out_watched = true;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &bc;
+    if (epoll_ctl(w.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        bc.io.close();
+        bc.state = CONN_IDLE;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void handle_event(worker &w, bench_conn &bc, uint32_t events)
+{
+    using namespace std;
+
+    if (bc.state == CONN_CONNECTING) {
+        bc.state = CONN_LOGIN;
+
+        int err = 0;
+        socklen_t len = sizeof (err);
+        getsockopt(bc.io.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            errno = err;
+            perror("connect");
+            drop_conn(w, bc, true);
+            return;
+        }
+
+        // The server reads compress and binary right after the login,
+        // before any chat; everything after compress is deflated.
+        string login = "user " + user_name(bc.user) + "\n";
+        if (options.compress) {
+            login += "compress\n";
+        }
+        int sendlen = static_cast<int>(login.size());
+        int status = bc.io.send(login.data(), &sendlen);
+        if (status == 0 && options.compress) {
+            status = bc.io.start_deflate(COMPRESS_LEVEL);
+        }
+        if (status == 0 && options.binary && !bc.offline) {
+            sendlen = 7;
+            status = bc.io.send("binary\n", &sendlen);
+        }
+        if (status < 0) {
+            perror("my_send");
+            drop_conn(w, bc, true);
+            return;
+        }
+
+        update_watch(w, bc);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && bc.io.flush() < 0) {
+        drop_conn(w, bc, bc.state != CONN_ONLINE);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while (true) {
+            int status = bc.io.fill();
+            if (status == 0 || (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)) {
+                drop_conn(w, bc, bc.state != CONN_ONLINE);
+                return;
+            }
+            if (read_messages(w, bc) < 0) {
+                return;
+            }
+            if (status < 0 && errno != ENOBUFS) {
+                break;
+            }
+        }
+    }
+
+    update_watch(w, bc);
+}
+
+static int read_messages(worker &w, bench_conn &bc)
+{
+    using namespace std;
+
+    char buf[MAX_FRAME];
+    while (bc.io.fd >= 0) {
+        int len = bc.framed ? MAX_FRAME : MAX_CMD;
+        int status = bc.framed ? bc.io.next_frame(buf, &len) : bc.io.next_cmd(buf, &len);
+        if (status < 0) {
+            // Inflated input may still wait for room in the buffer.
+            if (bc.io.input_pending() && bc.io.fill() > 0) {
+                continue;
+            }
+            return 0;
+        }
+        if (status > 0) {
+            cerr << "Invalid message from the server." << endl;
+            drop_conn(w, bc, bc.state != CONN_ONLINE);
+            return -1;
+        }
+
+        if (bc.framed) {
+            frame_header hdr;
+            cmd_token from, group, msg;
+            if (parse_message_frame(buf, len, hdr, from, group, msg) == 0) {
+                got_message(w, bc, hdr.type == FRAME_OFFLINE, msg);
+            }
+            continue;
+        }
+
+        if (bc.state == CONN_LOGIN) {
+            if (memcmp(buf, "Welcome", 7) != 0) {
+                cerr << "Login of " << user_name(bc.user) << " refused: " << string(buf, len - 1) << endl;
+                drop_conn(w, bc, true);
+                return -1;
+            }
+
+            bc.state = CONN_ONLINE;
+            logins_in_flight -= 1;
+            w.logged_in += 1;
+            if (bc.offline) {
+                // Known to the server from now on, and away.
+                drop_conn(w, bc, false);
+                return -1;
+            }
+            w.senders.push_back(&bc);
+            continue;
+        }
+
+        if (memcmp(buf, "message ", 8) == 0 || memcmp(buf, "offline ", 8) == 0) {
+            parsed_cmd cmd;
+            if (tokenize_command(buf, len - 1, cmd) == 0 && cmd.has_msg) {
+                got_message(w, bc, buf[0] == 'o', cmd.msg);
+            }
+        }
+        else if (len == 19 && memcmp(buf, "Binary framing on.\n", 19) == 0) {
+            bc.framed = true;
+        }
+        else if (len == 16 && memcmp(buf, "Compression on.\n", 16) == 0 && bc.io.start_inflate() < 0) {
+            drop_conn(w, bc, false);
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+static void got_message(worker &w, bench_conn &bc, bool offline, const cmd_token &msg)
+{
+    // The message starts with the time it was sent.
+    uint64_t sent_at = strtoull(std::string(msg.ptr, std::min(msg.len, static_cast<size_t>(20))).c_str(), NULL, 10);
+    if (run_start == 0 || sent_at < run_start) {
+        // Left over from an earlier run.
+        return;
+    }
+
+    if (offline) {
+        w.received_offline += 1;
+        return;
+    }
+
+    w.received += 1;
+    w.latencies.push_back(now_ns() - sent_at);
+}
+
+static void send_traffic(worker &w)
+{
+    if (w.senders.empty()) {
+        return;
+    }
+
+    uint64_t due;
+    if (options.rate > 0) {
+        double elapsed = (now_ns() - run_start) / 1e9;
+        due = static_cast<uint64_t>(elapsed * options.rate / options.threads);
+    }
+    else {
+        // As fast as the connections take them.
+        due = w.sent_budget + w.senders.size();
+    }
+
+    // Do not catch up with more than one round of the senders at once.
+    if (due > w.sent_budget + w.senders.size()) {
+        w.sent_budget = due - w.senders.size();
+    }
+
+    while (w.sent_budget < due) {
+        bench_conn &bc = *w.senders[w.next_sender];
+        w.next_sender = (w.next_sender + 1) % w.senders.size();
+        w.sent_budget += 1;
+        if (bc.io.fd >= 0) {
+            send_one(w, bc);
+        }
+    }
+}
+
+static void send_one(worker &w, bench_conn &bc)
+{
+    using namespace std;
+
+    if (bc.io.is_congested()) {
+        w.skipped += 1;
+        return;
+    }
+
+    // Pick distinct recipients.
+    int recipients[MAX_TOKENS];
+    int count = (options.pattern == TRAFFIC_MULTICAST) ? options.fanout : 1;
+    for (int i = 0; i < count; ++i) {
+        int user;
+        bool dup;
+        do {
+            if (options.pattern == TRAFFIC_OFFLINE) {
+                user = options.connections + w.rng() % options.offline_users;
+            }
+            else {
+                user = w.rng() % options.connections;
+            }
+            dup = (find(recipients, recipients + i, user) != recipients + i);
+        } while (dup);
+        recipients[i] = user;
+    }
+
+    string body = to_string(now_ns());
+    body.resize(options.msg_size, 'x');
+
+    vector<string> names(count);
+    cmd_token to[MAX_TOKENS];
+    for (int i = 0; i < count; ++i) {
+        names[i] = user_name(recipients[i]);
+        to[i].ptr = names[i].data();
+        to[i].len = names[i].size();
+    }
+
+    string msg;
+    if (options.binary) {
+        append_chat_frame(msg, to, count, body.data(), body.size());
+    }
+    else {
+        msg = "chat";
+        for (int i = 0; i < count; ++i) {
+            msg += " " + names[i];
+        }
+        msg += " \"" + body + "\"\n";
+    }
+
+    int sendlen = static_cast<int>(msg.size());
+    int status = bc.io.send(msg.data(), &sendlen);
+    if (status < 0) {
+        drop_conn(w, bc, false);
+        return;
+    }
+    if (status > 0) {
+        w.skipped += 1;
+        return;
+    }
+
+    w.sent += 1;
+    if (options.pattern == TRAFFIC_OFFLINE) {
+        w.expected_offline += count;
+    }
+    else {
+        w.expected += count;
+    }
+    update_watch(w, bc);
+}
+
+static void drop_conn(worker &w, bench_conn &bc, bool failed)
+{
+    if (bc.state == CONN_CONNECTING || bc.state == CONN_LOGIN) {
+        logins_in_flight -= 1;
+    }
+    if (failed) {
+        w.failed += 1;
+    }
+
+    if (bc.io.fd >= 0) {
+        epoll_ctl(w.epollfd, EPOLL_CTL_DEL, bc.io.fd, NULL);
+        bc.io.close();
+    }
+    bc.state = CONN_IDLE;
+
+    auto it = std::find(w.senders.begin(), w.senders.end(), &bc);
+    if (it != w.senders.end()) {
+        w.senders.erase(it);
+    }
+}
+
+static void update_watch(worker &w, bench_conn &bc)
+{
+    bool want_write = bc.io.want_write();
+    if (bc.io.fd < 0 || (bc.state != CONN_LOGIN && want_write == bc.out_watched)) {
+        return;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = &bc;
+    if (epoll_ctl(w.epollfd, EPOLL_CTL_MOD, bc.io.fd, &ev) == 0) {
+        bc.out_watched = want_write;
+    }
+}
+
+static uint64_t total(std::atomic<uint64_t> worker::*field)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < options.threads; ++i) {
+        sum += (workers[i]->*field).load();
+    }
+    return sum;
+}
+
+static void report(double connect_time, double run_time, double drain_time)
+{
+    using namespace std;
+
+    vector<uint64_t> latencies;
+    for (int i = 0; i < options.threads; ++i) {
+        latencies.insert(latencies.end(), workers[i]->latencies.begin(), workers[i]->latencies.end());
+    }
+    sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        size_t i = min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()));
+        return latencies[i] / 1e6;
+    };
+
+    uint64_t users = options.connections + options.offline_users;
+    printf("connections      %llu logged in, %llu failed, %.2f s, %.0f conn/s\n",
+           static_cast<unsigned long long>(total(&worker::logged_in)), static_cast<unsigned long long>(total(&worker::failed)),
+           connect_time, users / connect_time);
+    printf("sent             %llu msgs in %.2f s, %.0f msg/s, %llu skipped on congestion\n",
+           static_cast<unsigned long long>(total(&worker::sent)), run_time, total(&worker::sent) / run_time,
+           static_cast<unsigned long long>(total(&worker::skipped)));
+    if (options.pattern != TRAFFIC_OFFLINE) {
+        printf("delivered        %llu of %llu, %.0f msg/s\n",
+               static_cast<unsigned long long>(total(&worker::received)), static_cast<unsigned long long>(total(&worker::expected)),
+               total(&worker::received) / run_time);
+        printf("latency          p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+               percentile(0.5), percentile(0.99), percentile(0.999), latencies.empty() ? 0.0 : latencies.back() / 1e6);
+    }
+    else {
+        printf("off-line drain   %llu of %llu in %.2f s, %.0f msg/s\n",
+               static_cast<unsigned long long>(total(&worker::received_offline)), static_cast<unsigned long long>(total(&worker::expected_offline)),
+               drain_time, total(&worker::received_offline) / drain_time);
+    }
+}
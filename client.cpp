@@ -2,12 +2,14 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "commons.hpp"
 #include "my_send_recv.hpp"
+#include "frame.hpp"
 
 extern "C" {
 #include <sys/types.h>
@@ -19,11 +21,50 @@ extern "C" {
 #include <netdb.h>
 #include <errno.h>
 #include <libgen.h>
-#include <pthread.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fcntl.h>
 }
 
+// Bytes of commands collected before they are handed to the socket.
+#define OUT_BATCH (64 << 10)
+// Longest command line accepted.
+#define MAX_LINE (1 << 20)
+// Head start of a connection attempt before the next address is tried.
+#define CONNECT_DELAY_MS 250
+// Deflate level of commands sent with -z.
+#define COMPRESS_LEVEL 6
+
 struct my_send_recv client(-1);
 
+// Negotiate binary framing after login (-b).
+bool use_binary = false;
+// Negotiate compression after login (-z).
+bool use_compress = false;
+// Commands come from a file or pipe (-f): no prompt, and output is not
+// flushed after every line.
+bool batch = false;
+// Where commands are read from.
+int input_fd = STDIN_FILENO;
+// Command bytes read but not run yet.
+std::string input;
+bool input_eof = false;
+// Commands formatted but not handed to the socket yet.
+std::string outgoing;
+// Set once the server confirmed binary framing.
+bool framed = false;
+// Messages still arriving in pieces, by sender ID.
+std::unordered_map<uint32_t, std::string> partial;
+
+/**
+ * A file being sent by `sendfile`, one piece whenever the socket takes it.
+ */
+struct upload
+{
+    std::ifstream in;
+    bool active;
+} file_upload;
+
 /**
  * Descrption: Clean exit when SIGINT received.
  */
@@ -35,22 +76,142 @@ static void sigint_safe_exit(int sig);
  */
 static int login(const char *addr, const char *port, std::string name);
 
+/**
+ * Descrption: Connect to one of the addresses in `res`, racing attempts
+ *             started CONNECT_DELAY_MS apart and keeping the first one
+ *             that succeeds.
+ * Return: Connected non-blocking socket, or -1 if fail.
+ */
+static int connect_any(struct addrinfo *res);
+
 /**
  * Descrption: Check and parse user input and run connect command.
  * Return: 0 if succeed, or -1 if fail.
  */
-static int run_connect(std::vector<std::string> &cmd);
+static int run_connect(const parsed_cmd &cmd);
 
 /**
- * Descrption: Send chatting.
+ * Descrption: Send chatting, to users with `chat` or to a group with `gchat`.
  * Return: 0 if succeed, or -1 if fail.
  */
-static int run_chat(std::vector<std::string> &cmd, std::string &cmd_orig);
+static int run_chat(const parsed_cmd &cmd);
+
+/**
+ * Descrption: Send group command `create`, `join` or `leave`.
+ * Return: 0 if succeed, 1 if the command is refused, or -1 if fail.
+ */
+static int run_group(const parsed_cmd &cmd);
+
+/**
+ * Descrption: Ask the server for its metrics.
+ * Return: 0 if succeed, 1 if the command is refused, or -1 if fail.
+ */
+static int run_stats();
+
+/**
+ * Descrption: Send text command `line`, as a command frame with binary
+ *             framing.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_command(const std::string &line);
+
+/**
+ * Descrption: Send the contents of a file as one chat message, piece by piece.
+ * Return: 0 if succeed, 1 if the command is refused, or -1 if fail.
+ */
+static int run_sendfile(const parsed_cmd &cmd);
+
+/**
+ * Descrption: Send the next pieces of the file being sent, as long as the
+ *             socket is not congested.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int continue_upload();
+
+/**
+ * Descrption: Queue `msg` for the server. Commands are collected and handed
+ *             to the socket in batches by flush_outgoing().
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_raw(const std::string &msg);
+
+/**
+ * Descrption: Hand the collected commands to the socket.
+ * Return: 0 if succeed, 1 if the socket is congested and they are kept, or
+ *         -1 if fail.
+ */
+static int flush_outgoing();
+
+/**
+ * Descrption: Event loop over the command input and the server connection.
+ * Return: 0 after `bye` or the end of the input, or -1 if the connection
+ *         failed.
+ */
+static int run_loop();
+
+/**
+ * Descrption: Run every complete command line read so far, while the
+ *             connection takes more.
+ * Return: 0 to go on, 1 after `bye`, or -1 if fail.
+ */
+static int run_input();
+
+/**
+ * Descrption: Run one command line.
+ * Return: 0 to go on, 1 after `bye`, or -1 if fail.
+ */
+static int run_line(const std::string &line);
+
+/**
+ * Descrption: Read from the server once and print every complete message.
+ * Return: 0 if succeed, or -1 if the connection is closed or broken.
+ */
+static int serve_server();
 
-void *print_msg(void *);
+/**
+ * Descrption: Print message `msg` of `len` bytes received from the server.
+ * Return: 0 if succeed, or -1 if the message is invalid.
+ */
+static int print_msg(char *msg, int len);
 
-int main()
+/**
+ * Descrption: Print a chat message received from the server.
+ */
+static void print_chat(bool offline, time_t msg_time, const std::string &from, const std::string &group, const std::string &msg);
+
+/**
+ * Descrption: Print `line` from the server, above the prompt unless in
+ *             batch mode.
+ */
+static void print_line(const std::string &line);
+
+int main(int argc, char *argv[])
 {
+    int opt;
+    while ((opt = getopt(argc, argv, "bzf:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            use_binary = true;
+            break;
+        case 'z':
+            use_compress = true;
+            break;
+        case 'f':
+            batch = true;
+            if (strcmp(optarg, "-") != 0) {
+                input_fd = open(optarg, O_RDONLY);
+                if (input_fd < 0) {
+                    perror(optarg);
+                    return 1;
+                }
+            }
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-b] [-z] [-f command_file|-]" << std::endl;
+            return 1;
+        }
+    }
+
     // Handle SIGINT
     struct sigaction sa;
     sigemptyset(&sa.sa_mask);
@@ -61,51 +222,191 @@ int main()
 
     using namespace std;
 
-    // Prompt for user command
-    while (true) {
+    if (!batch) {
         cout << "> " << flush;
-        string cmd_orig;
-        getline(cin, cmd_orig);
-        vector<string> cmd = parse_command(cmd_orig);
-        if (cmd.size() == 0) {
-            continue;
-        }
-
-        // Run command
-        if (cmd[0] == "connect") {
-            if (run_connect(cmd) == 0) {
-                pthread_t tid;
-                pthread_create(&tid, NULL, print_msg, NULL);
+    }
+
+    int status = run_loop();
+
+    // Clean exit
+    if (client.fd > 2) {
+        client.close();
+    }
+
+    if (status < 0) {
+        return 1;
+    }
+
+    cout << "Goodbye." << endl;
+    return 0;
+}
+
+static int run_loop()
+{
+    using namespace std;
+
+    while (true) {
+        // Take more commands only while the connection keeps up.
+        bool want_input = !input_eof && !file_upload.active && outgoing.size() < OUT_BATCH && !client.is_congested();
+
+        struct pollfd fds[2];
+        int nfds = 0;
+        if (want_input) {
+            fds[nfds].fd = input_fd;
+            fds[nfds].events = POLLIN;
+            ++nfds;
+        }
+        if (client.fd > 2) {
+            fds[nfds].fd = client.fd;
+            fds[nfds].events = POLLIN | ((client.want_write() || !outgoing.empty()) ? POLLOUT : 0);
+            ++nfds;
+        }
+        if (nfds == 0) {
+            // Input ended and there is no connection to wait for.
+            return 0;
+        }
+
+        if (batch) {
+            cout << flush;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("poll");
+            return -1;
         }
-        else if (cmd[0] == "chat") {
-            if (run_chat(cmd, cmd_orig) < 0) {
-                break;
+
+        for (int i = 0; i < nfds; ++i) {
+            if (fds[i].fd == client.fd && (fds[i].revents & POLLOUT)) {
+                if (client.flush() < 0 || flush_outgoing() < 0 || continue_upload() < 0) {
+                    perror("my_flush");
+                    return -1;
+                }
+            }
+            if (fds[i].fd == client.fd && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                if (serve_server() < 0) {
+                    return -1;
+                }
+            }
+            if (fds[i].fd == input_fd && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                char buf[OUT_BATCH];
+                ssize_t n = read(input_fd, buf, sizeof (buf));
+                if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                    perror("read");
+                    return -1;
+                }
+                if (n == 0) {
+                    input_eof = true;
+                }
+                input.append(buf, (n > 0) ? n : 0);
             }
         }
-        else if (cmd[0] == "help") {
-            cout << "Available commands:" << endl;
-            cout << endl;
-            cout << "connect <IP> <port> <username>" << endl;
-            cout << "chat <user>[ user[ user]...] \"message\"" << endl;
-            cout << "bye" << endl;
-            cout << endl;
+
+        int status = run_input();
+        if (status != 0) {
+            if (status > 0 && client.fd > 2) {
+                // Everything typed before `bye` still goes out.
+                int flags = fcntl(client.fd, F_GETFL, 0);
+                fcntl(client.fd, F_SETFL, flags & ~O_NONBLOCK);
+                while (client.flush() == 1 || flush_outgoing() == 1) {
+                }
+            }
+            return (status > 0) ? 0 : -1;
         }
-        else if (cmd[0] == "bye" || cmd[0] == "exit") {
-            break;
+        if (flush_outgoing() < 0) {
+            return -1;
         }
-        else {
-            cout << "Invalid command." << endl;
+    }
+}
+
+static int run_input()
+{
+    using namespace std;
+
+    size_t pos = 0;
+    int status = 0;
+    while (status == 0 && !file_upload.active && outgoing.size() < OUT_BATCH && !client.is_congested()) {
+        size_t end = input.find('\n', pos);
+        if (end == string::npos) {
+            if (input.size() - pos > MAX_LINE) {
+                cout << "Command is too long." << endl;
+                pos = input.size();
+                continue;
+            }
+            if (!input_eof || pos == input.size()) {
+                break;
+            }
+            // The last line of the input has no newline.
+            end = input.size();
         }
 
+        status = run_line(input.substr(pos, end - pos));
+        pos = min(end + 1, input.size());
+        if (!batch) {
+            cout << "> " << flush;
+        }
     }
+    input.erase(0, pos);
 
-    // Clean exit
-    if (client.fd > 2) {
-        client.close();
+    if (status == 0 && input_eof && input.empty() && !file_upload.active) {
+        // The end of the input works like `bye`.
+        return 1;
+    }
+
+    return status;
+}
+
+static int run_line(const std::string &line)
+{
+    using namespace std;
+
+    parsed_cmd cmd;
+    if (tokenize_command(line.data(), line.size(), cmd) < 0) {
+        cout << "Invalid command." << endl;
+        return 0;
+    }
+    if (cmd.count == 0) {
+        return 0;
+    }
+
+    // Run command
+    if (cmd.words[0] == "connect") {
+        run_connect(cmd);
+    }
+    else if (cmd.words[0] == "chat" || cmd.words[0] == "gchat") {
+        return (run_chat(cmd) < 0) ? -1 : 0;
+    }
+    else if (cmd.words[0] == "sendfile") {
+        return (run_sendfile(cmd) < 0) ? -1 : 0;
+    }
+    else if (cmd.words[0] == "create" || cmd.words[0] == "join" || cmd.words[0] == "leave") {
+        return (run_group(cmd) < 0) ? -1 : 0;
+    }
+    else if (cmd.words[0] == "stats") {
+        return (run_stats() < 0) ? -1 : 0;
+    }
+    else if (cmd.words[0] == "help") {
+        cout << "Available commands:" << endl;
+        cout << endl;
+        cout << "connect <IP> <port> <username>" << endl;
+        cout << "chat <user>[ user[ user]...] \"message\"" << endl;
+        cout << "sendfile <user>[ user[ user]...] \"path\"" << endl;
+        cout << "create <group>" << endl;
+        cout << "join <group>" << endl;
+        cout << "leave <group>" << endl;
+        cout << "gchat <group> \"message\"" << endl;
+        cout << "stats" << endl;
+        cout << "bye" << endl;
+        cout << endl;
+    }
+    else if (cmd.words[0] == "bye" || cmd.words[0] == "exit") {
+        return 1;
+    }
+    else {
+        cout << "Invalid command." << endl;
     }
 
-    cout << "Goodbye." << endl;
     return 0;
 }
 
@@ -120,6 +421,8 @@ static void sigint_safe_exit(int sig)
 
 static int login(const char *addr, const char *port, std::string name)
 {
+    using namespace std;
+
     // Resolve hostname and connect
     struct addrinfo hints = {};
     struct addrinfo *res;
@@ -127,87 +430,179 @@ static int login(const char *addr, const char *port, std::string name)
     hints.ai_socktype = SOCK_STREAM;
     int status = getaddrinfo(addr, port, &hints, &res);
     if (status != 0) {
-        std::cerr << gai_strerror(status) << std::endl;
+        cerr << gai_strerror(status) << endl;
         return -1;
     }
 
-    int sockfd;
-    struct addrinfo *p;
-    for (p = res; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd > 0) {
-            if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break;
-            }
-
-            perror("connect");
-            close(sockfd);
-            sockfd = 0;
-            continue;
-        }
-
-        perror("socket");
-    }
-
+    int sockfd = connect_any(res);
     freeaddrinfo(res);
-
-    if (p == NULL) {
+    if (sockfd < 0) {
         return -1;
     }
 
     client.fd = sockfd;
 
-    std::string login_cmd = "user " + name + "\n";
+    // From now on nothing blocks. Commands pile up in the output queue up
+    // to 4 MiB before the client stops reading more.
+    if (client.set_nonblocking(4 << 20, 1 << 20, OVERFLOW_SPILL) < 0) {
+        perror("set_nonblocking");
+        client.close();
+        return -1;
+    }
+
+    // One exchange: the server runs `compress` and `binary` right after a
+    // successful login, and ignores them if it refused the name. Everything
+    // after `compress` is deflated.
+    string login_cmd = "user " + name + "\n";
+    if (use_compress) {
+        login_cmd += "compress\n";
+    }
     int len = static_cast<int>(login_cmd.size());
-    status = client.send(login_cmd.c_str(), &len);
-    if (status < 0) {
+    if (client.send(login_cmd.c_str(), &len, MSG_NOSIGNAL) < 0 || (use_compress && client.start_deflate(COMPRESS_LEVEL) < 0)) {
         perror("my_send");
         client.close();
         return -1;
     }
+    if (use_binary) {
+        len = 7;
+        if (client.send("binary\n", &len, MSG_NOSIGNAL) < 0) {
+            perror("my_send");
+            client.close();
+            return -1;
+        }
+    }
 
-    // Read welcome message
-    char welcome_msg[MAX_CMD] = {};
+    // The first line tells whether the login went through.
+    char welcome_msg[MAX_CMD];
     int msglen = static_cast<int>(sizeof (welcome_msg));
-    status = client.recv_cmd(welcome_msg, &msglen);
-    if (status < 0) {
-        perror("my_recv_cmd");
-        client.close();
-        client.fd = -1;
-        return -1;
+    while ((status = client.next_cmd(welcome_msg, &msglen)) < 0) {
+        struct pollfd pfd = { client.fd, static_cast<short>(POLLIN | (client.want_write() ? POLLOUT : 0)), 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            client.close();
+            return -1;
+        }
+
+        if ((pfd.revents & POLLOUT) && client.flush() < 0) {
+            perror("my_flush");
+            client.close();
+            return -1;
+        }
+        int filled = client.fill();
+        if (filled == 0 || (filled < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            cout << "Connection closed by peer." << endl;
+            client.close();
+            return -1;
+        }
+        msglen = static_cast<int>(sizeof (welcome_msg));
     }
-    else if (status > 0) {
-        std::cout << "Invalid command received." << std::endl;
+    if (status > 0) {
+        cout << "Invalid command received." << endl;
         client.close();
-        client.fd = -1;
         return -1;
     }
 
     welcome_msg[msglen - 1] = '\0';
-    std::cout << welcome_msg << std::endl;
+    cout << welcome_msg << endl;
 
-    // test whether connection is closed.
-    const char *peek = "\n";
-    len = 1;
-    status = client.send(peek, &len, MSG_NOSIGNAL);
-    if (status < 0) {
-        if (errno == EPIPE) {
-            std::cout << "Connection closed by peer." << std::endl;
-        }
-        else {
-            perror("my_send");
-        }
+    // The server closes the connection after one of these.
+    string reply = welcome_msg;
+    string taken = " has logged in.";
+    if (reply == "Too many users." || (reply.size() > taken.size() && reply.compare(reply.size() - taken.size(), taken.size(), taken) == 0)) {
         client.close();
-        client.fd = -1;
+        return -1;
+    }
+
+    // Messages that came along with the welcome message.
+    if (serve_server() < 0) {
         return -1;
     }
 
     return 0;
 }
 
-static int run_connect(std::vector<std::string> &cmd)
+static int connect_any(struct addrinfo *res)
 {
-    if (cmd.size() < 4) {
+    using namespace std;
+
+    // Alternate address families, starting with the first one resolved, so
+    // a broken family costs one attempt delay at most.
+    vector<struct addrinfo *> addrs;
+    vector<struct addrinfo *> others;
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        (p->ai_family == res->ai_family ? addrs : others).push_back(p);
+    }
+    for (size_t i = 0; i < others.size(); ++i) {
+        addrs.insert(addrs.begin() + min(2 * i + 1, addrs.size()), others[i]);
+    }
+
+    vector<struct pollfd> attempts;
+    size_t next = 0;
+    int winner = -1;
+    while (winner < 0 && (next < addrs.size() || !attempts.empty())) {
+        // Start the next attempt right away if none is in flight, otherwise
+        // once the current ones had CONNECT_DELAY_MS to complete.
+        if (next < addrs.size()) {
+            struct addrinfo *p = addrs[next++];
+            int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+            if (fd < 0) {
+                perror("socket");
+                continue;
+            }
+            if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+                winner = fd;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                perror("connect");
+                close(fd);
+                continue;
+            }
+            attempts.push_back(pollfd{ fd, POLLOUT, 0 });
+        }
+
+        int nready = poll(attempts.data(), attempts.size(), (next < addrs.size()) ? CONNECT_DELAY_MS : -1);
+        if (nready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < attempts.size() && nready > 0; ) {
+            if (attempts[i].revents == 0) {
+                ++i;
+                continue;
+            }
+
+            int err = 0;
+            socklen_t err_len = sizeof (err);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if (err == 0) {
+                winner = attempts[i].fd;
+                attempts.erase(attempts.begin() + i);
+                break;
+            }
+
+            errno = err;
+            perror("connect");
+            close(attempts[i].fd);
+            attempts.erase(attempts.begin() + i);
+        }
+    }
+
+    // The losers are dropped.
+    for (auto &attempt : attempts) {
+        close(attempt.fd);
+    }
+
+    return winner;
+}
+
+static int run_connect(const parsed_cmd &cmd)
+{
+    if (cmd.count < 4) {
         std::cout << "Invalid command.";
         return -1;
     }
@@ -217,8 +612,10 @@ static int run_connect(std::vector<std::string> &cmd)
         return -1;
     }
 
-    std::cout << "Connecting to " << cmd[1] << ":" << cmd[2] << std::endl;
-    if (login(cmd[1].c_str(), cmd[2].c_str(), cmd[3]) < 0) {
+    std::string host = cmd.words[1].str();
+    std::string port = cmd.words[2].str();
+    std::cout << "Connecting to " << host << ":" << port << std::endl;
+    if (login(host.c_str(), port.c_str(), cmd.words[3].str()) < 0) {
         std::cout << "Fail to login." << std::endl;
         return -1;
     }
@@ -226,7 +623,7 @@ static int run_connect(std::vector<std::string> &cmd)
     return 0;
 }
 
-static int run_chat(std::vector<std::string> &cmd, std::string &cmd_orig)
+static int run_chat(const parsed_cmd &cmd)
 {
     using namespace std;
 
@@ -235,106 +632,325 @@ static int run_chat(std::vector<std::string> &cmd, std::string &cmd_orig)
         return 1;
     }
 
-    if (cmd.size() < 3) {
+    bool to_group = (cmd.words[0] == "gchat");
+    if (cmd.count < 2 || (to_group && cmd.count != 2)) {
         cout << "Please provide receiver and message." << endl;
         return 1;
     }
 
-    size_t msg_start = cmd_orig.find('"', 6);
-    size_t msg_end = msg_start == string::npos ? string::npos : cmd_orig.find('"', msg_start + 1);
-
-    if (msg_start == string::npos || msg_end == string::npos) {
+    if (!cmd.has_msg) {
         cout << "Invalid message." << endl;
         return 1;
     }
 
-    string msg = "chat ";
-    for (unsigned int i = 1; i < cmd.size(); ++i) {
-        if (cmd[i][0] == '"') {
-            break;
+    string msg;
+    if (use_binary) {
+        // A message larger than a frame goes in pieces.
+        size_t overhead = chat_frame_overhead(cmd.words + 1, cmd.count - 1);
+        if (overhead == 0 || overhead > MAX_FRAME) {
+            cout << "Receiver name is too long." << endl;
+            return 1;
+        }
+
+        size_t len = cmd.msg.len;
+        size_t pos = min(len, static_cast<size_t>(MAX_FRAME) - overhead);
+        uint8_t flags = (to_group ? FRAME_GROUP : 0) | ((pos < len) ? FRAME_MORE : 0);
+        append_chat_frame(msg, cmd.words + 1, cmd.count - 1, cmd.msg.ptr, pos, flags);
+        while (pos < len) {
+            size_t piece = min(len - pos, static_cast<size_t>(MAX_FRAME - FRAME_HDR));
+            append_chunk_frame(msg, cmd.msg.ptr + pos, piece, (pos + piece < len) ? FRAME_MORE : 0);
+            pos += piece;
         }
-        msg += cmd[i] + " ";
     }
+    else {
+        msg = cmd.words[0].str() + " ";
+        for (int i = 1; i < cmd.count; ++i) {
+            msg.append(cmd.words[i].ptr, cmd.words[i].len);
+            msg += " ";
+        }
 
-    msg += "\"";
-    msg.append(cmd_orig.begin() + msg_start + 1, cmd_orig.begin() + msg_end);
-    msg += "\"\n";
+        msg += "\"";
+        msg.append(cmd.msg.ptr, cmd.msg.len);
+        msg += "\"\n";
 
-    // Send msg to server
-    int sendlen = static_cast<int>(msg.size());
-    int status = client.send(msg.c_str(), &sendlen);
-    if (status < 0) {
-        perror("my_send");
-        cout << "Send failed. Terminate conneciton." << endl;
+        // The server drops connections sending longer lines.
+        if (msg.size() > MAX_CMD) {
+            cout << "Message is too long; use binary framing (-b) for long messages." << endl;
+            return 1;
+        }
+    }
+
+    return send_raw(msg);
+}
+
+static int run_group(const parsed_cmd &cmd)
+{
+    using namespace std;
+
+    if (client.fd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (cmd.count != 2) {
+        cout << "Please provide one group name." << endl;
+        return 1;
+    }
+
+    return send_command(cmd.words[0].str() + " " + cmd.words[1].str());
+}
+
+static int run_stats()
+{
+    if (client.fd <= 2) {
+        std::cout << "You are not logged in yet." << std::endl;
+        return 1;
+    }
+
+    return send_command("stats");
+}
+
+static int send_command(const std::string &line)
+{
+    std::string msg;
+    if (use_binary) {
+        append_command_frame(msg, line.data(), line.size());
+    }
+    else {
+        msg = line + "\n";
+    }
+
+    return send_raw(msg);
+}
+
+static int run_sendfile(const parsed_cmd &cmd)
+{
+    using namespace std;
+
+    if (client.fd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (!use_binary) {
+        cout << "Sending files needs binary framing (-b)." << endl;
+        return 1;
+    }
+
+    if (cmd.count < 2 || !cmd.has_msg) {
+        cout << "Please provide receiver and file." << endl;
+        return 1;
+    }
+
+    size_t overhead = chat_frame_overhead(cmd.words + 1, cmd.count - 1);
+    if (overhead == 0 || overhead > MAX_FRAME) {
+        cout << "Receiver name is too long." << endl;
+        return 1;
+    }
+
+    ifstream &in = file_upload.in;
+    in.open(cmd.msg.str(), ios::binary);
+    if (!in) {
+        in.clear();
+        cout << "Cannot open " << cmd.msg.str() << "." << endl;
+        return 1;
+    }
+
+    // Only the pieces the socket takes are read; the rest of the file is
+    // sent by continue_upload() as the connection drains.
+    char buf[MAX_FRAME];
+    in.read(buf, MAX_FRAME - overhead);
+    size_t piece = in.gcount();
+    file_upload.active = (in.peek() != EOF);
+
+    string msg;
+    append_chat_frame(msg, cmd.words + 1, cmd.count - 1, buf, piece, file_upload.active ? FRAME_MORE : 0);
+    if (send_raw(msg) < 0) {
         return -1;
     }
+    if (!file_upload.active) {
+        in.close();
+    }
+
+    return continue_upload();
+}
+
+static int continue_upload()
+{
+    while (file_upload.active && outgoing.size() < OUT_BATCH && !client.is_congested()) {
+        std::ifstream &in = file_upload.in;
+        char buf[MAX_FRAME];
+        in.clear();
+        in.read(buf, MAX_FRAME - FRAME_HDR);
+        size_t piece = in.gcount();
+        file_upload.active = (in.peek() != EOF);
+
+        std::string msg;
+        append_chunk_frame(msg, buf, piece, file_upload.active ? FRAME_MORE : 0);
+        if (send_raw(msg) < 0) {
+            return -1;
+        }
+        if (!file_upload.active) {
+            in.close();
+        }
+    }
 
     return 0;
 }
 
-void *print_msg(void *)
+static int send_raw(const std::string &msg)
+{
+    outgoing += msg;
+    return (outgoing.size() >= OUT_BATCH && flush_outgoing() < 0) ? -1 : 0;
+}
+
+static int flush_outgoing()
+{
+    if (outgoing.empty() || client.fd < 0) {
+        return 0;
+    }
+
+    shared_buf msg = make_shared_buf(std::move(outgoing));
+    outgoing.clear();
+    int status = client.send(msg, MSG_NOSIGNAL);
+    if (status > 0) {
+        // Congested; try again once the queue drained.
+        outgoing = *msg;
+    }
+    else if (status < 0) {
+        perror("my_send");
+        std::cout << "Send failed. Terminate conneciton." << std::endl;
+    }
+
+    return status;
+}
+
+static void print_chat(bool offline, time_t msg_time, const std::string &from, const std::string &group, const std::string &msg)
 {
     using namespace std;
 
-    while (true) {
-        if (client.fd < 0) {
-            pthread_exit(NULL);
-        }
+    string time_str = ctime(&msg_time);
+    time_str.pop_back();
+    string sender = group.empty() ? from : from + " in " + group;
+    if (offline) {
+        print_line(time_str + " offline message from " + sender + ": " + msg);
+    }
+    else {
+        print_line(time_str + " " + sender + ": " + msg);
+    }
+}
+
+static void print_line(const std::string &line)
+{
+    if (batch) {
+        std::cout << line << '\n';
+    }
+    else {
+        std::cout << "\r" << line << std::endl << "> " << std::flush;
+    }
+}
+
+static int serve_server()
+{
+    using namespace std;
 
-        char msg_orig[MAX_CMD];
-        int msglen = static_cast<int>(sizeof (msg_orig));
-        int status = client.recv_cmd(msg_orig, &msglen);
+    int status = client.fill();
+    if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("my_recv");
+        return -1;
+    }
+    bool closed = (status == 0);
+
+    // Everything that is buffered, including what came before a close.
+    while (true) {
+        char msg_orig[MAX_FRAME];
+        int msglen = framed ? static_cast<int>(sizeof (msg_orig)) : MAX_CMD;
+        status = framed ? client.next_frame(msg_orig, &msglen) : client.next_cmd(msg_orig, &msglen);
         if (status < 0) {
-            perror("my_recv");
-            pthread_exit(NULL);
-        }
-        else if (status > 0) {
-            if (msglen == 0) {
-                cerr << "Connection closed by peer. Terminate connection." << endl;
-            }
-            else {
-                cerr << "Invalid command received. Terminate connection." << endl;
+            // Inflated input may still wait for room in the buffer.
+            if (client.input_pending() && client.fill() > 0) {
+                continue;
             }
+            break;
+        }
+        if (status > 0 || print_msg(msg_orig, msglen) < 0) {
+            cerr << "Invalid command received. Terminate connection." << endl;
             client.close();
-            exit(1);
+            return -1;
         }
+    }
 
-        msg_orig[msglen - 1] = '\0';
-
-        if (memcmp(msg_orig, "message ", 8) == 0 || memcmp(msg_orig, "offline ", 8) == 0) {
-            vector<string> cmd = parse_command(msg_orig);
+    if (closed) {
+        cerr << "Connection closed by peer. Terminate connection." << endl;
+        client.close();
+        return -1;
+    }
 
-            unsigned int msg_start = 0;
-            unsigned int msg_end = 0;
-            for (unsigned int i = 6; i < sizeof (msg_orig) && msg_orig[i] != '\n'; ++i) {
-                if (msg_orig[i] == '"') {
-                    if (msg_start > 0) {
-                        msg_end = i;
-                        break;
-                    }
-                    msg_start = i;
-                }
-            }
-            if (msg_start == 0 || msg_end == 0) {
-                cout << "Invalid command received. Terminating connection..." << endl;
-                client.close();
-                exit(1);
-            }
+    return 0;
+}
 
-            string msg(msg_orig + msg_start + 1, msg_end - msg_start - 1);
+static int print_msg(char *msg_orig, int msglen)
+{
+    using namespace std;
 
-            time_t msg_time = static_cast<time_t>(stoul(cmd[1]));
-            string time_str = ctime(&msg_time);
-            time_str.pop_back();
-            if (cmd[0] == "offline") {
-                cout << "\r" << time_str << " offline message from " << cmd[2] << ": " << msg << endl << "> " << flush;
-            }
-            else {
-                cout << "\r" << time_str << " " << cmd[2] << ": " << msg << endl << "> " << flush;
+    if (framed) {
+        frame_header hdr;
+        cmd_token from, group, msg;
+        decode_frame_header(msg_orig, hdr);
+        if (hdr.type == FRAME_NOTICE) {
+            // An empty notice is a heartbeat.
+            if (msglen - FRAME_HDR > 1) {
+                print_line(string(msg_orig + FRAME_HDR, msglen - FRAME_HDR));
             }
+            return 0;
+        }
+        if (parse_message_frame(msg_orig, msglen, hdr, from, group, msg) < 0) {
+            return -1;
         }
-        else {
-            cout << "\r" << msg_orig << endl << "> " << flush;
+
+        string &text = partial[hdr.sender];
+        if (!(hdr.flags & FRAME_CONT)) {
+            text.clear();
+        }
+        text.append(msg.ptr, msg.len);
+        if (hdr.flags & FRAME_MORE) {
+            return 0;
+        }
+        if (hdr.flags & FRAME_CUT) {
+            text += " [cut short]";
+        }
+
+        print_chat(hdr.type == FRAME_OFFLINE, static_cast<time_t>(hdr.time), from.str(), group.str(), text);
+        partial.erase(hdr.sender);
+        return 0;
+    }
+
+    msg_orig[msglen - 1] = '\0';
+
+    if (memcmp(msg_orig, "message ", 8) == 0 || memcmp(msg_orig, "offline ", 8) == 0) {
+        parsed_cmd cmd;
+        if (tokenize_command(msg_orig, msglen - 1, cmd) < 0 || cmd.count < 3 || !cmd.has_msg) {
+            return -1;
         }
+
+        time_t msg_time = static_cast<time_t>(strtoul(cmd.words[1].ptr, NULL, 10));
+        // A message to a group names it after the sender.
+        string group = (cmd.count > 3) ? cmd.words[3].str() : string();
+        print_chat(cmd.words[0] == "offline", msg_time, cmd.words[2].str(), group, cmd.msg.str());
+    }
+    else if (msglen == 1) {
+        // Heartbeat
     }
+    else if (strcmp(msg_orig, "Binary framing on.") == 0) {
+        framed = true;
+    }
+    else if (strcmp(msg_orig, "Compression on.") == 0) {
+        // Last plain line; the rest of the input is deflated.
+        return client.start_inflate();
+    }
+    else {
+        print_line(msg_orig);
+    }
+
+    return 0;
 }
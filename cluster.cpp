@@ -0,0 +1,551 @@
+#include "cluster.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+}
+
+static uint64_t clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void append_frame(std::string &out, uint8_t type, const char *data, size_t len)
+{
+    uint32_t n = htonl(static_cast<uint32_t>(len));
+    out.append(reinterpret_cast<const char *>(&n), 4);
+    out.push_back(static_cast<char>(type));
+    out.append(data, len);
+}
+
+static uint32_t frame_length(const std::string &buf, size_t pos)
+{
+    uint32_t n;
+    memcpy(&n, buf.data() + pos, 4);
+    return ntohl(n);
+}
+
+static int split_address(const std::string &address, std::string &host, std::string &port)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        return -1;
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return 0;
+}
+
+/**
+ * Description: Raw bytes of the IP address in `sa`, IPv4-mapped IPv6
+ *              addresses as IPv4.
+ */
+static std::string ip_bytes(const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *in = reinterpret_cast<const struct sockaddr_in *>(sa);
+        return std::string(reinterpret_cast<const char *>(&in->sin_addr), sizeof (in->sin_addr));
+    }
+    if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = reinterpret_cast<const struct sockaddr_in6 *>(sa);
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            return std::string(reinterpret_cast<const char *>(&in6->sin6_addr) + 12, 4);
+        }
+        return std::string(reinterpret_cast<const char *>(&in6->sin6_addr), sizeof (in6->sin6_addr));
+    }
+    return std::string();
+}
+
+/**
+ * Description: Whether `a` and `b` are equal, in a time that does not tell
+ *              where they differ.
+ */
+static bool same_secret(const std::string &a, const char *b, size_t len)
+{
+    if (a.size() != len) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; ++i) {
+        diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+static void tune_socket(int fd)
+{
+    // Chats are small; do not hold them back for coalescing.
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on));
+}
+
+cluster::cluster()
+: self_id(0), listenfd(-1), wakefd(-1), on_frame(NULL), on_link(NULL), log(NULL)
+{
+
+}
+
+int cluster::start(int self, const std::vector<std::string> &nodes, const std::string &key, link_receiver receiver, link_event event, logger &event_log)
+{
+    using namespace std;
+
+    if (self < 0 || static_cast<size_t>(self) >= nodes.size()) {
+        return -1;
+    }
+
+    self_id = self;
+    secret = key;
+    on_frame = receiver;
+    on_link = event;
+    log = &event_log;
+
+    links.resize(nodes.size());
+    queued = std::vector<std::atomic<size_t>>(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        link &l = links[i];
+        l.fd = -1;
+        l.node = static_cast<int>(i);
+        l.connecting = false;
+        l.up = false;
+        l.out_pos = 0;
+        l.retry_at = 0;
+        if (split_address(nodes[i], l.host, l.port) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // Connections claiming to be this node must come from one of these.
+        struct addrinfo hints = {}, *res;
+        hints.ai_socktype = SOCK_STREAM;
+        if (static_cast<int>(i) != self && getaddrinfo(l.host.c_str(), NULL, &hints, &res) == 0) {
+            for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+                l.addrs.push_back(ip_bytes(ai->ai_addr));
+            }
+            freeaddrinfo(res);
+        }
+    }
+
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(links[self].host.c_str(), links[self].port.c_str(), &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int yes = 1;
+    listenfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (listenfd < 0 || setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) < 0 ||
+    bind(listenfd, res->ai_addr, res->ai_addrlen) < 0 || listen(listenfd, SOMAXCONN) < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0 || pthread_create(&tid, NULL, cluster_main, this) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int cluster::send(int node, uint8_t type, const std::string &payload)
+{
+    if (node < 0 || node >= size() || node == self_id) {
+        return 0;
+    }
+
+    // Counted until written, so the caller learns of a drop right away.
+    size_t len = LINK_HDR + payload.size();
+    if (queued[node].fetch_add(len) + len > LINK_QUEUE_MAX) {
+        queued[node].fetch_sub(len);
+        log->log(LOG_WARN, "Output for node %u is over its limit. Dropping a frame.", std::string(), NULL, node);
+        return -1;
+    }
+
+    outgoing *o = new outgoing{ node, std::string(), NULL };
+    append_frame(o->data, type, payload.data(), payload.size());
+    if (outbox.push(o)) {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+
+    return 0;
+}
+
+void cluster::send_all(uint8_t type, const std::string &payload)
+{
+    for (int node = 0; node < size(); ++node) {
+        send(node, type, payload);
+    }
+}
+
+int cluster::home_of(const std::string &name) const
+{
+    if (!enabled()) {
+        return self_id;
+    }
+
+    // FNV-1a; every node must agree on it.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name.size(); ++i) {
+        hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+    }
+    return static_cast<int>(hash % links.size());
+}
+
+void *cluster::cluster_main(void *arg)
+{
+    static_cast<cluster *>(arg)->run();
+    return NULL;
+}
+
+void cluster::run()
+{
+    using namespace std;
+
+    vector<struct pollfd> fds;
+    vector<int> owners; // node of each entry of `fds`, or -1 - index in `pending`
+    while (true) {
+        uint64_t now = clock_ms();
+        int timeout = -1;
+        for (int node = 0; node < self_id; ++node) {
+            link &l = links[node];
+            if (l.fd < 0 && now >= l.retry_at) {
+                connect_link(node, now);
+            }
+            if (l.fd < 0) {
+                int wait = static_cast<int>(l.retry_at - now);
+                timeout = (timeout < 0 || wait < timeout) ? wait : timeout;
+            }
+        }
+
+        fds.clear();
+        owners.clear();
+        fds.push_back(pollfd{ listenfd, POLLIN, 0 });
+        fds.push_back(pollfd{ wakefd, POLLIN, 0 });
+        for (int node = 0; node < size(); ++node) {
+            const link &l = links[node];
+            if (l.fd >= 0) {
+                bool want_write = l.connecting || l.out_pos < l.out.size();
+                fds.push_back(pollfd{ l.fd, static_cast<short>(POLLIN | (want_write ? POLLOUT : 0)), 0 });
+                owners.push_back(node);
+            }
+        }
+        for (size_t i = 0; i < pending.size(); ++i) {
+            fds.push_back(pollfd{ pending[i].fd, POLLIN, 0 });
+            owners.push_back(-1 - static_cast<int>(i));
+        }
+
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                return;
+            }
+            continue;
+        }
+        now = clock_ms();
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(wakefd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+                perror("read");
+            }
+            take_outbox();
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                tune_socket(fd);
+                link l = link();
+                l.fd = fd;
+                l.node = -1;
+                pending.push_back(l);
+            }
+        }
+
+        // Entries of `pending` are removed back to front.
+        for (size_t i = fds.size(); i-- > 2; ) {
+            int owner = owners[i - 2];
+            short revents = fds[i].revents;
+            if (owner < 0) {
+                size_t index = static_cast<size_t>(-1 - owner);
+                link &p = pending[index];
+                if (revents == 0) {
+                    continue;
+                }
+
+                // The first frame names the node; anything else is dropped.
+                int status = read_frames(p, -1);
+                if (status < 0) {
+                    close(p.fd);
+                    pending.erase(pending.begin() + index);
+                }
+                else if (status > 0) {
+                    adopt(p);
+                    pending.erase(pending.begin() + index);
+                }
+                continue;
+            }
+
+            link &l = links[owner];
+            if (l.fd != fds[i].fd) {
+                continue;
+            }
+            if (l.connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof (err);
+                getsockopt(l.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    link_lost(owner, now);
+                    continue;
+                }
+                l.connecting = false;
+                l.up = true;
+                log->log(LOG_INFO, "Link to node %u is up.", string(), NULL, owner);
+                on_link(owner, true);
+            }
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && read_frames(l, owner) < 0) {
+                link_lost(owner, now);
+                continue;
+            }
+            if ((revents & POLLOUT) && write_out(l) < 0) {
+                link_lost(owner, now);
+            }
+        }
+    }
+}
+
+void cluster::connect_link(int node, uint64_t now)
+{
+    link &l = links[node];
+    l.retry_at = now + LINK_RETRY_MS;
+
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(l.host.c_str(), l.port.c_str(), &hints, &res) != 0) {
+        return;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (fd < 0 || (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(res);
+        return;
+    }
+    freeaddrinfo(res);
+    tune_socket(fd);
+
+    // The hello goes ahead of everything queued while the link was down.
+    uint32_t id = htonl(static_cast<uint32_t>(self_id));
+    std::string payload(reinterpret_cast<const char *>(&id), sizeof (id));
+    payload += secret;
+    std::string hello;
+    append_frame(hello, LINK_HELLO, payload.data(), payload.size());
+    l.out.insert(0, hello);
+    queued[node].fetch_add(hello.size());
+    l.fd = fd;
+    l.connecting = true;
+}
+
+void cluster::link_lost(int node, uint64_t now)
+{
+    link &l = links[node];
+    close(l.fd);
+    l.fd = -1;
+    l.connecting = false;
+    l.in.clear();
+    l.retry_at = now + LINK_RETRY_MS;
+
+    // Frames written, even in part, are gone with the connection.
+    size_t cut = 0;
+    while (cut < l.out_pos) {
+        cut += LINK_HDR + frame_length(l.out, cut);
+    }
+    // A hello never sent is queued again by the next connect.
+    if (cut == 0 && l.out.size() >= LINK_HDR && static_cast<uint8_t>(l.out[4]) == LINK_HELLO) {
+        cut = LINK_HDR + frame_length(l.out, 0);
+    }
+    queued[node].fetch_sub(cut - l.out_pos);
+    l.out.erase(0, cut);
+    l.out_pos = 0;
+
+    if (l.up) {
+        l.up = false;
+        log->log(LOG_WARN, "Link to node %u is down.", std::string(), NULL, node);
+        on_link(node, false);
+    }
+}
+
+void cluster::adopt(link &p)
+{
+    int node = p.node;
+    link &l = links[node];
+
+    // The node connected again; its old connection is dead.
+    if (l.fd >= 0) {
+        link_lost(node, clock_ms());
+    }
+
+    l.fd = p.fd;
+    l.in.swap(p.in);
+    l.up = true;
+    log->log(LOG_INFO, "Link to node %u is up.", std::string(), NULL, node);
+    on_link(node, true);
+
+    // Frames that came right behind the hello, and output queued meanwhile.
+    if (read_frames(l, node) < 0 || write_out(l) < 0) {
+        link_lost(node, clock_ms());
+    }
+}
+
+void cluster::take_outbox()
+{
+    outgoing *o = outbox.take_all();
+    while (o != NULL) {
+        // Admitted by send() already.
+        links[o->node].out += o->data;
+
+        outgoing *next = o->next;
+        delete o;
+        o = next;
+    }
+
+    // Most of the time the socket takes it right away.
+    for (int node = 0; node < size(); ++node) {
+        link &l = links[node];
+        if (l.up && l.out_pos < l.out.size() && write_out(l) < 0) {
+            link_lost(node, clock_ms());
+        }
+    }
+}
+
+int cluster::read_frames(link &l, int node)
+{
+    char buf[65536];
+    bool closed = false;
+    while (true) {
+        ssize_t n = recv(l.fd, buf, sizeof (buf), 0);
+        if (n > 0) {
+            l.in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        closed = (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+        break;
+    }
+
+    size_t pos = 0;
+    while (l.in.size() - pos >= LINK_HDR) {
+        uint32_t len = frame_length(l.in, pos);
+        if (len > MAX_LINK_FRAME) {
+            return -1;
+        }
+        if (l.in.size() - pos < LINK_HDR + len) {
+            break;
+        }
+        uint8_t type = static_cast<uint8_t>(l.in[pos + 4]);
+        const char *data = l.in.data() + pos + LINK_HDR;
+        pos += LINK_HDR + len;
+
+        if (node >= 0) {
+            if (type != LINK_HELLO) {
+                on_frame(node, type, data, len);
+            }
+            continue;
+        }
+
+        // Not identified yet: the rest of the input goes to the link.
+        uint32_t id;
+        if (type != LINK_HELLO || len < sizeof (id)) {
+            return -1;
+        }
+        memcpy(&id, data, sizeof (id));
+        id = ntohl(id);
+        if (id >= links.size() || static_cast<int>(id) == self_id) {
+            return -1;
+        }
+        if (!same_secret(secret, data + sizeof (id), len - sizeof (id)) || !peer_matches(l.fd, static_cast<int>(id))) {
+            log->log(LOG_WARN, "Refused a link claiming to be node %u.", std::string(), NULL, id);
+            return -1;
+        }
+        l.node = static_cast<int>(id);
+        l.in.erase(0, pos);
+        return closed ? -1 : 1;
+    }
+    l.in.erase(0, pos);
+
+    return closed ? -1 : 0;
+}
+
+bool cluster::peer_matches(int fd, int node) const
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof (addr);
+    if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) < 0) {
+        return false;
+    }
+
+    std::string ip = ip_bytes(reinterpret_cast<const struct sockaddr *>(&addr));
+    for (const auto &a : links[node].addrs) {
+        if (a == ip) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int cluster::write_out(link &l)
+{
+    while (l.out_pos < l.out.size()) {
+        ssize_t n = ::send(l.fd, l.out.data() + l.out_pos, l.out.size() - l.out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        l.out_pos += n;
+        queued[l.node].fetch_sub(n);
+    }
+
+    if (l.out_pos == l.out.size()) {
+        l.out.clear();
+        l.out_pos = 0;
+    }
+    else if (l.out_pos > (1 << 20) && l.out_pos > l.out.size() / 2) {
+        l.out.erase(0, l.out_pos);
+        l.out_pos = 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#ifndef __CLUSTER_HPP__
+#define __CLUSTER_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "mailbox.hpp"
+#include "logger.hpp"
+
+extern "C" {
+#include <pthread.h>
+}
+
+// Link frame header: payload length (4, network byte order), then type (1).
+#define LINK_HDR 5
+// Largest payload accepted on a link.
+#define MAX_LINK_FRAME (1 << 20)
+// Output kept for a node while its link is down; more is dropped.
+#define LINK_QUEUE_MAX (64 << 20)
+// Between attempts to connect to a node.
+#define LINK_RETRY_MS 1000
+// Type of the first frame on a connection, the 4-byte number of the node
+// that opened it followed by the shared secret of the cluster. Other types
+// are up to the user of the cluster.
+#define LINK_HELLO 0
+
+// Called on the cluster thread for every frame received from `node`.
+typedef void (*link_receiver)(int node, uint8_t type, const char *data, size_t len);
+// Called on the cluster thread when the link to `node` comes up or goes down.
+typedef void (*link_event)(int node, bool up);
+
+/**
+ * Links between the server nodes of a cluster. Every pair of nodes keeps one
+ * TCP connection, opened by the node with the higher number, and all traffic
+ * between the two goes over it. A background thread owns the connections: it
+ * reconnects lost links, writes what other threads send() and hands received
+ * frames to a callback. Frames sent to a node whose link is down wait for it
+ * to come back, up to LINK_QUEUE_MAX bytes, and send() refuses the ones past
+ * that; frames being written when a link fails are lost, so a user of the
+ * cluster that must not lose a frame has it acknowledged.
+ *
+ * An accepted connection is trusted only if it comes from an address of the
+ * node its hello names and the hello carries the shared secret.
+ */
+class cluster
+{
+    struct outgoing
+    {
+        int node;
+        std::string data; // whole frames
+        outgoing *next;
+    };
+
+    struct link
+    {
+        int fd;              // -1 while down
+        int node;            // -1 until the hello of an accepted connection
+        bool connecting;     // non-blocking connect in progress
+        bool up;
+        std::string in;
+        std::string out;     // frames not written yet
+        size_t out_pos;      // bytes of `out` written
+        uint64_t retry_at;   // clock of the next connect attempt
+        std::string host;
+        std::string port;
+        std::vector<std::string> addrs; // IP addresses of `host`, raw bytes
+    };
+
+    int self_id;
+    std::string secret;
+    std::vector<link> links;   // by node; the entry of this node is unused
+    std::vector<link> pending; // accepted, before their hello
+    std::vector<std::atomic<size_t>> queued; // bytes not written yet, by node
+    int listenfd;
+    int wakefd;
+    mailbox<outgoing> outbox;
+    link_receiver on_frame;
+    link_event on_link;
+    logger *log;
+    pthread_t tid;
+
+    static void *cluster_main(void *arg);
+    void run();
+    void connect_link(int node, uint64_t now);
+    void link_lost(int node, uint64_t now);
+    void adopt(link &l);
+    void take_outbox();
+    int read_frames(link &l, int node);
+    bool peer_matches(int fd, int node) const;
+    int write_out(link &l);
+
+public:
+    cluster();
+
+    /**
+    * Description: Join the cluster of `nodes` (host:port of the link listener
+    *              of every node, by node number) as node `self`, and start
+    *              the background thread. Every node must be given the same
+    *              `key`, which may be empty.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int start(int self, const std::vector<std::string> &nodes, const std::string &key, link_receiver receiver, link_event event, logger &event_log);
+
+    /**
+    * Description: Queue a frame of `type` for `node`. Any thread may call it.
+    * Return: 0 if succeed, or -1 if the output for `node` is over its limit
+    *         and the frame is dropped.
+    */
+    int send(int node, uint8_t type, const std::string &payload);
+
+    /**
+    * Description: Queue a frame of `type` for every other node.
+    */
+    void send_all(uint8_t type, const std::string &payload);
+
+    /**
+    * Description: Whether this server is part of a cluster at all.
+    */
+    bool enabled() const
+    {
+        return !links.empty();
+    }
+
+    int self() const
+    {
+        return self_id;
+    }
+
+    int size() const
+    {
+        return static_cast<int>(links.size());
+    }
+
+    /**
+    * Description: Node that keeps the off-line messages of user `name`, by a
+    *              hash of the name. This node if there is no cluster.
+    */
+    int home_of(const std::string &name) const;
+};
+
+#endif
@@ -1,12 +1,165 @@
-#include <sstream>
-#include <iterator>
-
 #include "commons.hpp"
 
-std::vector<std::string> parse_command(std::string cmd_str)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Description: Whether `c` separates words (same set as isspace() in the "C"
+ *              locale) or starts a quoted message.
+ */
+static inline bool is_special(unsigned char c)
+{
+    return c == ' ' || c == '"' || (c >= '\t' && c <= '\r');
+}
+
+static const char *find_special_scalar(const char *p, const char *end)
+{
+    while (p < end && !is_special(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+    return p;
+}
+
+#if defined(__SSE2__)
+
+static const char *find_special_sse2(const char *p, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i span = _mm_set1_epi8('\r' - '\t');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+        // '\t' <= c <= '\r' as one unsigned compare: (c - '\t') <= ('\r' - '\t')
+        __m128i off = _mm_sub_epi8(v, tab);
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(off, span), off);
+        __m128i hit = _mm_or_si128(ctl, _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, quote)));
+
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+
+    return find_special_scalar(p, end);
+}
+
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_DISPATCH
+
+__attribute__((target("avx2")))
+static const char *find_special_avx2(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i span = _mm256_set1_epi8('\r' - '\t');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+
+        __m256i off = _mm256_sub_epi8(v, tab);
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(off, span), off);
+        __m256i hit = _mm256_or_si256(ctl, _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, quote)));
+
+        unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(hit));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+
+    return find_special_sse2(p, end);
+}
+
+#endif
+
+static find_special_fn pick_find_special()
 {
-    using namespace std;
+#ifdef HAVE_AVX2_DISPATCH
+    // Runs from a static initializer, possibly before libgcc set up cpu info.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_special_avx2;
+    }
+#endif
+#if defined(__SSE2__)
+    return find_special_sse2;
+#else
+    return find_special_scalar;
+#endif
+}
+
+static const find_special_fn find_special = pick_find_special();
+
+size_t find_special_impls(find_special_fn impls[], const char *names[], size_t max)
+{
+    size_t count = 0;
+    if (count < max) {
+        impls[count] = find_special_scalar;
+        names[count++] = "scalar";
+    }
+#if defined(__SSE2__)
+    if (count < max) {
+        impls[count] = find_special_sse2;
+        names[count++] = "sse2";
+    }
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if (count < max && __builtin_cpu_supports("avx2")) {
+        impls[count] = find_special_avx2;
+        names[count++] = "avx2";
+    }
+#endif
+    return count;
+}
+
+int tokenize_command(const char *cmd, size_t len, parsed_cmd &out)
+{
+    const char *p = cmd;
+    const char *end = cmd + len;
+
+    out.count = 0;
+    out.has_msg = false;
+    out.msg.ptr = end;
+    out.msg.len = 0;
+
+    while (p < end) {
+        // Runs of separators are short; skip them without vector setup.
+        while (p < end && *p != '"' && is_special(static_cast<unsigned char>(*p))) {
+            ++p;
+        }
+        if (p == end) {
+            break;
+        }
+
+        if (*p == '"') {
+            const char *msg_end = reinterpret_cast<const char *>( memchr(p + 1, '"', end - p - 1) );
+            if (msg_end != NULL) {
+                out.msg.ptr = p + 1;
+                out.msg.len = msg_end - p - 1;
+                out.has_msg = true;
+            }
+            break;
+        }
+
+        if (out.count == MAX_TOKENS) {
+            return -1;
+        }
+
+        const char *word_end = find_special(p, end);
+        out.words[out.count].ptr = p;
+        out.words[out.count].len = word_end - p;
+        ++out.count;
+        p = word_end;
+    }
 
-    stringstream ss(cmd_str);
-    return vector<string>(istream_iterator<string>(ss), istream_iterator<string>{});
+    return 0;
 }
@@ -2,10 +2,66 @@
 #define __COMMONS_HPP__
 
 #include <string>
-#include <vector>
+#include <cstring>
 
 #define MAX_CMD 512
+#define MAX_TOKENS (MAX_CMD / 2 + 1)
 
-std::vector<std::string> parse_command(std::string cmd_str);
+/**
+ * A word of a command. Points into the command buffer, which must outlive it.
+ */
+struct cmd_token
+{
+    const char *ptr;
+    size_t len;
 
-#endif
\ No newline at end of file
+    bool operator==(const char *str) const
+    {
+        return strlen(str) == len && memcmp(ptr, str, len) == 0;
+    }
+
+    bool operator!=(const char *str) const
+    {
+        return !(*this == str);
+    }
+
+    std::string str() const
+    {
+        return std::string(ptr, len);
+    }
+};
+
+/**
+ * A tokenized command: the whitespace separated words before the first '"',
+ * and the text between the first two '"' if there is any.
+ */
+struct parsed_cmd
+{
+    cmd_token words[MAX_TOKENS];
+    int count;
+    cmd_token msg;
+    bool has_msg;
+};
+
+/**
+ * Description: Split `len` bytes of `cmd` into words and quoted message
+ *              without allocating or copying. Separators and quotes are
+ *              found with SSE2/AVX2 when the CPU has them.
+ * Return: 0 if succeed, or -1 if there are more than MAX_TOKENS words.
+ */
+int tokenize_command(const char *cmd, size_t len, parsed_cmd &out);
+
+/**
+ * Search for the first separator or quote in [p, end), or `end` if none.
+ */
+typedef const char *(*find_special_fn)(const char *p, const char *end);
+
+/**
+ * Description: Fill `impls` and `names` with the separator searches this
+ *              build has and the CPU can run, the scalar one first, so they
+ *              can be checked against each other.
+ * Return: Number of searches filled in, at most `max`.
+ */
+size_t find_special_impls(find_special_fn impls[], const char *names[], size_t max);
+
+#endif
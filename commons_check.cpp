@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "commons.hpp"
+
+// Longer than two AVX2 vectors plus a partial one.
+#define MAX_LEN 100
+#define RANDOM_ROUNDS 200000
+
+find_special_fn impls[4];
+const char *names[4];
+size_t impl_count;
+unsigned long checks = 0;
+unsigned long failures = 0;
+
+/**
+ * Description: Whether `c` is what find_special() stops at.
+ */
+static bool is_special(unsigned char c)
+{
+    return c == ' ' || c == '"' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * Description: Random byte that is not a separator, often from 0x80-0xff
+ *              where a signed compare would go wrong.
+ */
+static char plain_byte()
+{
+    unsigned char c;
+    do {
+        c = static_cast<unsigned char>(rand() & 0xff);
+    } while (is_special(c));
+    return static_cast<char>(c);
+}
+
+/**
+ * Description: Run every search on `buf` from `start` and compare it with the
+ *              scalar one.
+ */
+static void check(const std::vector<char> &buf, size_t start, const char *what)
+{
+    const char *begin = buf.data() + start;
+    const char *end = buf.data() + buf.size();
+    const char *expect = impls[0](begin, end);
+
+    for (size_t i = 1; i < impl_count; ++i) {
+        ++checks;
+        const char *got = impls[i](begin, end);
+        if (got != expect) {
+            ++failures;
+            if (failures <= 10) {
+                fprintf(stderr, "%s: %s found %ld, scalar %ld (length %zu, start %zu)\n", what, names[i],
+                    static_cast<long>(got - begin), static_cast<long>(expect - begin), buf.size() - start, start);
+            }
+        }
+    }
+}
+
+int main()
+{
+    impl_count = find_special_impls(impls, names, sizeof (impls) / sizeof (impls[0]));
+    srand(1);
+
+    // Every byte value alone at every position, around the vector edges and
+    // in a trailing partial vector.
+    for (size_t len = 1; len <= MAX_LEN; ++len) {
+        for (size_t pos = 0; pos < len; ++pos) {
+            for (int c = 0; c < 256; ++c) {
+                std::vector<char> buf(len);
+                for (auto &b : buf) {
+                    b = plain_byte();
+                }
+                buf[pos] = static_cast<char>(c);
+                for (size_t start = 0; start < 4 && start <= pos; ++start) {
+                    check(buf, start, "single byte");
+                }
+            }
+        }
+    }
+
+    // No separator at all.
+    for (size_t len = 0; len <= MAX_LEN; ++len) {
+        std::vector<char> buf(len);
+        for (auto &b : buf) {
+            b = plain_byte();
+        }
+        check(buf, 0, "no separator");
+    }
+
+    // Random bytes with separators of varying density.
+    for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+        size_t len = static_cast<size_t>(rand() % (MAX_LEN + 1));
+        int density = 1 + rand() % 64;
+        std::vector<char> buf(len);
+        for (auto &b : buf) {
+            b = (rand() % density == 0) ? " \"\t\n\v\f\r"[rand() % 7] : static_cast<char>(rand() & 0xff);
+        }
+        check(buf, (len > 0) ? static_cast<size_t>(rand()) % len : 0, "random");
+    }
+
+    std::string list;
+    for (size_t i = 0; i < impl_count; ++i) {
+        list += std::string(" ") + names[i];
+    }
+    printf("find_special:%s: %lu checks, %lu failures\n", list.c_str(), checks, failures);
+
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+#include "frame.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <arpa/inet.h>
+}
+
+void encode_frame_header(const frame_header &hdr, char *buf)
+{
+    uint16_t recipients = htons(hdr.recipients);
+    uint32_t length = htonl(hdr.length);
+    uint32_t sender = htonl(hdr.sender);
+    uint32_t time = htonl(hdr.time);
+
+    buf[0] = static_cast<char>(hdr.type);
+    buf[1] = static_cast<char>(hdr.flags);
+    memcpy(buf + 2, &recipients, 2);
+    memcpy(buf + 4, &length, 4);
+    memcpy(buf + 8, &sender, 4);
+    memcpy(buf + 12, &time, 4);
+}
+
+void decode_frame_header(const char *buf, frame_header &hdr)
+{
+    uint16_t recipients;
+    uint32_t length, sender, time;
+    memcpy(&recipients, buf + 2, 2);
+    memcpy(&length, buf + 4, 4);
+    memcpy(&sender, buf + 8, 4);
+    memcpy(&time, buf + 12, 4);
+
+    hdr.type = static_cast<uint8_t>(buf[0]);
+    hdr.flags = static_cast<uint8_t>(buf[1]);
+    hdr.recipients = ntohs(recipients);
+    hdr.length = ntohl(length);
+    hdr.sender = ntohl(sender);
+    hdr.time = ntohl(time);
+}
+
+static void append_header(std::string &out, frame_type type, uint8_t flags, uint16_t recipients, size_t length, uint32_t sender, uint32_t time)
+{
+    frame_header hdr = { static_cast<uint8_t>(type), flags, recipients, static_cast<uint32_t>(length), sender, time };
+    char buf[FRAME_HDR];
+    encode_frame_header(hdr, buf);
+    out.append(buf, FRAME_HDR);
+}
+
+size_t chat_frame_overhead(const cmd_token *to, int count)
+{
+    size_t size = FRAME_HDR;
+    for (int i = 0; i < count; ++i) {
+        if (to[i].len > 255) {
+            return 0;
+        }
+        size += 1 + to[i].len;
+    }
+
+    return size;
+}
+
+int append_chat_frame(std::string &out, const cmd_token *to, int count, const char *msg, size_t len, uint8_t flags)
+{
+    size_t overhead = chat_frame_overhead(to, count);
+    if (overhead == 0 || overhead + len > MAX_FRAME) {
+        return -1;
+    }
+
+    append_header(out, FRAME_CHAT, flags, static_cast<uint16_t>(count), overhead - FRAME_HDR + len, 0, 0);
+    for (int i = 0; i < count; ++i) {
+        out += static_cast<char>(to[i].len);
+        out.append(to[i].ptr, to[i].len);
+    }
+    out.append(msg, len);
+
+    return 0;
+}
+
+void append_chunk_frame(std::string &out, const char *msg, size_t len, uint8_t flags)
+{
+    append_header(out, FRAME_CHUNK, flags, 0, len, 0, 0);
+    out.append(msg, len);
+}
+
+void append_command_frame(std::string &out, const char *line, size_t len)
+{
+    append_header(out, FRAME_COMMAND, 0, 0, len, 0, 0);
+    out.append(line, len);
+}
+
+void append_message_frame(std::string &out, frame_type type, uint32_t time, uint32_t sender, const std::string &from, const std::string &group, const char *msg, size_t len, uint8_t flags)
+{
+    size_t from_len = (from.size() > 255) ? 255 : from.size();
+    size_t group_len = (group.size() > 255) ? 255 : group.size();
+    size_t names_len = 1 + from_len + (group.empty() ? 0 : 1 + group_len);
+    append_header(out, type, group.empty() ? flags : (flags | FRAME_GROUP), 0, names_len + len, sender, time);
+    out += static_cast<char>(from_len);
+    out.append(from, 0, from_len);
+    if (!group.empty()) {
+        out += static_cast<char>(group_len);
+        out.append(group, 0, group_len);
+    }
+    out.append(msg, len);
+}
+
+void append_message_text(std::string &out, frame_type type, uint32_t time, const std::string &from, const std::string &group, const char *msg, size_t len)
+{
+    std::string prefix = (type == FRAME_OFFLINE) ? "offline " : "message ";
+    prefix += std::to_string(time);
+    prefix += ' ';
+    prefix += from;
+    if (!group.empty()) {
+        prefix += ' ';
+        prefix += group;
+    }
+    prefix += " \"";
+
+    // Text clients take lines of up to MAX_CMD bytes.
+    size_t room = MAX_CMD - 2 - std::min(prefix.size(), static_cast<size_t>(MAX_CMD - 66));
+
+    size_t pos = 0;
+    do {
+        size_t end = pos + std::min(len - pos, room);
+        const char *newline = static_cast<const char *>(memchr(msg + pos, '\n', end - pos));
+        if (newline != NULL) {
+            end = newline - msg;
+        }
+
+        out += prefix;
+        size_t start = out.size();
+        out.append(msg + pos, end - pos);
+        for (size_t i = start; i < out.size(); ++i) {
+            if (out[i] == '"') {
+                out[i] = '\'';
+            }
+            else if (out[i] == '\r') {
+                out[i] = ' ';
+            }
+        }
+        out += "\"\n";
+
+        pos = (newline != NULL) ? end + 1 : end;
+    } while (pos < len);
+}
+
+void append_notice_frame(std::string &out, const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\n') {
+        --len;
+    }
+
+    append_header(out, FRAME_NOTICE, 0, 0, len, 0, 0);
+    out.append(line, len);
+}
+
+int parse_chat_frame(const char *frame, size_t len, parsed_cmd &out)
+{
+    frame_header hdr;
+    if (len < FRAME_HDR) {
+        return -1;
+    }
+    decode_frame_header(frame, hdr);
+    if (hdr.type != FRAME_CHAT || FRAME_HDR + hdr.length != len || hdr.recipients + 1 > MAX_TOKENS) {
+        return -1;
+    }
+
+    static const char chat[] = "chat";
+    static const char gchat[] = "gchat";
+    if (hdr.flags & FRAME_GROUP) {
+        if (hdr.recipients != 1) {
+            return -1;
+        }
+        out.words[0].ptr = gchat;
+        out.words[0].len = 5;
+    }
+    else {
+        out.words[0].ptr = chat;
+        out.words[0].len = 4;
+    }
+    out.count = 1;
+
+    size_t pos = FRAME_HDR;
+    for (int i = 0; i < hdr.recipients; ++i) {
+        if (pos >= len || static_cast<uint8_t>(frame[pos]) > len - pos - 1) {
+            return -1;
+        }
+        size_t name_len = static_cast<uint8_t>(frame[pos]);
+        out.words[out.count].ptr = frame + pos + 1;
+        out.words[out.count].len = name_len;
+        out.count += 1;
+        pos += 1 + name_len;
+    }
+
+    out.msg.ptr = frame + pos;
+    out.msg.len = len - pos;
+    out.has_msg = true;
+
+    return 0;
+}
+
+int parse_message_frame(const char *frame, size_t len, frame_header &hdr, cmd_token &from, cmd_token &group, cmd_token &msg)
+{
+    if (len < FRAME_HDR + 1) {
+        return -1;
+    }
+    decode_frame_header(frame, hdr);
+    if ((hdr.type != FRAME_MESSAGE && hdr.type != FRAME_OFFLINE) || FRAME_HDR + hdr.length != len) {
+        return -1;
+    }
+
+    size_t from_len = static_cast<uint8_t>(frame[FRAME_HDR]);
+    if (from_len > len - FRAME_HDR - 1) {
+        return -1;
+    }
+    from.ptr = frame + FRAME_HDR + 1;
+    from.len = from_len;
+
+    size_t pos = FRAME_HDR + 1 + from_len;
+    group.ptr = frame + pos;
+    group.len = 0;
+    if (hdr.flags & FRAME_GROUP) {
+        if (pos >= len || static_cast<uint8_t>(frame[pos]) > len - pos - 1) {
+            return -1;
+        }
+        group.ptr = frame + pos + 1;
+        group.len = static_cast<uint8_t>(frame[pos]);
+        pos += 1 + group.len;
+    }
+
+    msg.ptr = frame + pos;
+    msg.len = len - pos;
+
+    return 0;
+}
+
+int frame_to_text(const char *frame, size_t len, std::string &out)
+{
+    frame_header hdr;
+    if (len < FRAME_HDR) {
+        return -1;
+    }
+    decode_frame_header(frame, hdr);
+
+    if (hdr.type == FRAME_NOTICE && FRAME_HDR + hdr.length == len) {
+        out.append(frame + FRAME_HDR, hdr.length);
+        out += '\n';
+        return 0;
+    }
+
+    cmd_token from, group, msg;
+    if (parse_message_frame(frame, len, hdr, from, group, msg) < 0) {
+        return -1;
+    }
+    if (msg.len == 0 && (hdr.flags & FRAME_CONT)) {
+        // Only ends a message; there is no line for it.
+        return 0;
+    }
+
+    append_message_text(out, static_cast<frame_type>(hdr.type), hdr.time, from.str(), group.str(), msg.ptr, msg.len);
+    return 0;
+}
+
+uint8_t frame_flags(const char *frame)
+{
+    return static_cast<uint8_t>(frame[1]);
+}
@@ -0,0 +1,138 @@
+#ifndef __FRAME_HPP__
+#define __FRAME_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#include "commons.hpp"
+
+// Size of a frame header on the wire.
+#define FRAME_HDR 16
+// Largest frame accepted, header included.
+#define MAX_FRAME 2048
+
+/**
+ * Frames of the binary protocol. A logged in client switches to it by sending
+ * the text command `binary`. Everything it sends afterwards is frames; the
+ * server answers "Binary framing on." as a last text line and sends frames
+ * only from then on.
+ */
+enum frame_type
+{
+    FRAME_CHAT = 1,    // client: `recipients` names, then the message
+    FRAME_MESSAGE = 2, // server: sender name, then the message
+    FRAME_OFFLINE = 3, // server: like FRAME_MESSAGE, sent while user was away
+    FRAME_NOTICE = 4,  // server: one line of text, without '\n'
+    FRAME_CHUNK = 5,   // client: next piece of the FRAME_CHAT being sent
+    FRAME_COMMAND = 6  // client: one text protocol command, without '\n'
+};
+
+/**
+ * A message larger than a frame is sent as a sequence of pieces. The server
+ * relays every piece on its own, as a message frame with the same sender, so
+ * pieces of different senders may interleave.
+ */
+enum frame_flag
+{
+    FRAME_MORE = 1, // more pieces of this message follow
+    FRAME_CONT = 2, // continues the previous piece from the same sender
+    FRAME_CUT = 4,  // last piece of a message cut short by the server
+    FRAME_GROUP = 8 // chat: the one recipient is a group; message: the sender
+                    // name is followed by the group name
+};
+
+/**
+ * Fixed size frame header, followed by `length` bytes of payload. Integers
+ * are in network byte order on the wire. A name in the payload is one length
+ * byte followed by the name.
+ */
+struct frame_header
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t recipients;
+    uint32_t length;
+    uint32_t sender; // user ID of the sender
+    uint32_t time;   // seconds since the epoch
+};
+
+void encode_frame_header(const frame_header &hdr, char *buf);
+void decode_frame_header(const char *buf, frame_header &hdr);
+
+/**
+ * Description: Size of a FRAME_CHAT frame for recipients `to` without its
+ *              message.
+ * Return: Size in bytes, or 0 if a name is too long.
+ */
+size_t chat_frame_overhead(const cmd_token *to, int count);
+
+/**
+ * Description: Append a FRAME_CHAT frame for recipients `to` to `out`.
+ * Return: 0 if succeed, or -1 if a name or the frame is too long.
+ */
+int append_chat_frame(std::string &out, const cmd_token *to, int count, const char *msg, size_t len, uint8_t flags = 0);
+
+/**
+ * Description: Append a FRAME_CHUNK frame holding `len` bytes of `msg`, at
+ *              most MAX_FRAME - FRAME_HDR, to `out`.
+ */
+void append_chunk_frame(std::string &out, const char *msg, size_t len, uint8_t flags);
+
+/**
+ * Description: Append a FRAME_COMMAND frame holding text command `line` to
+ *              `out`.
+ */
+void append_command_frame(std::string &out, const char *line, size_t len);
+
+/**
+ * Description: Append a FRAME_MESSAGE or FRAME_OFFLINE frame to `out`. A
+ *              message to a group names it in `group`, otherwise it is empty.
+ */
+void append_message_frame(std::string &out, frame_type type, uint32_t time, uint32_t sender, const std::string &from, const std::string &group, const char *msg, size_t len, uint8_t flags = 0);
+
+/**
+ * Description: Append the text protocol lines of a chat message to `out`.
+ *              A line holds no newline and at most MAX_CMD bytes, so `msg`
+ *              is split at newlines and where a line is full. Quotes cannot
+ *              be expressed there and are replaced.
+ */
+void append_message_text(std::string &out, frame_type type, uint32_t time, const std::string &from, const std::string &group, const char *msg, size_t len);
+
+/**
+ * Description: Append a FRAME_NOTICE frame holding `line` to `out`. A
+ *              trailing '\n' is not copied.
+ */
+void append_notice_frame(std::string &out, const char *line, size_t len);
+
+/**
+ * Description: Split FRAME_CHAT `frame` of `len` bytes into a command like
+ *              tokenize_command() does for `chat <user>... "<msg>"`, or for
+ *              `gchat <group> "<msg>"` if it goes to a group. The tokens point
+ *              into `frame`.
+ * Return: 0 if succeed, or -1 if the frame is malformed.
+ */
+int parse_chat_frame(const char *frame, size_t len, parsed_cmd &out);
+
+/**
+ * Description: Split FRAME_MESSAGE or FRAME_OFFLINE `frame` of `len` bytes
+ *              into its header, sender name, group name (empty if none) and
+ *              message. The tokens point into `frame`.
+ * Return: 0 if succeed, or -1 if the frame is malformed.
+ */
+int parse_message_frame(const char *frame, size_t len, frame_header &hdr, cmd_token &from, cmd_token &group, cmd_token &msg);
+
+/**
+ * Description: Append the text protocol line of frame `frame` of `len` bytes
+ *              to `out`.
+ * Return: 0 if succeed, or -1 if the frame is malformed or has no text form.
+ */
+int frame_to_text(const char *frame, size_t len, std::string &out);
+
+/**
+ * Description: Flags of the frame starting at `frame`.
+ */
+uint8_t frame_flags(const char *frame);
+
+#endif
@@ -0,0 +1,299 @@
+#include "handover.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+static int unix_addr(const char *path, struct sockaddr_un &addr)
+{
+    addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+int handover_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (unix_addr(path, addr) < 0) {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, reinterpret_cast<const struct sockaddr *>(&addr), sizeof (addr)) < 0 || listen(sock, 1) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+int handover_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (unix_addr(path, addr) < 0) {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, reinterpret_cast<const struct sockaddr *>(&addr), sizeof (addr)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+static int write_all(int sock, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int read_all(int sock, char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(sock, data, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            errno = (n == 0) ? EPIPE : errno;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int send_handover(int sock, const std::vector<int> &fds, const std::string &state)
+{
+    // At least one batch, so the receiver always finds a header.
+    size_t pos = 0;
+    do {
+        size_t count = std::min(fds.size() - pos, static_cast<size_t>(HANDOVER_FDS));
+        uint32_t hdr[2] = { htonl(static_cast<uint32_t>(count)), htonl(pos + count < fds.size() ? 1 : 0) };
+
+        struct iovec iov;
+        iov.iov_base = hdr;
+        iov.iov_len = sizeof (hdr);
+        char control[CMSG_SPACE(sizeof (int) * HANDOVER_FDS)] = {};
+        struct msghdr mh = {};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        if (count > 0) {
+            mh.msg_control = control;
+            mh.msg_controllen = CMSG_SPACE(sizeof (int) * count);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof (int) * count);
+            memcpy(CMSG_DATA(cmsg), fds.data() + pos, sizeof (int) * count);
+        }
+
+        // The header is tiny; a short write would split it from its
+        // descriptors, so it is not retried.
+        ssize_t n;
+        while ((n = sendmsg(sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+        }
+        if (n != static_cast<ssize_t>(sizeof (hdr))) {
+            errno = (n < 0) ? errno : EIO;
+            return -1;
+        }
+        pos += count;
+    } while (pos < fds.size());
+
+    uint64_t len = state.size();
+    uint32_t len_buf[2] = { htonl(static_cast<uint32_t>(len >> 32)), htonl(static_cast<uint32_t>(len)) };
+    if (write_all(sock, reinterpret_cast<const char *>(len_buf), sizeof (len_buf)) < 0) {
+        return -1;
+    }
+    return write_all(sock, state.data(), state.size());
+}
+
+int recv_handover(int sock, std::vector<int> &fds, std::string &state)
+{
+    bool more = true;
+    while (more) {
+        uint32_t hdr[2];
+        struct iovec iov;
+        iov.iov_base = hdr;
+        iov.iov_len = sizeof (hdr);
+        char control[CMSG_SPACE(sizeof (int) * HANDOVER_FDS)];
+        struct msghdr mh = {};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof (control);
+
+        ssize_t n;
+        while ((n = recvmsg(sock, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+        }
+
+        for (struct cmsghdr *cmsg = (n > 0) ? CMSG_FIRSTHDR(&mh) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+                size_t at = fds.size();
+                fds.resize(at + count);
+                memcpy(fds.data() + at, CMSG_DATA(cmsg), sizeof (int) * count);
+            }
+        }
+
+        if (n != static_cast<ssize_t>(sizeof (hdr)) || (mh.msg_flags & MSG_CTRUNC)) {
+            errno = (n < 0) ? errno : EIO;
+            break;
+        }
+        more = (ntohl(hdr[1]) != 0);
+    }
+
+    uint32_t len_buf[2];
+    if (!more && read_all(sock, reinterpret_cast<char *>(len_buf), sizeof (len_buf)) == 0) {
+        uint64_t len = (static_cast<uint64_t>(ntohl(len_buf[0])) << 32) | ntohl(len_buf[1]);
+        state.resize(len);
+        if (read_all(sock, &state[0], len) == 0) {
+            return 0;
+        }
+    }
+
+    int err = errno;
+    for (auto fd : fds) {
+        close(fd);
+    }
+    fds.clear();
+    errno = err;
+    return -1;
+}
+
+int wait_peer_exit(int sock)
+{
+    // EOF on the socket is not enough: an exiting process closes its
+    // descriptors one by one, so a port it listens on may still be taken.
+    // Its pidfd becomes readable once all are released.
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    int pidfd = -1;
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        pidfd = static_cast<int>(syscall(SYS_pidfd_open, cred.pid, 0));
+    }
+    if (pidfd >= 0) {
+        struct pollfd pfd = { pidfd, POLLIN, 0 };
+        int status;
+        while ((status = poll(&pfd, 1, -1)) < 0 && errno == EINTR) {
+        }
+        close(pidfd);
+        return (status < 0) ? -1 : 0;
+    }
+
+    char byte;
+    ssize_t n;
+    do {
+        n = read(sock, &byte, 1);
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    return (n < 0) ? -1 : 0;
+}
+
+void state_writer::put_u8(uint8_t v)
+{
+    out.push_back(static_cast<char>(v));
+}
+
+void state_writer::put_u32(uint32_t v)
+{
+    uint32_t n = htonl(v);
+    out.append(reinterpret_cast<const char *>(&n), sizeof (n));
+}
+
+void state_writer::put_u64(uint64_t v)
+{
+    put_u32(static_cast<uint32_t>(v >> 32));
+    put_u32(static_cast<uint32_t>(v));
+}
+
+void state_writer::put_str(const std::string &s)
+{
+    put_u32(static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+bool state_reader::take(size_t len)
+{
+    if (bad || in.size() - pos < len) {
+        bad = true;
+        return false;
+    }
+    return true;
+}
+
+uint8_t state_reader::get_u8()
+{
+    if (!take(1)) {
+        return 0;
+    }
+    return static_cast<uint8_t>(in[pos++]);
+}
+
+uint32_t state_reader::get_u32()
+{
+    uint32_t n;
+    if (!take(sizeof (n))) {
+        return 0;
+    }
+    memcpy(&n, in.data() + pos, sizeof (n));
+    pos += sizeof (n);
+    return ntohl(n);
+}
+
+uint64_t state_reader::get_u64()
+{
+    uint64_t high = get_u32();
+    return (high << 32) | get_u32();
+}
+
+std::string state_reader::get_str()
+{
+    size_t len = get_u32();
+    if (!take(len)) {
+        return std::string();
+    }
+    std::string s = in.substr(pos, len);
+    pos += len;
+    return s;
+}
@@ -0,0 +1,97 @@
+#ifndef __HANDOVER_HPP__
+#define __HANDOVER_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Descriptors passed per message; the kernel takes up to SCM_MAX_FD (253).
+#define HANDOVER_FDS 250
+
+/**
+ * Description: Bind a Unix socket at `path` for a successor to connect to,
+ *              replacing whatever file is there.
+ * Return: The listening socket, or -1 if fail.
+ */
+int handover_listen(const char *path);
+
+/**
+ * Description: Connect to the Unix socket at `path` of a running server.
+ * Return: The socket, or -1 if fail (errno ENOENT or ECONNREFUSED if no
+ *         server listens there).
+ */
+int handover_connect(const char *path);
+
+/**
+ * Description: Pass descriptors `fds` and then `state` over Unix socket `sock`.
+ *              The descriptors go in batches of HANDOVER_FDS, each with a
+ *              header of the count and whether more batches follow; the
+ *              state follows the last batch, after its length.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+int send_handover(int sock, const std::vector<int> &fds, const std::string &state);
+
+/**
+ * Description: Receive what send_handover() passed over `sock`. Descriptors
+ *              received before a failure are closed.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+int recv_handover(int sock, std::vector<int> &fds, std::string &state);
+
+/**
+ * Description: Wait until the process at the other end of Unix socket `sock`
+ *              has exited and released its descriptors.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+int wait_peer_exit(int sock);
+
+/**
+ * Appends integers, in network byte order, and strings, after their 4-byte
+ * length, to a state blob.
+ */
+class state_writer
+{
+    std::string &out;
+
+public:
+    explicit state_writer(std::string &out) : out(out)
+    {
+    }
+
+    void put_u8(uint8_t v);
+    void put_u32(uint32_t v);
+    void put_u64(uint64_t v);
+    void put_str(const std::string &s);
+};
+
+/**
+ * Reads back what state_writer wrote. Reading past the end yields zeroes and
+ * empty strings and marks the reader failed.
+ */
+class state_reader
+{
+    const std::string &in;
+    size_t pos;
+    bool bad;
+
+    bool take(size_t len);
+
+public:
+    explicit state_reader(const std::string &in) : in(in), pos(0), bad(false)
+    {
+    }
+
+    uint8_t get_u8();
+    uint32_t get_u32();
+    uint64_t get_u64();
+    std::string get_str();
+
+    bool failed() const
+    {
+        return bad;
+    }
+};
+
+#endif
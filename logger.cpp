@@ -0,0 +1,219 @@
+#include "logger.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+// How long the background thread sleeps when the ring is empty.
+#define LOG_IDLE_US 10000
+
+static const char *level_prefix[] = { "debug: ", "", "warning: ", "error: " };
+
+logger::logger()
+: head(0), tail(0), dropped_count(0), dropped_reported(0), running(false), fd(-1), min_level(LOG_INFO)
+{
+    for (uint64_t i = 0; i < LOG_RING; ++i) {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+int logger::start(int out_fd, log_level level)
+{
+    fd = out_fd;
+    min_level = level;
+    running.store(true);
+
+    if (pthread_create(&tid, NULL, writer_main, this) != 0) {
+        running.store(false);
+        return -1;
+    }
+
+    return 0;
+}
+
+void logger::log(log_level level, const char *fmt, const std::string &text, const struct sockaddr *addr, uint64_t number)
+{
+    if (level < min_level) {
+        return;
+    }
+
+    // Claim the next slot, unless the writer has not freed it yet.
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    record *rec;
+    while (true) {
+        rec = &ring[pos & (LOG_RING - 1)];
+        uint64_t seq = rec->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (seq < pos) {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    rec->format = fmt;
+    rec->level = static_cast<uint8_t>(level);
+    rec->text_len = static_cast<uint8_t>(std::min(text.size(), static_cast<size_t>(LOG_TEXT)));
+    memcpy(rec->text, text.data(), rec->text_len);
+    rec->number = number;
+    rec->family = 0;
+    if (addr != NULL && addr->sa_family == AF_INET) {
+        const struct sockaddr_in &in = reinterpret_cast<const struct sockaddr_in &>(*addr);
+        rec->family = AF_INET;
+        rec->port = ntohs(in.sin_port);
+        memcpy(rec->addr, &in.sin_addr, 4);
+    }
+    else if (addr != NULL && addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 &in6 = reinterpret_cast<const struct sockaddr_in6 &>(*addr);
+        rec->family = AF_INET6;
+        rec->port = ntohs(in6.sin6_port);
+        memcpy(rec->addr, &in6.sin6_addr, 16);
+    }
+
+    rec->seq.store(pos + 1, std::memory_order_release);
+}
+
+void logger::flush()
+{
+    std::unique_lock<std::mutex> lock(drain_mtx, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+
+    std::string out;
+    drain(out);
+    write_out(out);
+}
+
+uint64_t logger::dropped() const
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+void *logger::writer_main(void *arg)
+{
+    logger &lg = *reinterpret_cast<logger *>(arg);
+
+    std::string out;
+    while (lg.running.load(std::memory_order_relaxed)) {
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock(lg.drain_mtx);
+            out.clear();
+            count = lg.drain(out);
+            lg.write_out(out);
+        }
+
+        if (count == 0) {
+            usleep(LOG_IDLE_US);
+        }
+    }
+
+    return NULL;
+}
+
+void logger::format(const record &rec, std::string &out)
+{
+    char addr[INET6_ADDRSTRLEN] = "";
+    if (rec.family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(reinterpret_cast<const struct in6_addr *>(rec.addr))) {
+        // Shown as the IPv4 address it is.
+        inet_ntop(AF_INET, rec.addr + 12, addr, sizeof (addr));
+    }
+    else if (rec.family != 0) {
+        inet_ntop(rec.family, rec.addr, addr, sizeof (addr));
+    }
+
+    out += level_prefix[rec.level];
+    for (const char *p = rec.format; *p != '\0'; ++p) {
+        if (*p != '%' || p[1] == '\0') {
+            out += *p;
+            continue;
+        }
+
+        ++p;
+        switch (*p) {
+        case 's':
+            out.append(rec.text, rec.text_len);
+            break;
+        case 'a':
+            out += addr;
+            break;
+        case 'p':
+            out += std::to_string(rec.port);
+            break;
+        case 'u':
+            out += std::to_string(rec.number);
+            break;
+        default:
+            out += *p;
+            break;
+        }
+    }
+    out += '\n';
+}
+
+size_t logger::drain(std::string &out)
+{
+    size_t count = 0;
+    while (true) {
+        record &rec = ring[tail & (LOG_RING - 1)];
+        if (rec.seq.load(std::memory_order_acquire) != tail + 1) {
+            break;
+        }
+
+        format(rec, out);
+        rec.seq.store(tail + LOG_RING, std::memory_order_release);
+        ++tail;
+        ++count;
+    }
+
+    uint64_t dropped_now = dropped();
+    if (dropped_now != dropped_reported) {
+        out += level_prefix[LOG_WARN] + std::to_string(dropped_now - dropped_reported) + " log records dropped.\n";
+        dropped_reported = dropped_now;
+    }
+
+    return count;
+}
+
+void logger::write_out(const std::string &out)
+{
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = write(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Nowhere to log to; the lines are lost.
+            return;
+        }
+        done += n;
+    }
+}
+
+int parse_log_level(const char *name, log_level &level)
+{
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            level = static_cast<log_level>(i);
+            return 0;
+        }
+    }
+
+    return -1;
+}
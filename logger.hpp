@@ -0,0 +1,103 @@
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <sys/socket.h>
+#include <pthread.h>
+}
+
+// Records the ring holds; a power of two.
+#define LOG_RING 2048
+// Longest text argument kept in a record.
+#define LOG_TEXT 255
+
+enum log_level
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+/**
+ * Asynchronous logger. A thread logging an event only copies its arguments
+ * into a slot of a lock-free ring; a background thread turns the records into
+ * lines and writes them in batches. When the ring is full the record is
+ * dropped and counted, so logging never blocks the caller.
+ *
+ * The format of a record must be a string literal. It is expanded by the
+ * background thread: %s is the text argument, %a the IP address and %p the
+ * port of the address argument, %u the number argument, %% a percent sign.
+ */
+class logger
+{
+    struct record
+    {
+        std::atomic<uint64_t> seq; // ring position it is ready for
+        const char *format;
+        uint8_t level;
+        uint8_t family;            // of the address, 0 if none
+        uint8_t text_len;
+        uint16_t port;             // host byte order
+        uint8_t addr[16];
+        uint64_t number;
+        char text[LOG_TEXT];
+    };
+
+    record ring[LOG_RING];
+    std::atomic<uint64_t> head; // next position to fill
+    uint64_t tail;              // next position to write out
+    std::atomic<uint64_t> dropped_count;
+    uint64_t dropped_reported;
+    std::atomic<bool> running;
+    std::mutex drain_mtx;       // held by whoever consumes the ring
+    int fd;
+    log_level min_level;
+    pthread_t tid;
+
+    static void *writer_main(void *arg);
+    void format(const record &rec, std::string &out);
+    size_t drain(std::string &out);
+    void write_out(const std::string &out);
+
+public:
+    logger();
+
+    /**
+    * Description: Start the background thread writing to `fd`. Records below
+    *              `level` are discarded.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int start(int fd, log_level level);
+
+    /**
+    * Description: Log an event. Does not block and makes no system call.
+    */
+    void log(log_level level, const char *format, const std::string &text = std::string(), const struct sockaddr *addr = NULL, uint64_t number = 0);
+
+    /**
+    * Description: Write out every record logged so far from the calling
+    *              thread. Does nothing if the background thread is writing.
+    */
+    void flush();
+
+    /**
+    * Description: Records dropped because the ring was full.
+    */
+    uint64_t dropped() const;
+};
+
+/**
+ * Description: Parse level name `name` into `level`.
+ * Return: 0 if succeed, or -1 if the name is unknown.
+ */
+int parse_log_level(const char *name, log_level &level);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __MAILBOX_HPP__
+#define __MAILBOX_HPP__
+
+#include <atomic>
+
+/**
+ * Lock-free multi-producer single-consumer queue of intrusive items. `T` must
+ * have a `T *next` member. Any thread may push(); only the owning thread calls
+ * take_all().
+ */
+template <typename T>
+class mailbox
+{
+    std::atomic<T *> head;
+
+public:
+    mailbox() : head(nullptr)
+    {
+    }
+
+    /**
+    * Description: Add `item` to the mailbox.
+    * Return: true if the mailbox was empty before, i.e. the consumer has to
+    *         be woken up; false if a wakeup is already pending.
+    */
+    bool push(T *item)
+    {
+        T *old = head.load(std::memory_order_relaxed);
+        do {
+            item->next = old;
+        } while (!head.compare_exchange_weak(old, item, std::memory_order_release, std::memory_order_relaxed));
+
+        return old == nullptr;
+    }
+
+    /**
+    * Description: Detach every item pushed so far.
+    * Return: List of items in the order they were pushed, or nullptr.
+    */
+    T *take_all()
+    {
+        T *list = head.exchange(nullptr, std::memory_order_acquire);
+
+        // The stack holds newest first; reverse it to keep FIFO order.
+        T *fifo = nullptr;
+        while (list != nullptr) {
+            T *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+
+        return fifo;
+    }
+};
+
+#endif
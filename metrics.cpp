@@ -0,0 +1,93 @@
+#include "metrics.hpp"
+
+#include <cstdio>
+
+extern "C" {
+#include <time.h>
+}
+
+size_t histogram::bucket_of(uint64_t value)
+{
+    if (value < (1u << HIST_SUB_BITS)) {
+        return static_cast<size_t>(value);
+    }
+
+    // The top HIST_SUB_BITS bits below the highest set bit pick the
+    // sub-bucket.
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - HIST_SUB_BITS;
+    size_t sub = static_cast<size_t>(value >> shift) & ((1u << HIST_SUB_BITS) - 1);
+    return (static_cast<size_t>(shift + 1) << HIST_SUB_BITS) + sub;
+}
+
+uint64_t histogram::bucket_max(size_t i)
+{
+    if (i < (1u << HIST_SUB_BITS)) {
+        return i;
+    }
+
+    int shift = static_cast<int>(i >> HIST_SUB_BITS) - 1;
+    uint64_t low = static_cast<uint64_t>((1u << HIST_SUB_BITS) | (i & ((1u << HIST_SUB_BITS) - 1))) << shift;
+    return low + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+void histogram::add_to(histogram_snapshot &snap) const
+{
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        snap.buckets[i] += buckets[i].get();
+    }
+    snap.sum += sum.get();
+}
+
+uint64_t metrics_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static void append_header(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void append_metric(std::string &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    append_header(out, name, type, help);
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+void append_histogram(std::string &out, const char *name, const char *help, const histogram_snapshot &snap, double scale)
+{
+    append_header(out, name, "histogram", help);
+
+    size_t last = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        if (snap.buckets[i] != 0) {
+            last = i;
+        }
+    }
+
+    char line[256];
+    uint64_t count = 0;
+    for (size_t i = 0; i <= last; ++i) {
+        count += snap.buckets[i];
+        snprintf(line, sizeof (line), "%s_bucket{le=\"%.9g\"} %llu\n", name, histogram::bucket_max(i) * scale, static_cast<unsigned long long>(count));
+        out += line;
+    }
+
+    snprintf(line, sizeof (line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n", name, static_cast<unsigned long long>(count),
+    name, snap.sum * scale, name, static_cast<unsigned long long>(count));
+    out += line;
+}
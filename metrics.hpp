@@ -0,0 +1,108 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <string>
+
+// Sub-buckets per power of two of a histogram, as bits.
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+/**
+ * Monotonic counter with a single writer. The owner thread updates it without
+ * a locked instruction; any thread may read it.
+ */
+class counter
+{
+    std::atomic<uint64_t> value;
+
+public:
+    counter() : value(0)
+    {
+    }
+
+    void add(uint64_t n = 1)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t n)
+    {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Counts and sum of histogram values, added up over several histograms.
+ */
+struct histogram_snapshot
+{
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t sum;
+
+    histogram_snapshot() : buckets(), sum(0)
+    {
+    }
+};
+
+/**
+ * Log-linear histogram of non-negative integers with a single writer, like
+ * counter. Values below 2^HIST_SUB_BITS have a bucket each; above, every
+ * power of two is split into 2^HIST_SUB_BITS buckets, so a bucket is at most
+ * 25% wide whatever the magnitude.
+ */
+class histogram
+{
+    counter buckets[HIST_BUCKETS];
+    counter sum;
+
+public:
+    /**
+    * Description: Index of the bucket holding `value`.
+    */
+    static size_t bucket_of(uint64_t value);
+
+    /**
+    * Description: Largest value that falls in bucket `i`.
+    */
+    static uint64_t bucket_max(size_t i);
+
+    void record(uint64_t value)
+    {
+        buckets[bucket_of(value)].add();
+        sum.add(value);
+    }
+
+    /**
+    * Description: Add the current counts of this histogram to `snap`.
+    */
+    void add_to(histogram_snapshot &snap) const;
+};
+
+/**
+ * Description: Current time of the monotonic clock in nanoseconds.
+ */
+uint64_t metrics_clock();
+
+/**
+ * Description: Append counter or gauge `name` to `out` in the Prometheus text
+ *              format. `type` is "counter" or "gauge".
+ */
+void append_metric(std::string &out, const char *name, const char *type, const char *help, uint64_t value);
+
+/**
+ * Description: Append histogram `name` to `out` in the Prometheus text
+ *              format, with values and bucket bounds multiplied by `scale`.
+ *              Buckets above the largest value recorded are left out.
+ */
+void append_histogram(std::string &out, const char *name, const char *help, const histogram_snapshot &snap, double scale = 1);
+
+#endif
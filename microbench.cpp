@@ -0,0 +1,407 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "commons.hpp"
+#include "my_send_recv.hpp"
+#include "frame.hpp"
+#include "offline_store.hpp"
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+}
+
+// Pipelined input written per round of the recv benchmarks.
+#define PIPELINE_CMDS 4096
+// Messages kept in the off-line store for the backlog benchmark.
+#define BACKLOG_MSGS 4096
+
+struct bench_result
+{
+    std::string name;
+    uint64_t iterations;  // per repetition
+    double ns_per_op;     // median of the repetitions
+    double min_ns_per_op;
+    double bytes_per_op;  // 0 if the benchmark does not move bytes
+};
+
+double rep_seconds = 0.2;
+int repetitions = 5;
+const char *filter = NULL;
+std::vector<bench_result> results;
+
+// Keeps results alive so the compiler cannot drop the measured work.
+volatile size_t sink;
+
+/**
+ * Descrption: Current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns();
+
+/**
+ * Descrption: Measure `body`, which runs the benchmarked operation as many
+ *             times as its argument says, and record the result.
+ */
+template <typename F>
+static void run_bench(const char *name, double bytes_per_op, F body);
+
+/**
+ * Descrption: Chat command lines like a client sends them, `count` of them.
+ */
+static std::string pipelined_input(int count);
+
+/**
+ * Descrption: Receive `count` commands from `input` written to a socket,
+ *             with recv_cmd() or with fill() and next_cmd().
+ */
+static void recv_pipelined(const std::string &input, int per_round, uint64_t count, bool use_fill);
+
+/**
+ * Descrption: Print the results as JSON.
+ */
+static void print_json();
+
+int main(int argc, char *argv[])
+{
+    using namespace std;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:r:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            rep_seconds = atof(optarg);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-f name_filter] [-t seconds_per_repetition] [-r repetitions]" << endl;
+            return 1;
+        }
+    }
+    if (repetitions < 1 || rep_seconds <= 0) {
+        cerr << "Need at least one repetition of positive length." << endl;
+        return 1;
+    }
+
+    string input = pipelined_input(PIPELINE_CMDS);
+    double line_bytes = static_cast<double>(input.size()) / PIPELINE_CMDS;
+
+    run_bench("recv_cmd_pipelined", line_bytes, [&](uint64_t n) {
+        recv_pipelined(input, PIPELINE_CMDS, n, false);
+    });
+
+    run_bench("fill_next_cmd_pipelined", line_bytes, [&](uint64_t n) {
+        recv_pipelined(input, PIPELINE_CMDS, n, true);
+    });
+
+    const string short_cmd = "chat bob carol dave \"" + string(64, 'm') + "\"";
+    run_bench("tokenize_chat_64", short_cmd.size(), [&](uint64_t n) {
+        parsed_cmd cmd;
+        for (uint64_t i = 0; i < n; ++i) {
+            tokenize_command(short_cmd.data(), short_cmd.size(), cmd);
+            sink = cmd.msg.len;
+        }
+    });
+
+    const string long_cmd = "chat bob \"" + string(480, 'm') + "\"";
+    run_bench("tokenize_chat_480", long_cmd.size(), [&](uint64_t n) {
+        parsed_cmd cmd;
+        for (uint64_t i = 0; i < n; ++i) {
+            tokenize_command(long_cmd.data(), long_cmd.size(), cmd);
+            sink = cmd.msg.len;
+        }
+    });
+
+    // What relay_piece() builds for every message: text line, frame and
+    // stored frame, each in a shared buffer.
+    const string from = "alice";
+    const string msg(64, 'm');
+    const string quoted = "say \"hi\"\nto " + string(52, 'm');
+    run_bench("format_text_64", msg.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            string text;
+            append_message_text(text, FRAME_MESSAGE, 1700000000u + i, from, string(), msg.data(), msg.size());
+            sink = text.size();
+        }
+    });
+
+    run_bench("format_text_quotes_64", quoted.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            string text;
+            append_message_text(text, FRAME_MESSAGE, 1700000000u + i, from, string(), quoted.data(), quoted.size());
+            sink = text.size();
+        }
+    });
+
+    run_bench("format_frame_64", msg.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            string frame;
+            append_message_frame(frame, FRAME_MESSAGE, 1700000000u + i, 7, from, string(), msg.data(), msg.size());
+            sink = frame.size();
+        }
+    });
+
+    run_bench("relay_format_64", msg.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            string text, frame, stored;
+            uint32_t now = 1700000000u + i;
+            append_message_text(text, FRAME_MESSAGE, now, from, string(), msg.data(), msg.size());
+            append_message_frame(frame, FRAME_MESSAGE, now, 7, from, string(), msg.data(), msg.size());
+            append_message_frame(stored, FRAME_OFFLINE, now, 7, from, string(), msg.data(), msg.size());
+            shared_buf bufs[3] = { make_shared_buf(move(text)), make_shared_buf(move(frame)), make_shared_buf(move(stored)) };
+            sink = bufs[0]->size() + bufs[1]->size() + bufs[2]->size();
+        }
+    });
+
+    string chat_frame;
+    cmd_token to[3] = { { "bob", 3 }, { "carol", 5 }, { "dave", 4 } };
+    append_chat_frame(chat_frame, to, 3, msg.data(), msg.size());
+    run_bench("parse_chat_frame_64", chat_frame.size(), [&](uint64_t n) {
+        parsed_cmd cmd;
+        for (uint64_t i = 0; i < n; ++i) {
+            parse_chat_frame(chat_frame.data(), chat_frame.size(), cmd);
+            sink = cmd.msg.len;
+        }
+    });
+
+    // The off-line backlog on login: read a chunk of stored frames and turn
+    // it into text lines, as the server does for a text client.
+    char dir_template[] = "/tmp/microbench.XXXXXX";
+    const char *dir = mkdtemp(dir_template);
+    if (dir == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    {
+        offline_store store;
+        if (store.open(dir) < 0) {
+            return 1;
+        }
+
+        string stored;
+        append_message_frame(stored, FRAME_OFFLINE, 1700000000u, 7, from, string(), msg.data(), msg.size());
+        for (int i = 0; i < BACKLOG_MSGS; ++i) {
+            store.append("bob", stored.data(), stored.size());
+        }
+
+        run_bench("offline_read_64", stored.size(), [&](uint64_t n) {
+            uint64_t done = 0;
+            while (done < n) {
+                string chunk;
+                done += store.read("bob", 0, min(n - done, static_cast<uint64_t>(BACKLOG_MSGS)) * stored.size(), chunk);
+                sink = chunk.size();
+            }
+        });
+
+        string chunk;
+        store.read("bob", 0, BACKLOG_MSGS * stored.size(), chunk);
+        run_bench("offline_to_text_64", stored.size(), [&](uint64_t n) {
+            uint64_t done = 0;
+            while (done < n) {
+                string out;
+                for (size_t pos = 0; pos < chunk.size() && done < n; ++done) {
+                    frame_header hdr;
+                    decode_frame_header(chunk.data() + pos, hdr);
+                    frame_to_text(chunk.data() + pos, FRAME_HDR + hdr.length, out);
+                    pos += FRAME_HDR + hdr.length;
+                }
+                sink = out.size();
+            }
+        });
+
+        run_bench("offline_append_consume_64", stored.size(), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                store.append("carol", stored.data(), stored.size());
+            }
+            store.consume("carol", n);
+        });
+    }
+
+    // The same with the messages deflated in the store.
+    {
+        offline_store store;
+        store.set_compression(6);
+        if (store.open(string(dir) + "/deflate") < 0) {
+            return 1;
+        }
+
+        string stored;
+        append_message_frame(stored, FRAME_OFFLINE, 1700000000u, 7, from, string(), msg.data(), msg.size());
+        for (int i = 0; i < BACKLOG_MSGS; ++i) {
+            store.append("bob", stored.data(), stored.size());
+        }
+
+        run_bench("offline_read_deflate_64", stored.size(), [&](uint64_t n) {
+            uint64_t done = 0;
+            while (done < n) {
+                string chunk;
+                done += store.read("bob", 0, min(n - done, static_cast<uint64_t>(BACKLOG_MSGS)) * stored.size(), chunk);
+                sink = chunk.size();
+            }
+        });
+
+        run_bench("offline_append_consume_deflate_64", stored.size(), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                store.append("carol", stored.data(), stored.size());
+            }
+            store.consume("carol", n);
+        });
+    }
+
+    string cleanup = string("rm -rf ") + dir;
+    if (system(cleanup.c_str()) != 0) {
+        cerr << "Fail to remove " << dir << "." << endl;
+    }
+
+    print_json();
+    return 0;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+template <typename F>
+static void run_bench(const char *name, double bytes_per_op, F body)
+{
+    using namespace std;
+
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    // Grow the batch until one takes a tenth of a repetition.
+    uint64_t n = 1;
+    while (true) {
+        uint64_t start = now_ns();
+        body(n);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed > rep_seconds * 1e8 || n >= (1ull << 40)) {
+            n = max(static_cast<uint64_t>(1), static_cast<uint64_t>(n * rep_seconds * 1e9 / max(elapsed, static_cast<uint64_t>(1))));
+            break;
+        }
+        n *= 2;
+    }
+
+    vector<double> samples;
+    for (int i = 0; i < repetitions; ++i) {
+        uint64_t start = now_ns();
+        body(n);
+        samples.push_back(static_cast<double>(now_ns() - start) / n);
+    }
+    sort(samples.begin(), samples.end());
+
+    results.push_back(bench_result{ name, n, samples[samples.size() / 2], samples.front(), bytes_per_op });
+    cerr << name << ": " << samples[samples.size() / 2] << " ns/op" << endl;
+}
+
+static std::string pipelined_input(int count)
+{
+    std::string input;
+    for (int i = 0; i < count; ++i) {
+        input += "chat bob carol \"message number " + std::to_string(i) + " " + std::string(40, 'm') + "\"\n";
+    }
+    return input;
+}
+
+static void recv_pipelined(const std::string &input, int per_round, uint64_t count, bool use_fill)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // The writer keeps the socket full; the whole input of a round goes in
+    // as few writes as the socket allows.
+    uint64_t rounds = (count + per_round - 1) / per_round;
+    std::thread writer([&]() {
+        for (uint64_t r = 0; r < rounds; ++r) {
+            size_t sent = 0;
+            while (sent < input.size()) {
+                ssize_t n = send(fds[1], input.data() + sent, input.size() - sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    return;
+                }
+                sent += n;
+            }
+        }
+    });
+
+    my_send_recv reader(fds[0]);
+    char buf[MAX_CMD];
+    uint64_t got = 0;
+    while (got < count) {
+        int len = MAX_CMD;
+        int status;
+        if (use_fill) {
+            status = reader.next_cmd(buf, &len);
+            if (status < 0) {
+                if (reader.fill() <= 0) {
+                    break;
+                }
+                continue;
+            }
+        }
+        else {
+            status = reader.recv_cmd(buf, &len);
+        }
+        if (status != 0) {
+            break;
+        }
+        sink = len;
+        ++got;
+    }
+
+    // Unblock the writer if the count ended mid-round.
+    shutdown(fds[0], SHUT_RDWR);
+    writer.join();
+    reader.close();
+    close(fds[1]);
+}
+
+static void print_json()
+{
+    using namespace std;
+
+    printf("{\n");
+    printf("  \"context\": {\n");
+    printf("    \"compiler\": \"%s\",\n", __VERSION__);
+    printf("    \"cpus\": %u,\n", thread::hardware_concurrency());
+    printf("    \"repetitions\": %d,\n", repetitions);
+    printf("    \"seconds_per_repetition\": %g\n", rep_seconds);
+    printf("  },\n");
+    printf("  \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result &r = results[i];
+        printf("%s\n    {\n", (i > 0) ? "," : "");
+        printf("      \"name\": \"%s\",\n", r.name.c_str());
+        printf("      \"iterations\": %llu,\n", static_cast<unsigned long long>(r.iterations));
+        printf("      \"ns_per_op\": %.3f,\n", r.ns_per_op);
+        printf("      \"min_ns_per_op\": %.3f,\n", r.min_ns_per_op);
+        printf("      \"ops_per_sec\": %.0f", 1e9 / r.ns_per_op);
+        if (r.bytes_per_op > 0) {
+            printf(",\n      \"mb_per_sec\": %.1f", r.bytes_per_op * 1e3 / r.ns_per_op);
+        }
+        printf("\n    }");
+    }
+    printf("\n  ]\n}\n");
+}
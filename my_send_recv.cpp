@@ -1,11 +1,62 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 #include "my_send_recv.hpp"
+#include "frame.hpp"
+
+// Queued messages written by one sendmsg() call in flush().
+#define FLUSH_IOVS 64
+
+// Streams are raw deflate, without zlib header or checksum. The sender keeps
+// an 8 KiB window, so a connection's deflate state takes 64 KiB; the
+// receiver accepts any window.
+#define DEFLATE_WBITS    13
+#define DEFLATE_MEMLEVEL 6
+#define INFLATE_WBITS    15
+// Largest window, the most a stream can remember.
+#define MAX_DICT         (1 << 15)
+
+static void deflate_end(z_stream_s *zs)
+{
+    deflateEnd(zs);
+    delete zs;
+}
+
+static void inflate_end(z_stream_s *zs)
+{
+    inflateEnd(zs);
+    delete zs;
+}
+
+static z_stream_s *open_deflate(int level)
+{
+    z_stream_s *zs = new z_stream_s();
+    if (deflateInit2(zs, level, Z_DEFLATED, -DEFLATE_WBITS, DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete zs;
+        errno = ENOMEM;
+        return NULL;
+    }
+    return zs;
+}
+
+static z_stream_s *open_inflate()
+{
+    z_stream_s *zs = new z_stream_s();
+    if (inflateInit2(zs, -INFLATE_WBITS) != Z_OK) {
+        delete zs;
+        errno = ENOMEM;
+        return NULL;
+    }
+    return zs;
+}
 
 void my_send_recv::close()
 {
@@ -13,19 +64,347 @@ void my_send_recv::close()
         ::close(fd);
     }
     fd = -1;
-    in_buflen = 0;
+    in_head = 0;
+    in_tail = 0;
+    in_scanned = 0;
+    fed = 0;
+    fed_end = false;
+    fed_err = 0;
+    out_queue.clear();
+    out_offset = 0;
+    out_pending = 0;
+    congested = false;
+    zout.reset();
+    zin.reset();
+    zin_raw.clear();
+    zin_more = false;
+    zin_clean = true;
+}
+
+int my_send_recv::set_nonblocking(size_t high, size_t low, overflow_policy policy)
+{
+    // Sockets from accept4(SOCK_NONBLOCK) are non-blocking already.
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        return -1;
+    }
+
+    nonblock = true;
+    high_watermark = high;
+    low_watermark = (low > high) ? high : low;
+    this->policy = policy;
+
+    return 0;
+}
+
+void my_send_recv::set_deferred()
+{
+    deferred = true;
+}
+
+size_t my_send_recv::feed(const char *data, size_t len)
+{
+    if (zin) {
+        // Keep at most one buffer of compressed bytes aside.
+        size_t room = (zin_raw.size() < IN_BUFLEN) ? IN_BUFLEN - zin_raw.size() : 0;
+        size_t take = (len < room) ? len : room;
+        zin_raw.append(data, take);
+
+        int inflated = inflate_input();
+        if (inflated < 0) {
+            // Nothing after a corrupt block can be read.
+            feed_end(errno);
+            return len;
+        }
+        fed += inflated;
+        return take;
+    }
+
+    size_t space = IN_BUFLEN - (in_tail - in_head);
+    size_t take = (len < space) ? len : space;
+
+    size_t pos = in_tail & (IN_BUFLEN - 1);
+    size_t first = (take < IN_BUFLEN - pos) ? take : IN_BUFLEN - pos;
+    memcpy(in_buf + pos, data, first);
+    memcpy(in_buf, data + first, take - first);
+    in_tail += take;
+    fed += take;
+
+    return take;
+}
+
+void my_send_recv::feed_end(int err)
+{
+    fed_end = true;
+    fed_err = err;
+}
+
+int my_send_recv::pending_iov(struct iovec *iov, int max) const
+{
+    int iovcnt = 0;
+    for (auto it = out_queue.begin(); it != out_queue.end() && iovcnt < max; ++it, ++iovcnt) {
+        size_t skip = (iovcnt == 0) ? out_offset : 0;
+        iov[iovcnt].iov_base = const_cast<char *>((*it)->data() + skip);
+        iov[iovcnt].iov_len = (*it)->size() - skip;
+    }
+
+    return iovcnt;
+}
+
+void my_send_recv::sent(size_t len)
+{
+    out_pending -= len;
+    size_t written = len + out_offset;
+    while (!out_queue.empty() && written >= out_queue.front()->size()) {
+        written -= out_queue.front()->size();
+        out_queue.pop_front();
+    }
+    out_offset = written;
+
+    if (congested && out_pending <= low_watermark) {
+        congested = false;
+    }
+}
+
+void my_send_recv::save_buffers(std::string &in, std::string &out) const
+{
+    in.clear();
+    for (size_t pos = in_head; pos < in_tail; ++pos) {
+        in.push_back(static_cast<char>(in_buf[pos & (IN_BUFLEN - 1)]));
+    }
+
+    out.clear();
+    out.reserve(out_pending);
+    for (auto it = out_queue.begin(); it != out_queue.end(); ++it) {
+        size_t skip = (it == out_queue.begin()) ? out_offset : 0;
+        out.append(**it, skip, std::string::npos);
+    }
+}
+
+void my_send_recv::restore_buffers(const std::string &in, const std::string &out)
+{
+    size_t len = (in.size() < IN_BUFLEN) ? in.size() : IN_BUFLEN;
+    for (size_t i = 0; i < len; ++i) {
+        in_buf[(in_tail + i) & (IN_BUFLEN - 1)] = static_cast<uint8_t>(in[i]);
+    }
+    in_tail += len;
+
+    if (!out.empty()) {
+        out_queue.push_back(make_shared_buf(out));
+        out_pending += out.size();
+        congested = (out_pending > high_watermark);
+    }
+}
+
+int my_send_recv::fill()
+{
+    if (deferred) {
+        if (zin_more) {
+            int inflated = inflate_input();
+            if (inflated < 0) {
+                return -1;
+            }
+            fed += inflated;
+        }
+        if (fed > 0) {
+            int received_val = static_cast<int>(fed);
+            fed = 0;
+            return received_val;
+        }
+        if (fed_end) {
+            errno = fed_err;
+            return (fed_err != 0) ? -1 : 0;
+        }
+        errno = (in_tail - in_head == IN_BUFLEN) ? ENOBUFS : EAGAIN;
+        return -1;
+    }
+
+    if (zin) {
+        // Read more only once everything inflated before has been taken.
+        int inflated = 0;
+        while (inflated == 0) {
+            if (!zin_more) {
+                char raw[IN_BUFLEN];
+                ssize_t received_val = read(fd, raw, sizeof (raw));
+                if (received_val <= 0) {
+                    return static_cast<int>(received_val);
+                }
+                zin_raw.append(raw, received_val);
+            }
+
+            // A read may end inside a deflate block.
+            inflated = inflate_input();
+            if (inflated == 0 && (nonblock || in_tail - in_head == IN_BUFLEN)) {
+                errno = (in_tail - in_head == IN_BUFLEN) ? ENOBUFS : EAGAIN;
+                return -1;
+            }
+        }
+        return inflated;
+    }
+
+    size_t space = IN_BUFLEN - (in_tail - in_head);
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Free space may wrap around the end of the ring; fill both parts at once.
+    size_t pos = in_tail & (IN_BUFLEN - 1);
+    struct iovec iov[2];
+    iov[0].iov_base = in_buf + pos;
+    iov[0].iov_len = (space < IN_BUFLEN - pos) ? space : IN_BUFLEN - pos;
+    iov[1].iov_base = in_buf;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    ssize_t received_val = readv(fd, iov, (iov[1].iov_len > 0) ? 2 : 1);
+    if (received_val > 0) {
+        in_tail += received_val;
+    }
+
+    return static_cast<int>(received_val);
 }
 
-int my_send_recv::recv(int flags)
+int my_send_recv::inflate_input()
 {
-    int received_val = ::recv(fd, in_buf, sizeof (in_buf), flags);
-    if (received_val < 0) {
-        in_buflen = 0;
-        return received_val;
+    size_t before = in_tail;
+    size_t space = IN_BUFLEN - (in_tail - in_head);
+    zin->next_in = reinterpret_cast<Bytef *>(&zin_raw[0]);
+    zin->avail_in = static_cast<uInt>(zin_raw.size());
+
+    // Free space may wrap around the end of the ring; fill both parts. Stop
+    // at every block boundary, to know whether the input ends on one.
+    int status = Z_OK;
+    while (space > 0) {
+        size_t pos = in_tail & (IN_BUFLEN - 1);
+        size_t seg = (space < IN_BUFLEN - pos) ? space : IN_BUFLEN - pos;
+        uInt avail_in = zin->avail_in;
+        zin->next_out = in_buf + pos;
+        zin->avail_out = static_cast<uInt>(seg);
+        status = inflate(zin.get(), Z_BLOCK);
+        in_tail += seg - zin->avail_out;
+        space -= seg - zin->avail_out;
+
+        // Between blocks with no bits left over, see `data_type` in zlib.h;
+        // a call without progress does not say.
+        if (zin->avail_in != avail_in || zin->avail_out != seg) {
+            zin_clean = ((zin->data_type & 0x1ff) == 128);
+        }
+        if (status != Z_OK || (zin->avail_in == 0 && zin->avail_out > 0)) {
+            break;
+        }
     }
-    in_buflen = received_val;
+    zin_raw.erase(0, zin_raw.size() - zin->avail_in);
 
-    return in_buflen;
+    // With no room left, zlib may hold inflated bytes back.
+    zin_more = (space == 0);
+
+    if (status != Z_OK && status != Z_BUF_ERROR) {
+        zin_more = false;
+        errno = EPROTO;
+        return -1;
+    }
+    return static_cast<int>(in_tail - before);
+}
+
+int my_send_recv::start_deflate(int level)
+{
+    if (!zout) {
+        z_stream_s *zs = open_deflate(level);
+        if (zs == NULL) {
+            return -1;
+        }
+        zout.reset(zs, deflate_end);
+    }
+    return 0;
+}
+
+int my_send_recv::start_inflate()
+{
+    if (zin) {
+        return 0;
+    }
+    z_stream_s *zs = open_inflate();
+    if (zs == NULL) {
+        return -1;
+    }
+    zin.reset(zs, inflate_end);
+
+    // Whatever follows the command that switched is compressed already.
+    zin_raw.resize(in_tail - in_head);
+    copy_out(&zin_raw[0], zin_raw.size());
+
+    return (inflate_input() < 0) ? -1 : 0;
+}
+
+int my_send_recv::save_compression(std::string &out_dict, std::string &in_dict, std::string &in_raw)
+{
+    out_dict.clear();
+    in_dict.clear();
+    in_raw.clear();
+    if (!is_compressed()) {
+        return 0;
+    }
+    if (!zin_clean) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Every message was flushed, so the output stream is between blocks.
+    uInt len = MAX_DICT;
+    out_dict.resize(len);
+    if (deflateGetDictionary(zout.get(), reinterpret_cast<Bytef *>(&out_dict[0]), &len) != Z_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+    out_dict.resize(len);
+
+    len = MAX_DICT;
+    in_dict.resize(len);
+    if (inflateGetDictionary(zin.get(), reinterpret_cast<Bytef *>(&in_dict[0]), &len) != Z_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+    in_dict.resize(len);
+    in_raw = zin_raw;
+
+    return 0;
+}
+
+int my_send_recv::restore_compression(int level, const std::string &out_dict, const std::string &in_dict, const std::string &in_raw)
+{
+    // Buffered input was inflated already.
+    z_stream_s *out_zs = open_deflate(level);
+    z_stream_s *in_zs = open_inflate();
+    if (out_zs == NULL || in_zs == NULL) {
+        deflate_end(out_zs);
+        inflate_end(in_zs);
+        return -1;
+    }
+    zout.reset(out_zs, deflate_end);
+    zin.reset(in_zs, inflate_end);
+
+    // A raw stream may start with the window of the one it continues.
+    if ((!out_dict.empty() && deflateSetDictionary(zout.get(), reinterpret_cast<const Bytef *>(out_dict.data()), static_cast<uInt>(out_dict.size())) != Z_OK) ||
+        (!in_dict.empty() && inflateSetDictionary(zin.get(), reinterpret_cast<const Bytef *>(in_dict.data()), static_cast<uInt>(in_dict.size())) != Z_OK)) {
+        errno = EINVAL;
+        return -1;
+    }
+    zin_raw = in_raw;
+    zin_more = !zin_raw.empty();
+
+    return 0;
+}
+
+void my_send_recv::copy_out(char *buf, size_t len)
+{
+    size_t pos = in_head & (IN_BUFLEN - 1);
+    size_t first = (len < IN_BUFLEN - pos) ? len : IN_BUFLEN - pos;
+    memcpy(buf, in_buf + pos, first);
+    memcpy(buf + first, in_buf, len - first);
+    in_head += len;
+    if (in_scanned < in_head) {
+        in_scanned = in_head;
+    }
 }
 
 int my_send_recv::send(const void *buf, int *buflen, int flags)
@@ -38,8 +417,24 @@ int my_send_recv::send(const void *buf, int *buflen, int flags)
         return -1;
     }
 
+    if (zout) {
+        int status = send_deflated(reinterpret_cast<const char *>(buf), static_cast<size_t>(*buflen), flags);
+        if (status != 0) {
+            *buflen = 0;
+        }
+        return status;
+    }
+
+    if (nonblock) {
+        int status = enqueue(reinterpret_cast<const char *>(buf), static_cast<size_t>(*buflen), NULL, flags);
+        if (status != 0) {
+            *buflen = 0;
+        }
+        return status;
+    }
+
     while (*buflen > sent) {
-        send_val = ::send(fd, reinterpret_cast<const char *>(buf) + sent, *buflen - sent, 0);
+        send_val = ::send(fd, reinterpret_cast<const char *>(buf) + sent, *buflen - sent, flags);
         if (send_val <= 0) {
             *buflen = sent;
             return send_val;
@@ -52,97 +447,320 @@ int my_send_recv::send(const void *buf, int *buflen, int flags)
     return 0;
 }
 
-int my_send_recv::recv_cmd(char *buf, int *buflen)
+int my_send_recv::send(const shared_buf &msg, int flags)
 {
     if (fd < 0) {
-        *buflen = 0;
         return -1;
     }
 
-    int received_val;
-    if (in_buflen == 0) {
-        received_val = recv(0);
-        if (received_val <= 0) {
-            *buflen = 0;
-            return (received_val == 0 ? 1 : -1);
+    if (zout) {
+        return send_deflated(msg->data(), msg->size(), flags);
+    }
+
+    if (nonblock) {
+        return enqueue(msg->data(), msg->size(), &msg, flags);
+    }
+
+    int len = static_cast<int>(msg->size());
+    return send(msg->data(), &len, flags);
+}
+
+int my_send_recv::send_deflated(const char *data, size_t len, int flags)
+{
+    // A refused message must stay out of the stream, or the peer could not
+    // inflate the next ones; so the policy applies before compressing.
+    if (nonblock && (congested || (out_pending > 0 && out_pending + len > high_watermark))) {
+        return overflow();
+    }
+
+    std::string out;
+    zout->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    zout->avail_in = static_cast<uInt>(len);
+    do {
+        size_t at = out.size();
+        out.resize(at + deflateBound(zout.get(), len) + 16);
+        zout->next_out = reinterpret_cast<Bytef *>(&out[at]);
+        zout->avail_out = static_cast<uInt>(out.size() - at);
+        int status = deflate(zout.get(), Z_SYNC_FLUSH);
+        out.resize(out.size() - zout->avail_out);
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            errno = EIO;
+            return -1;
         }
+    } while (zout->avail_out == 0);
+
+    if (nonblock) {
+        shared_buf wire = make_shared_buf(std::move(out));
+        return enqueue(wire->data(), wire->size(), &wire, flags, true);
     }
 
-    int received = 0;
+    for (size_t sent = 0; sent < out.size(); ) {
+        ssize_t send_val = ::send(fd, out.data() + sent, out.size() - sent, flags);
+        if (send_val <= 0) {
+            return -1;
+        }
+        sent += send_val;
+    }
 
-    uint8_t *cmd_end = reinterpret_cast<uint8_t *>( memchr(in_buf, '\n', static_cast<size_t>(in_buflen)) );
-    while (cmd_end == NULL) {
-        size_t cpy_size = static_cast<size_t>( (*buflen - received >= in_buflen) ? in_buflen : (*buflen - received) );
-        memcpy(buf + received, in_buf, cpy_size);
-        received += cpy_size;
-        if (*buflen <= received) {
-            memmove(in_buf, in_buf + cpy_size, in_buflen - cpy_size);
-            in_buflen -= cpy_size;
-            *buflen = received;
-            return 1;
+    return 0;
+}
+
+int my_send_recv::overflow()
+{
+    congested = true;
+    switch (policy) {
+    case OVERFLOW_SPILL:
+        return 1;
+    case OVERFLOW_DISCONNECT:
+        errno = ECONNABORTED;
+        return -1;
+    default:
+        errno = ENOBUFS;
+        return -1;
+    }
+}
+
+int my_send_recv::enqueue(const char *data, size_t len, const shared_buf *msg, int flags, bool admitted)
+{
+    size_t sent = 0;
+
+    if (!congested && out_pending == 0 && !deferred) {
+        while (len > sent) {
+            ssize_t send_val = ::send(fd, data + sent, len - sent, flags | MSG_NOSIGNAL);
+            if (send_val < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return -1;
+            }
+
+            sent += send_val;
         }
 
-        received_val = recv(0);
-        if (received_val <= 0) {
-            *buflen = received;
-            return (received_val == 0 ? 1 : -1);
+        if (sent == len) {
+            return 0;
         }
-        cmd_end = reinterpret_cast<uint8_t *>( memchr(in_buf, '\n', static_cast<size_t>(in_buflen)) );
     }
 
-    int end_index = static_cast<int>(cmd_end - in_buf) + 1;
+    // A message that is partially on the wire must be queued whole,
+    // otherwise the stream would be corrupted. An empty queue always admits
+    // the message, so one oversized message cannot wedge the connection.
+    size_t remain = len - sent;
+    if (!admitted && sent == 0 && out_pending > 0 && (congested || out_pending + remain > high_watermark)) {
+        return overflow();
+    }
 
-    size_t cpy_size = static_cast<size_t>( (*buflen - received >= end_index) ? end_index : (*buflen - received) );
-    memcpy(buf + received, in_buf, cpy_size);
-    received += cpy_size;
-    if (static_cast<size_t>(in_buflen) > cpy_size) {
-        memmove(in_buf, in_buf + cpy_size, in_buflen - cpy_size);
+    if (msg != NULL) {
+        // Partially written only if the queue was empty, so it is the front.
+        out_queue.push_back(*msg);
+        out_offset = (sent > 0) ? sent : out_offset;
     }
-    in_buflen -= cpy_size;
-    *buflen = received;
-    if (cpy_size < static_cast<size_t>(end_index)) {
-        return 1;
+    else {
+        out_queue.push_back(make_shared_buf(std::string(data + sent, remain)));
     }
-    
+    out_pending += remain;
+    if (out_pending > high_watermark) {
+        congested = true;
+    }
+
     return 0;
 }
 
-int my_send_recv::recv_data(void *buf, int *buflen)
+int my_send_recv::flush()
+{
+    if (fd < 0) {
+        return -1;
+    }
+
+    while (!out_queue.empty() && !deferred) {
+        // Hand many queued messages to the kernel in one call.
+        struct iovec iov[FLUSH_IOVS];
+        int iovcnt = pending_iov(iov, FLUSH_IOVS);
+        size_t batch = 0;
+        for (int i = 0; i < iovcnt; ++i) {
+            batch += iov[i].iov_len;
+        }
+
+        struct msghdr mh = {};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iovcnt;
+        ssize_t send_val = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (send_val < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        sent(send_val);
+
+        if (static_cast<size_t>(send_val) < batch) {
+            // The socket buffer is full.
+            break;
+        }
+    }
+
+    if (congested && out_pending <= low_watermark) {
+        congested = false;
+    }
+
+    return out_pending > 0 ? 1 : 0;
+}
+
+int my_send_recv::next_cmd(char *buf, int *buflen)
+{
+    // Only look at bytes that were not searched for '\n' before.
+    bool found = false;
+    while (in_scanned < in_tail) {
+        size_t pos = in_scanned & (IN_BUFLEN - 1);
+        size_t seg = (in_tail - in_scanned < IN_BUFLEN - pos) ? in_tail - in_scanned : IN_BUFLEN - pos;
+        const uint8_t *cmd_end = reinterpret_cast<const uint8_t *>( memchr(in_buf + pos, '\n', seg) );
+        if (cmd_end != NULL) {
+            in_scanned += cmd_end - (in_buf + pos);
+            found = true;
+            break;
+        }
+        in_scanned += seg;
+    }
+
+    size_t pending = in_tail - in_head;
+    size_t want = static_cast<size_t>(*buflen);
+    if (!found) {
+        // No room left for the rest of the command.
+        if (pending >= want || pending == IN_BUFLEN) {
+            size_t cpy_size = (want < pending) ? want : pending;
+            copy_out(buf, cpy_size);
+            *buflen = static_cast<int>(cpy_size);
+            return 1;
+        }
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t cmd_len = in_scanned - in_head + 1;
+    size_t cpy_size = (want < cmd_len) ? want : cmd_len;
+    copy_out(buf, cpy_size);
+    *buflen = static_cast<int>(cpy_size);
+
+    return (cpy_size < cmd_len) ? 1 : 0;
+}
+
+int my_send_recv::recv_cmd(char *buf, int *buflen)
 {
     if (fd < 0) {
         *buflen = 0;
         return -1;
     }
 
-    int received_val;
-    if (in_buflen == 0) {
-        received_val = recv(0);
-        if (received_val <= 0) {
+    int want = *buflen;
+    while (true) {
+        *buflen = want;
+        int status = next_cmd(buf, buflen);
+        if (status >= 0) {
+            return status;
+        }
+
+        int received_val = fill();
+        if (received_val == 0) {
+            // Hand out what is left of an unterminated command.
+            size_t pending = in_tail - in_head;
+            size_t cpy_size = (static_cast<size_t>(want) < pending) ? want : pending;
+            copy_out(buf, cpy_size);
+            *buflen = static_cast<int>(cpy_size);
+            return 1;
+        }
+        if (received_val < 0) {
             *buflen = 0;
-            return received_val;
+            return -1;
         }
     }
+}
 
-    int received = 0;
-    while (received < *buflen) {
-        size_t cpy_size = static_cast<size_t>( (*buflen - received >= in_buflen) ? in_buflen : (*buflen - received) );
-        memcpy(reinterpret_cast<char *>(buf) + received, in_buf, cpy_size);
-        received += cpy_size;
-        if (*buflen <= received) {
-            memmove(in_buf, in_buf + cpy_size, in_buflen - cpy_size);
-            in_buflen -= cpy_size;
-            *buflen = received;
-            return 0;
+int my_send_recv::next_frame(char *buf, int *buflen)
+{
+    size_t pending = in_tail - in_head;
+    if (pending < FRAME_HDR) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // The header itself may wrap around the end of the ring.
+    char hdr_buf[FRAME_HDR];
+    size_t pos = in_head & (IN_BUFLEN - 1);
+    size_t first = (FRAME_HDR < IN_BUFLEN - pos) ? FRAME_HDR : IN_BUFLEN - pos;
+    memcpy(hdr_buf, in_buf + pos, first);
+    memcpy(hdr_buf + first, in_buf, FRAME_HDR - first);
+
+    frame_header hdr;
+    decode_frame_header(hdr_buf, hdr);
+    size_t frame_len = FRAME_HDR + static_cast<size_t>(hdr.length);
+    if (frame_len > static_cast<size_t>(*buflen) || frame_len > IN_BUFLEN) {
+        *buflen = 0;
+        return 1;
+    }
+
+    if (pending < frame_len) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    copy_out(buf, frame_len);
+    *buflen = static_cast<int>(frame_len);
+    return 0;
+}
+
+int my_send_recv::recv_frame(char *buf, int *buflen)
+{
+    if (fd < 0) {
+        *buflen = 0;
+        return -1;
+    }
+
+    int want = *buflen;
+    while (true) {
+        *buflen = want;
+        int status = next_frame(buf, buflen);
+        if (status >= 0) {
+            return status;
         }
 
-        received_val = recv(0);
+        int received_val = fill();
+        if (received_val == 0) {
+            *buflen = 0;
+            return 1;
+        }
         if (received_val < 0) {
-            *buflen = received;
-            return received_val;
+            *buflen = 0;
+            return -1;
         }
-        if (received_val == 0) {
-            break;
+    }
+}
+
+int my_send_recv::recv_data(void *buf, int *buflen)
+{
+    if (fd < 0) {
+        *buflen = 0;
+        return -1;
+    }
+
+    int received = 0;
+    while (received < *buflen) {
+        if (in_tail == in_head) {
+            int received_val = fill();
+            if (received_val < 0) {
+                *buflen = received;
+                return received_val;
+            }
+            if (received_val == 0) {
+                break;
+            }
         }
+
+        size_t pending = in_tail - in_head;
+        size_t cpy_size = (static_cast<size_t>(*buflen - received) < pending) ? *buflen - received : pending;
+        copy_out(reinterpret_cast<char *>(buf) + received, cpy_size);
+        received += cpy_size;
     }
 
     *buflen = received;
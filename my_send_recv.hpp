@@ -1,17 +1,87 @@
 #ifndef __MY_SEND_RECV_HPP__
 #define __MY_SEND_RECV_HPP__
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <deque>
+#include <memory>
+
+struct iovec;
+struct z_stream_s;
+
+// Size of the input ring buffer, must be a power of 2.
+#define IN_BUFLEN 2048
+
+/**
+ * What a non-blocking connection does with new messages once its output
+ * queue went above the high watermark, until it drains below the low one.
+ */
+enum overflow_policy
+{
+    OVERFLOW_DROP,       // discard the message, send() fails with ENOBUFS
+    OVERFLOW_DISCONNECT, // send() fails with ECONNABORTED, caller should close
+    OVERFLOW_SPILL       // send() returns 1, caller keeps the message aside
+};
+
+/**
+ * Immutable message that any number of output queues can hold at once. It is
+ * formatted once and freed when the last connection has written it out.
+ */
+typedef std::shared_ptr<const std::string> shared_buf;
+
+
+inline shared_buf make_shared_buf(std::string str)
+{
+    return std::make_shared<const std::string>(std::move(str));
+}
+
 class my_send_recv
 {
-    uint8_t in_buf[1024];
-    int in_buflen;
+    // Input ring buffer. Positions only grow; index with `& (IN_BUFLEN - 1)`.
+    uint8_t in_buf[IN_BUFLEN];
+    size_t in_head;
+    size_t in_tail;
+    size_t in_scanned;
+
+    bool nonblock;
+    std::deque<shared_buf> out_queue;
+    size_t out_offset;
+    size_t out_pending;
+    size_t high_watermark;
+    size_t low_watermark;
+    overflow_policy policy;
+    bool congested;
+
+    // Deferred mode: the owner does the socket I/O itself.
+    bool deferred;
+    size_t fed;   // bytes fed since the last fill()
+    bool fed_end; // feed_end() was called
+    int fed_err;
 
-    int recv(int flags);
+    // Compression: output is deflated message by message, input is
+    // inflated into the ring as room allows. Copies of a connection share
+    // its streams, like its fd.
+    std::shared_ptr<z_stream_s> zout;
+    std::shared_ptr<z_stream_s> zin;
+    std::string zin_raw; // received bytes not inflated yet
+    bool zin_more;       // inflated bytes may wait for room in the ring
+    bool zin_clean;      // the input stopped between two deflate blocks
+
+    void copy_out(char *buf, size_t len);
+    int overflow();
+    int enqueue(const char *data, size_t len, const shared_buf *msg, int flags, bool admitted = false);
+    int send_deflated(const char *data, size_t len, int flags);
+    int inflate_input();
 
 public:
     int fd;
 
-    my_send_recv(int fd) : in_buflen(0), fd(fd)
+    my_send_recv(int fd)
+    : in_head(0), in_tail(0), in_scanned(0), nonblock(false), out_offset(0), out_pending(0),
+      high_watermark(0), low_watermark(0), policy(OVERFLOW_DROP),
+      congested(false), deferred(false), fed(0), fed_end(false), fed_err(0), zin_more(false), zin_clean(true), fd(fd)
     {
     }
 
@@ -21,25 +91,221 @@ public:
     */
     void close();
 
+    /**
+    * Description: Put `fd` in non-blocking mode. From now on send() never
+    *              blocks: bytes the socket does not take are kept in an
+    *              output queue that flush() writes out when `fd` becomes
+    *              writable. Once more than `high` bytes are queued, `policy`
+    *              applies to new messages until the queue drains to `low`.
+    * Return: -1 if fail, and errno set to appropriate value.
+    *         0 if succeed.
+    */
+    int set_nonblocking(size_t high, size_t low, overflow_policy policy);
+
+    /**
+    * Description: After set_nonblocking(), leave the socket I/O to the
+    *              caller, e.g. an io_uring loop. send() only queues and
+    *              flush() writes nothing; the caller writes the queue from
+    *              pending_iov() and reports it with sent(). Bytes the caller
+    *              received are passed in with feed(), and fill() returns them
+    *              without reading `fd`.
+    */
+    void set_deferred();
+
+    /**
+    * Description: Append up to `len` received bytes of `data` to the input
+    *              buffer, in deferred mode.
+    * Return: Number of bytes taken; less than `len` if the buffer is full.
+    */
+    size_t feed(const char *data, size_t len);
+
+    /**
+    * Description: Make the next fill() report the end of the input, in
+    *              deferred mode: 0 if the peer closed the connection, or an
+    *              errno value for a failed read.
+    */
+    void feed_end(int err);
+
+    /**
+    * Description: Describe up to `max` pieces of the output queue, oldest
+    *              first, in `iov`.
+    * Return: Number of pieces described.
+    */
+    int pending_iov(struct iovec *iov, int max) const;
+
+    /**
+    * Description: Remove `len` bytes written by the caller from the front of
+    *              the output queue.
+    */
+    void sent(size_t len);
+
+    /**
+    * Description: Copy the bytes received but not taken yet to `in`, and the
+    *              output queue to `out`, e.g. to hand the connection over to
+    *              another process.
+    */
+    void save_buffers(std::string &in, std::string &out) const;
+
+    /**
+    * Description: Put buffers saved by save_buffers() back, after
+    *              set_nonblocking(). `in` must fit the input buffer.
+    */
+    void restore_buffers(const std::string &in, const std::string &out);
+
+    /**
+    * Description: Compress everything sent from now on as one raw deflate
+    *              stream at `level` (0-9), flushed after every message so
+    *              the peer can read it at once. Does nothing if compression
+    *              is on already.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int start_deflate(int level);
+
+    /**
+    * Description: Inflate everything received from now on, starting with the
+    *              bytes already buffered but not taken. Does nothing if
+    *              compression is on already.
+    * Return: 0 if succeed, or -1 if fail (errno EPROTO if the buffered
+    *         bytes are not a deflate stream).
+    */
+    int start_inflate();
+
+    /**
+    * Description: Whether inflated input is waiting for room in the input
+    *              buffer; fill() takes it once commands have been taken.
+    */
+    bool input_pending() const
+    {
+        return zin_more;
+    }
+
+    /**
+    * Description: Whether both directions are compressed.
+    */
+    bool is_compressed() const
+    {
+        return zout && zin;
+    }
+
+    /**
+    * Description: Copy the history of the compressed streams, which the next
+    *              messages may refer to, to `out_dict` and `in_dict`, and the
+    *              received bytes not inflated yet to `in_raw`. Fails if the
+    *              input stopped inside a deflate block, which cannot be
+    *              resumed by another process.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int save_compression(std::string &out_dict, std::string &in_dict, std::string &in_raw);
+
+    /**
+    * Description: Compress both directions, resuming streams saved by
+    *              save_compression(), after restore_buffers().
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int restore_compression(int level, const std::string &out_dict, const std::string &in_dict, const std::string &in_raw);
+
     /**
     * Description: Try to write `buflen` bytes of message of `buf` to `fd`.
-    *              Actual bytes written will be stored in `buflen`.
+    *              Actual bytes written (or queued) will be stored in `buflen`.
     * Return: -1 if fail, and errno set to appropriate value.
     *         0 if succeed.
+    *         1 if the queue is congested and policy is OVERFLOW_SPILL; nothing
+    *          is written and the caller should retry after flush().
     */
     int send(const void *buf, int *buflen, int flags = 0);
 
+    /**
+    * Description: Same as send() above, but in non-blocking mode the output
+    *              queue keeps a reference to `msg` instead of copying it.
+    * Return: Same as send() above.
+    */
+    int send(const shared_buf &msg, int flags = 0);
+
+    /**
+    * Description: Write as much of the output queue as `fd` accepts.
+    * Return: -1 if fail, and errno set to appropriate value.
+    *         0 if the queue is empty.
+    *         1 if bytes are still pending.
+    */
+    int flush();
+
+    /**
+    * Description: Whether the output queue has bytes waiting for `fd` to
+    *              become writable.
+    */
+    bool want_write() const
+    {
+        return out_pending > 0;
+    }
+
+    /**
+    * Description: Whether new messages are currently subject to the overflow
+    *              policy.
+    */
+    bool is_congested() const
+    {
+        return congested;
+    }
+
+    /**
+    * Description: Read once from `fd`, appending to the input buffer. Call
+    *              next_cmd() afterwards until it runs out of commands. In
+    *              deferred mode, report what was fed instead.
+    * Return: -1 if fail, and errno set to appropriate value (EAGAIN if
+    *          nothing to read in non-blocking mode, ENOBUFS if the buffer is
+    *          full).
+    *         0 if the peer closed the connection.
+    *         Otherwise number of bytes read.
+    */
+    int fill();
+
+    /**
+    * Description: Take the next complete command already in the input buffer,
+    *              without reading from `fd`.
+    *              Read up to `buflen` bytes and write to `buf`.
+    *              Actual bytes written will be stored in `buflen`.
+    * Return: -1 if no complete command is buffered, and errno set to EAGAIN.
+    *         0 if command is valid (end with '\n').
+    *         1 if command is longer than `buflen`, or the buffer is full but
+    *          no '\n' received.
+    */
+    int next_cmd(char *buf, int *buflen);
+
     /**
     * Description: Try to read command from `fd` with a newline character ('\n').
     *              Read up to `buflen` bytes and write to `buf`.
     *              Actual bytes written will be stored in `buflen`.
-    * Return: -1 if fail, and errno set to appropriate value.
+    *              Incomplete commands stay buffered, so in non-blocking mode
+    *              the call can simply be repeated on the next readiness.
+    * Return: -1 if fail, and errno set to appropriate value (EAGAIN if no
+    *          complete command is available yet in non-blocking mode).
     *         0 if read succeed and command is valid (end with '\n').
     *         1 if read succeed but command is not valid (not end with '\n') or
     *          read exact `buflen` bytes but no '\n' received.
     */
     int recv_cmd(char *buf, int *buflen);
 
+    /**
+    * Description: Take the next complete frame (see frame.hpp) already in
+    *              the input buffer, without reading from `fd`.
+    *              Read up to `buflen` bytes and write to `buf`.
+    *              Actual bytes written will be stored in `buflen`.
+    * Return: -1 if no complete frame is buffered, and errno set to EAGAIN.
+    *         0 if a frame is taken.
+    *         1 if the frame is longer than `buflen` or the input buffer;
+    *          nothing is taken.
+    */
+    int next_frame(char *buf, int *buflen);
+
+    /**
+    * Description: Like recv_cmd(), but read one frame.
+    * Return: -1 if fail, and errno set to appropriate value.
+    *         0 if a frame is read.
+    *         1 if the frame is too long, or the peer closed the connection
+    *          (`buflen` is 0 then).
+    */
+    int recv_frame(char *buf, int *buflen);
+
     /**
     * Description: Read binary data.
     *              Read up to `buflen` bytes and write to `buf`.
@@ -50,4 +316,4 @@ public:
     int recv_data(void *buf, int *buflen);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,788 @@
+#include "offline_store.hpp"
+#include "logger.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <zlib.h>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+}
+
+#define SEGMENT_MAGIC 0x3147455354414843ULL // "CHATSEG1"
+#define INDEX_MAGIC   0x3158444e54414843ULL // "CHATNDX1"
+#define RECORD_LIVE   0x4556494cU
+#define RECORD_DEAD   0x44414544U
+
+// Segment files start with SEGMENT_MAGIC and a reserved word.
+#define SEGMENT_HDR 16
+
+// Records are raw deflate streams with a small window; the state is reset
+// for every record, and a smaller hash table is quicker to clear.
+#define RECORD_WBITS    12
+#define RECORD_MEMLEVEL 6
+
+/**
+ * Preset dictionary of deflated records, so even short messages find
+ * matches. Part of the segment format: records written with it must be
+ * read with it. Most frequent strings go last, where the distances are
+ * shortest.
+ */
+static const char record_dict[] =
+    "http://https://www.com .org .net :) :( :D lol thx pls btw brb omg ok okay "
+    "sorry thanks thank you please hello hi hey bye see you later tomorrow "
+    "today tonight morning afternoon evening night week weekend meeting "
+    "call message chat group file home work time now soon again maybe sure "
+    "yes no not don't can't won't didn't isn't it's I'm I'll I've you're "
+    "we're they're that's what's let's there here where when what which who "
+    "why how about after before because could would should will can have "
+    "has had been were was are is am do does did just like know think want "
+    "need going get got make good great nice new one all some any more "
+    "that with from your for and the you ";
+
+/**
+ * Header of a record, followed by the user name and the message. Records are
+ * padded to 8 bytes. `magic` is written last, so a record cut short by a
+ * crash ends the scan instead of being read.
+ */
+struct record_header
+{
+    uint32_t magic;
+    uint32_t user_len;
+    uint32_t msg_len;
+    uint32_t plain_len; // size of the message inflated, 0 if kept as is
+    uint64_t seq;
+};
+
+static size_t record_size(size_t user_len, size_t msg_len)
+{
+    return (sizeof (record_header) + user_len + msg_len + 7) & ~static_cast<size_t>(7);
+}
+
+template <typename T>
+static void put(std::string &buf, T val)
+{
+    buf.append(reinterpret_cast<const char *>(&val), sizeof (val));
+}
+
+template <typename T>
+static bool get(const std::string &buf, size_t &pos, T &val)
+{
+    if (buf.size() - pos < sizeof (val)) {
+        return false;
+    }
+    memcpy(&val, buf.data() + pos, sizeof (val));
+    pos += sizeof (val);
+    return true;
+}
+
+offline_store::offline_store()
+: segment_size(SEGMENT_SIZE), active(0), next_seq(1), level(0), zdeflate(NULL), zinflate(NULL), log(NULL)
+{
+}
+
+offline_store::~offline_store()
+{
+    for (auto &it : segments) {
+        munmap(it.second.base, it.second.size);
+        ::close(it.second.fd);
+    }
+
+    if (zdeflate != NULL) {
+        deflateEnd(zdeflate);
+        delete zdeflate;
+    }
+    if (zinflate != NULL) {
+        inflateEnd(zinflate);
+        delete zinflate;
+    }
+}
+
+void offline_store::set_logger(logger &event_log)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    log = &event_log;
+}
+
+void offline_store::report(const char *format, const std::string &text) const
+{
+    // Formats only use %s, which both the logger and printf expand.
+    if (log != NULL) {
+        log->log(LOG_ERROR, format, text);
+    }
+    else {
+        fprintf(stderr, format, text.c_str());
+        fputc('\n', stderr);
+    }
+}
+
+void offline_store::set_compression(int level)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // Made again at the new level by the next append.
+    this->level = level;
+    if (zdeflate != NULL) {
+        deflateEnd(zdeflate);
+        delete zdeflate;
+        zdeflate = NULL;
+    }
+}
+
+int offline_store::deflate_record(const char *msg, size_t len)
+{
+    if (zdeflate == NULL) {
+        zdeflate = new z_stream_s();
+        if (deflateInit2(zdeflate, level, Z_DEFLATED, -RECORD_WBITS, RECORD_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete zdeflate;
+            zdeflate = NULL;
+            return -1;
+        }
+    }
+    else if (deflateReset(zdeflate) != Z_OK) {
+        return -1;
+    }
+
+    if (deflateSetDictionary(zdeflate, reinterpret_cast<const Bytef *>(record_dict), sizeof (record_dict) - 1) != Z_OK) {
+        return -1;
+    }
+
+    // Only worth keeping if smaller.
+    zbuf.resize(len);
+    zdeflate->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(msg));
+    zdeflate->avail_in = static_cast<uInt>(len);
+    zdeflate->next_out = reinterpret_cast<Bytef *>(&zbuf[0]);
+    zdeflate->avail_out = static_cast<uInt>(len);
+    if (deflate(zdeflate, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    zbuf.resize(len - zdeflate->avail_out);
+
+    return 0;
+}
+
+int offline_store::inflate_record(const char *data, size_t len, size_t plain_len, std::string &out)
+{
+    if (zinflate == NULL) {
+        zinflate = new z_stream_s();
+        if (inflateInit2(zinflate, -MAX_WBITS) != Z_OK) {
+            delete zinflate;
+            zinflate = NULL;
+            return -1;
+        }
+    }
+    else if (inflateReset(zinflate) != Z_OK) {
+        return -1;
+    }
+
+    if (inflateSetDictionary(zinflate, reinterpret_cast<const Bytef *>(record_dict), sizeof (record_dict) - 1) != Z_OK) {
+        return -1;
+    }
+
+    size_t at = out.size();
+    out.resize(at + plain_len);
+    zinflate->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    zinflate->avail_in = static_cast<uInt>(len);
+    zinflate->next_out = reinterpret_cast<Bytef *>(&out[at]);
+    zinflate->avail_out = static_cast<uInt>(plain_len);
+    if (inflate(zinflate, Z_FINISH) != Z_STREAM_END || zinflate->avail_out != 0) {
+        out.resize(at);
+        return -1;
+    }
+
+    return 0;
+}
+
+std::string offline_store::segment_path(uint32_t id) const
+{
+    char name[32];
+    snprintf(name, sizeof (name), "/%08x.seg", id);
+    return dir + name;
+}
+
+int offline_store::map_segment(uint32_t id, bool create, size_t size)
+{
+    std::string path = segment_path(id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) {
+        report("Off-line store %s.", path + ": " + strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (create ? ftruncate(fd, size) < 0 : fstat(fd, &st) < 0) {
+        report("Off-line store %s.", path + ": " + strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    if (!create) {
+        size = static_cast<size_t>(st.st_size);
+    }
+
+    char *base = NULL;
+    if (size >= SEGMENT_HDR) {
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        base = (addr == MAP_FAILED) ? NULL : reinterpret_cast<char *>(addr);
+    }
+    if (base == NULL) {
+        report("Off-line store %s: cannot map segment.", path);
+        ::close(fd);
+        return -1;
+    }
+
+    uint64_t magic = SEGMENT_MAGIC;
+    if (create) {
+        memcpy(base, &magic, sizeof (magic));
+    }
+    else if (memcmp(base, &magic, sizeof (magic)) != 0) {
+        report("Off-line store %s: not a segment file.", path);
+        munmap(base, size);
+        ::close(fd);
+        return -1;
+    }
+
+    segment seg = { fd, base, size, SEGMENT_HDR, 0, 0 };
+    segments[id] = seg;
+    return 0;
+}
+
+void offline_store::drop_segment(uint32_t id)
+{
+    auto it = segments.find(id);
+    munmap(it->second.base, it->second.size);
+    ::close(it->second.fd);
+    unlink(segment_path(id).c_str());
+    segments.erase(it);
+}
+
+int offline_store::scan_segment(uint32_t id, size_t from)
+{
+    segment &seg = segments[id];
+    size_t off = std::max(from, static_cast<size_t>(SEGMENT_HDR));
+    int found = 0;
+
+    while (off + sizeof (record_header) <= seg.size) {
+        const record_header *hdr = reinterpret_cast<const record_header *>(seg.base + off);
+        if (hdr->magic != RECORD_LIVE && hdr->magic != RECORD_DEAD) {
+            break;
+        }
+
+        size_t rec = record_size(hdr->user_len, hdr->msg_len);
+        if (rec > seg.size - off) {
+            break;
+        }
+
+        if (hdr->magic == RECORD_LIVE) {
+            std::string user(seg.base + off + sizeof (record_header), hdr->user_len);
+            record_ref ref = { hdr->seq, id, static_cast<uint32_t>(off) };
+            index[user].push_back(ref);
+            seg.live += 1;
+            seg.live_bytes += rec;
+            ++found;
+        }
+        next_seq = std::max(next_seq, hdr->seq + 1);
+        off += rec;
+    }
+
+    seg.tail = off;
+    return found;
+}
+
+int offline_store::load_index()
+{
+    using namespace std;
+
+    string path = dir + "/index";
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    string buf;
+    char chunk[65536];
+    ssize_t n;
+    while ((n = ::read(fd, chunk, sizeof (chunk))) > 0) {
+        buf.append(chunk, n);
+    }
+    ::close(fd);
+
+    size_t pos = 0;
+    uint64_t magic;
+    uint32_t seg_count;
+    if (!get(buf, pos, magic) || magic != INDEX_MAGIC || !get(buf, pos, seg_count)) {
+        return -1;
+    }
+
+    // Segments are scanned from where the saved index ended.
+    map<uint32_t, uint32_t> saved_tails;
+    for (uint32_t i = 0; i < seg_count; ++i) {
+        uint32_t id, tail;
+        if (!get(buf, pos, id) || !get(buf, pos, tail)) {
+            return -1;
+        }
+        saved_tails[id] = tail;
+    }
+
+    uint32_t user_count;
+    if (!get(buf, pos, user_count)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < user_count; ++i) {
+        uint32_t name_len, ref_count;
+        if (!get(buf, pos, name_len) || buf.size() - pos < name_len) {
+            return -1;
+        }
+        string user = buf.substr(pos, name_len);
+        pos += name_len;
+        if (!get(buf, pos, ref_count)) {
+            return -1;
+        }
+
+        for (uint32_t j = 0; j < ref_count; ++j) {
+            record_ref ref;
+            if (!get(buf, pos, ref.seq) || !get(buf, pos, ref.segment) || !get(buf, pos, ref.offset)) {
+                return -1;
+            }
+
+            // Skip records consumed or compacted away since the save.
+            auto seg_it = segments.find(ref.segment);
+            if (seg_it == segments.end() || saved_tails.count(ref.segment) == 0) {
+                continue;
+            }
+            segment &seg = seg_it->second;
+            if (ref.offset < SEGMENT_HDR || ref.offset + sizeof (record_header) > seg.size) {
+                continue;
+            }
+            const record_header *hdr = reinterpret_cast<const record_header *>(seg.base + ref.offset);
+            size_t rec = record_size(hdr->user_len, hdr->msg_len);
+            if (hdr->magic != RECORD_LIVE || hdr->seq != ref.seq || rec > seg.size - ref.offset) {
+                continue;
+            }
+
+            index[user].push_back(ref);
+            seg.live += 1;
+            seg.live_bytes += rec;
+            next_seq = max(next_seq, ref.seq + 1);
+        }
+    }
+
+    for (auto &it : segments) {
+        auto saved = saved_tails.find(it.first);
+        size_t from = (saved == saved_tails.end()) ? 0 : min(static_cast<size_t>(saved->second), it.second.size);
+        scan_segment(it.first, from);
+    }
+
+    return 0;
+}
+
+int offline_store::write_index()
+{
+    using namespace std;
+
+    string buf;
+    put(buf, static_cast<uint64_t>(INDEX_MAGIC));
+    put(buf, static_cast<uint32_t>(segments.size()));
+    for (auto &it : segments) {
+        put(buf, it.first);
+        put(buf, static_cast<uint32_t>(it.second.tail));
+    }
+
+    put(buf, static_cast<uint32_t>(index.size()));
+    for (auto &it : index) {
+        put(buf, static_cast<uint32_t>(it.first.size()));
+        buf += it.first;
+        put(buf, static_cast<uint32_t>(it.second.size()));
+        for (auto &ref : it.second) {
+            put(buf, ref.seq);
+            put(buf, ref.segment);
+            put(buf, ref.offset);
+        }
+    }
+
+    // Replace the old index atomically.
+    string path = dir + "/index";
+    string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        report("Off-line store %s.", tmp_path + ": " + strerror(errno));
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = ::write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("Off-line store %s.", tmp_path + ": " + strerror(errno));
+            ::close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    ::close(fd);
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        report("Off-line store %s.", path + ": " + strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int offline_store::open(const std::string &path, size_t seg_size)
+{
+    using namespace std;
+
+    lock_guard<mutex> lock(mtx);
+
+    dir = path;
+    segment_size = seg_size;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        report("Off-line store %s.", dir + ": " + strerror(errno));
+        return -1;
+    }
+
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL) {
+        report("Off-line store %s.", dir + ": " + strerror(errno));
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        unsigned int id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%8x.%4s", &id, suffix) == 2 && strcmp(suffix, "seg") == 0) {
+            if (map_segment(id, false, 0) < 0) {
+                closedir(dp);
+                return -1;
+            }
+        }
+    }
+    closedir(dp);
+
+    if (load_index() < 0) {
+        // No usable index, rebuild it from the records.
+        index.clear();
+        for (auto &it : segments) {
+            it.second.live = 0;
+            it.second.live_bytes = 0;
+            scan_segment(it.first, 0);
+        }
+    }
+
+    active = segments.empty() ? 0 : segments.rbegin()->first;
+
+    // A saved index and the records scanned after it may interleave.
+    for (auto &it : index) {
+        deque<record_ref> &refs = it.second;
+        sort(refs.begin(), refs.end(), [](const record_ref &a, const record_ref &b) {
+            return a.seq < b.seq;
+        });
+
+        // compact() writes the moved copy before it kills the original; a
+        // crash in between leaves both live. The copy is the newer one.
+        size_t kept = 0;
+        for (size_t i = 0; i < refs.size(); ++i) {
+            if (kept > 0 && refs[kept - 1].seq == refs[i].seq) {
+                record_ref &prev = refs[kept - 1];
+                bool prev_older = (prev.segment != refs[i].segment) ? prev.segment < refs[i].segment : prev.offset < refs[i].offset;
+                consume(prev_older ? prev : refs[i]);
+                if (prev_older) {
+                    prev = refs[i];
+                }
+                continue;
+            }
+            refs[kept++] = refs[i];
+        }
+        refs.resize(kept);
+    }
+
+    vector<uint32_t> dead;
+    for (auto &it : segments) {
+        if (it.second.live == 0 && it.first != active) {
+            dead.push_back(it.first);
+        }
+    }
+    for (auto id : dead) {
+        drop_segment(id);
+    }
+
+    return 0;
+}
+
+int offline_store::append_locked(const std::string &user, const char *msg, size_t len, uint32_t plain_len, uint64_t seq, record_ref &ref)
+{
+    size_t rec = record_size(user.size(), len);
+
+    auto it = segments.find(active);
+    if (it == segments.end() || rec > it->second.size - it->second.tail) {
+        if (map_segment(active + 1, true, std::max(segment_size, rec + SEGMENT_HDR)) < 0) {
+            return -1;
+        }
+        active += 1;
+        it = segments.find(active);
+    }
+
+    segment &seg = it->second;
+    char *dst = seg.base + seg.tail;
+    record_header *hdr = reinterpret_cast<record_header *>(dst);
+    hdr->user_len = static_cast<uint32_t>(user.size());
+    hdr->msg_len = static_cast<uint32_t>(len);
+    hdr->plain_len = plain_len;
+    hdr->seq = seq;
+    memcpy(dst + sizeof (record_header), user.data(), user.size());
+    memcpy(dst + sizeof (record_header) + user.size(), msg, len);
+    __atomic_store_n(&hdr->magic, RECORD_LIVE, __ATOMIC_RELEASE);
+
+    ref.seq = seq;
+    ref.segment = active;
+    ref.offset = static_cast<uint32_t>(seg.tail);
+
+    seg.tail += rec;
+    seg.live += 1;
+    seg.live_bytes += rec;
+
+    return 0;
+}
+
+int offline_store::append(const std::string &user, const char *msg, size_t len)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    uint32_t old_active = active;
+    uint32_t plain_len = 0;
+    if (level > 0 && deflate_record(msg, len) == 0) {
+        plain_len = static_cast<uint32_t>(len);
+        msg = zbuf.data();
+        len = zbuf.size();
+    }
+
+    record_ref ref;
+    if (append_locked(user, msg, len, plain_len, next_seq, ref) < 0) {
+        return -1;
+    }
+    ++next_seq;
+    index[user].push_back(ref);
+
+    // A segment was sealed; a good time to reclaim space in older ones.
+    if (active != old_active) {
+        compact();
+    }
+
+    return 0;
+}
+
+void offline_store::consume(const record_ref &ref)
+{
+    segment &seg = segments[ref.segment];
+    record_header *hdr = reinterpret_cast<record_header *>(seg.base + ref.offset);
+    hdr->magic = RECORD_DEAD;
+
+    seg.live -= 1;
+    seg.live_bytes -= record_size(hdr->user_len, hdr->msg_len);
+    if (seg.live == 0 && ref.segment != active) {
+        drop_segment(ref.segment);
+    }
+}
+
+void offline_store::compact()
+{
+    using namespace std;
+
+    // Sealed segments that are more than half dead.
+    vector<uint32_t> sparse;
+    for (auto &it : segments) {
+        if (it.first != active && it.second.live_bytes * 2 < it.second.tail - SEGMENT_HDR) {
+            sparse.push_back(it.first);
+        }
+    }
+    if (sparse.empty()) {
+        return;
+    }
+
+    for (auto id : sparse) {
+        size_t off = SEGMENT_HDR;
+        while (segments.count(id) != 0 && off < segments[id].tail) {
+            const record_header *hdr = reinterpret_cast<const record_header *>(segments[id].base + off);
+            size_t rec = record_size(hdr->user_len, hdr->msg_len);
+            if (hdr->magic == RECORD_LIVE) {
+                const char *data = segments[id].base + off + sizeof (record_header);
+                string user(data, hdr->user_len);
+
+                // References of a user are sorted by `seq`.
+                auto user_it = index.find(user);
+                deque<record_ref>::iterator ref;
+                if (user_it != index.end()) {
+                    deque<record_ref> &refs = user_it->second;
+                    ref = lower_bound(refs.begin(), refs.end(), hdr->seq, [](const record_ref &r, uint64_t seq) {
+                        return r.seq < seq;
+                    });
+                }
+
+                // A live record the index does not know is never read; it
+                // is flagged dead rather than moved. A saved index does not
+                // count it as live, so the counts of the segment stay.
+                if (user_it == index.end() || ref == user_it->second.end() || ref->seq != hdr->seq ||
+                    ref->segment != id || ref->offset != off) {
+                    reinterpret_cast<record_header *>(segments[id].base + off)->magic = RECORD_DEAD;
+                    off += rec;
+                    continue;
+                }
+
+                record_ref moved;
+                if (append_locked(user, data + hdr->user_len, hdr->msg_len, hdr->plain_len, hdr->seq, moved) < 0) {
+                    return;
+                }
+                record_ref old = *ref;
+                *ref = moved;
+                // May unmap the segment once its last record moved.
+                consume(old);
+            }
+            off += rec;
+        }
+    }
+
+    write_index();
+}
+
+size_t offline_store::read(const std::string &user, size_t skip, size_t max_bytes, std::string &out)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = index.find(user);
+    if (it == index.end() || it->second.size() <= skip) {
+        return 0;
+    }
+
+    uint64_t last;
+    return read_refs(user, it->second.begin() + skip, it->second.end(), max_bytes, out, last);
+}
+
+size_t offline_store::read_after(const std::string &user, uint64_t after, size_t max_bytes, std::string &out, uint64_t &first, uint64_t &last)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = index.find(user);
+    if (it == index.end()) {
+        return 0;
+    }
+
+    auto from = std::upper_bound(it->second.cbegin(), it->second.cend(), after, [](uint64_t seq, const record_ref &r) {
+        return seq < r.seq;
+    });
+    if (from == it->second.cend()) {
+        return 0;
+    }
+
+    first = from->seq;
+    return read_refs(user, from, it->second.cend(), max_bytes, out, last);
+}
+
+size_t offline_store::read_refs(const std::string &user, std::deque<record_ref>::const_iterator from, std::deque<record_ref>::const_iterator to,
+    size_t max_bytes, std::string &out, uint64_t &last)
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    for (auto ref_it = from; ref_it != to; ++ref_it) {
+        const record_ref &ref = *ref_it;
+        const segment &seg = segments[ref.segment];
+        const record_header *hdr = reinterpret_cast<const record_header *>(seg.base + ref.offset);
+        size_t size = (hdr->plain_len > 0) ? hdr->plain_len : hdr->msg_len;
+        if (count > 0 && bytes + size > max_bytes) {
+            break;
+        }
+
+        const char *msg = seg.base + ref.offset + sizeof (record_header) + hdr->user_len;
+        if (hdr->plain_len == 0) {
+            out.append(msg, hdr->msg_len);
+        }
+        else if (inflate_record(msg, hdr->msg_len, hdr->plain_len, out) < 0) {
+            // Still counted, so it is consumed with the others.
+            report("Off-line store: skipping corrupt message of %s.", user);
+        }
+        bytes += size;
+        ++count;
+        last = ref.seq;
+    }
+
+    return count;
+}
+
+void offline_store::consume(const std::string &user, size_t count)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = index.find(user);
+    if (it == index.end()) {
+        return;
+    }
+
+    std::deque<record_ref> &refs = it->second;
+    for (size_t i = 0; i < count && !refs.empty(); ++i) {
+        consume(refs.front());
+        refs.pop_front();
+    }
+
+    if (refs.empty()) {
+        index.erase(it);
+    }
+}
+
+void offline_store::consume_range(const std::string &user, uint64_t first, uint64_t last)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = index.find(user);
+    if (it == index.end()) {
+        return;
+    }
+
+    std::deque<record_ref> &refs = it->second;
+    auto from = std::lower_bound(refs.begin(), refs.end(), first, [](const record_ref &r, uint64_t seq) {
+        return r.seq < seq;
+    });
+    auto to = from;
+    while (to != refs.end() && to->seq <= last) {
+        consume(*to);
+        ++to;
+    }
+    refs.erase(from, to);
+
+    if (refs.empty()) {
+        index.erase(it);
+    }
+}
+
+size_t offline_store::pending(size_t &users, size_t &bytes)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    size_t count = 0;
+    bytes = 0;
+    for (auto &it : segments) {
+        count += it.second.live;
+        bytes += it.second.live_bytes;
+    }
+    users = index.size();
+
+    return count;
+}
+
+int offline_store::save_index()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return write_index();
+}
@@ -0,0 +1,156 @@
+#ifndef __OFFLINE_STORE_HPP__
+#define __OFFLINE_STORE_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+
+// Default size of a segment file.
+#define SEGMENT_SIZE (4 << 20)
+
+struct z_stream_s;
+class logger;
+
+/**
+ * Append-only on-disk log of off-line messages. Messages are appended to
+ * memory-mapped segment files; only a small per-user index of record
+ * positions stays in RAM. Consumed records are flagged in place, segments
+ * without live records are deleted, and mostly dead ones are compacted into
+ * the active segment. The index is saved to `index` in the directory so a
+ * restart only scans records appended after the last save. Messages may be
+ * kept deflated, each on its own with a preset dictionary, so any of them
+ * can be read, consumed or moved alone.
+ *
+ * All methods are thread-safe.
+ */
+class offline_store
+{
+    // Position of a record; `seq` is its global append order.
+    struct record_ref
+    {
+        uint64_t seq;
+        uint32_t segment;
+        uint32_t offset;
+    };
+
+    struct segment
+    {
+        int fd;
+        char *base;
+        size_t size;
+        size_t tail;       // end of the last record
+        size_t live;       // records not consumed yet
+        size_t live_bytes;
+    };
+
+    std::mutex mtx;
+    std::string dir;
+    size_t segment_size;
+    std::map<uint32_t, segment> segments;
+    std::unordered_map<std::string, std::deque<record_ref>> index;
+    uint32_t active;
+    uint64_t next_seq;
+    int level;            // deflate level, 0 to store messages as is
+    z_stream_s *zdeflate; // reused for every record, under `mtx`
+    z_stream_s *zinflate;
+    std::string zbuf;
+    logger *log;          // errors go to stderr without one
+
+    std::string segment_path(uint32_t id) const;
+    int map_segment(uint32_t id, bool create, size_t size);
+    void drop_segment(uint32_t id);
+    int scan_segment(uint32_t id, size_t from);
+    int load_index();
+    int write_index();
+    int append_locked(const std::string &user, const char *msg, size_t len, uint32_t plain_len, uint64_t seq, record_ref &ref);
+    int deflate_record(const char *msg, size_t len);
+    int inflate_record(const char *data, size_t len, size_t plain_len, std::string &out);
+    void consume(const record_ref &ref);
+    size_t read_refs(const std::string &user, std::deque<record_ref>::const_iterator from, std::deque<record_ref>::const_iterator to,
+        size_t max_bytes, std::string &out, uint64_t &last);
+    void compact();
+    void report(const char *format, const std::string &text) const;
+
+public:
+    offline_store();
+    ~offline_store();
+
+    /**
+    * Description: Open the store in directory `path`, creating it if needed,
+    *              and load the index.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int open(const std::string &path, size_t seg_size = SEGMENT_SIZE);
+
+    /**
+    * Description: Report errors through `event_log` instead of stderr, so
+    *              no reactor blocks on writing them.
+    */
+    void set_logger(logger &event_log);
+
+    /**
+    * Description: Deflate messages appended from now on at `level` (1-9),
+    *              or store them as is with 0, the default. A message stays
+    *              as is if deflating does not make it smaller. Messages of
+    *              either kind are read back the same.
+    */
+    void set_compression(int level);
+
+    /**
+    * Description: Append message `msg` of `len` bytes for `user`.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int append(const std::string &user, const char *msg, size_t len);
+
+    /**
+    * Description: Skip the `skip` oldest messages of `user`, and append the
+    *              following ones to `out`, as many as fit in `max_bytes` but
+    *              at least one. They stay in the store until consume().
+    * Return: Number of messages read, 0 if there is none.
+    */
+    size_t read(const std::string &user, size_t skip, size_t max_bytes, std::string &out);
+
+    /**
+    * Description: Remove the `count` oldest messages of `user`, after they
+    *              have been delivered.
+    */
+    void consume(const std::string &user, size_t count);
+
+    /**
+    * Description: Append the oldest messages of `user` with a sequence number
+    *              above `after` to `out`, as many as fit in `max_bytes` but at
+    *              least one, and set `first` and `last` to the numbers of the
+    *              first and last of them. Unlike read(), this stays right
+    *              while other messages of the user are consumed.
+    * Return: Number of messages read, 0 if there is none.
+    */
+    size_t read_after(const std::string &user, uint64_t after, size_t max_bytes, std::string &out, uint64_t &first, uint64_t &last);
+
+    /**
+    * Description: Remove the messages of `user` numbered `first` to `last`,
+    *              those still there.
+    */
+    void consume_range(const std::string &user, uint64_t first, uint64_t last);
+
+    /**
+    * Description: Count the messages not consumed yet, and the users they
+    *              are for and the bytes they take in the segments.
+    * Return: Number of messages.
+    */
+    size_t pending(size_t &users, size_t &bytes);
+
+    /**
+    * Description: Save the index so the next open() does not have to scan
+    *              the whole log.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int save_index();
+};
+
+#endif
@@ -1,208 +1,3016 @@
 #include <iostream>
 #include <fstream>
 #include <exception>
-#include <map>
+#include <vector>
+#include <new>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "commons.hpp"
 #include "my_send_recv.hpp"
+#include "frame.hpp"
+#include "mailbox.hpp"
+#include "offline_store.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include "uring.hpp"
+#include "timer_wheel.hpp"
+#include "cluster.hpp"
+#include "handover.hpp"
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <endian.h>
+}
+
+#define LISTEN_PORT 1733
+#define BUFLEN 65536
+#define MAX_EVENTS 64
+#define MAX_SHARDS 256
+#define USER_LOCKS 64
+#define SLAB_SHIFT 8
+#define MAX_USERS (1 << 20)
+#define BACKLOG_CHUNK (64 << 10)
+#define ACCEPT_BATCH 256
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024
+#define URING_GROUP 0
+#define SEND_IOVS 64
+#define TIMER_TICK_NS 100000000ull
+#define NS_PER_SEC 1000000000ull
+// Wait of an io_uring shard for its cancelled requests before a handover.
+#define HANDOVER_POLL_MS 100
+
+// Kind of request an io_uring completion belongs to, in the top byte of its
+// user data. Below are the generation (24 bits) and the fd.
+enum uring_op
+{
+    URING_ACCEPT = 1,
+    URING_WAKE,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+// Frames between the nodes of a cluster. The payload of each starts with the
+// name of the user it is about, as one length byte and the name.
+enum link_type
+{
+    LINK_USER = 1, // then 1 if the user is on-line at the sender: directory
+                   // sync when a link comes up
+    LINK_ONLINE,   // then the IP address: the user logged in at the sender
+    LINK_OFFLINE,  // the user left the sender
+    LINK_CHAT,     // then a message frame for the user
+    LINK_STORE,    // then an off-line message frame, for the home node
+    LINK_FETCH,    // send the off-line messages of the user
+    LINK_BACKLOG,  // then the store numbers of the first and last message
+                   // (8 bytes each) and off-line message frames of the user
+    LINK_ACK       // then the two store numbers of a LINK_BACKLOG kept by
+                   // the receiver, which the sender may now remove
+};
+
+char welcome_msg[] = "Welcome to my netprog hw3 chat server\n";
+
+struct server_options
+{
+    size_t high_watermark;
+    size_t low_watermark;
+    overflow_policy policy;
+    int threads;
+    const char *store_dir;
+    size_t max_message;
+    log_level min_log_level;
+    bool uring;
+    int listen_backlog;
+    size_t max_pending; // per reactor thread
+    unsigned login_timeout; // seconds, 0 for none
+    unsigned idle_timeout;
+    unsigned heartbeat;
+    int port;
+    int node;                  // number of this node in the cluster
+    const char *cluster_nodes; // link addresses of all nodes, or NULL
+    const char *cluster_key;   // file with the shared secret of the links
+    const char *handover_path; // Unix socket a new process takes over at
+    int compress_level;        // deflate level of connections and the store
+};
+
+server_options options = { 1 << 20, 256 << 10, OVERFLOW_SPILL, 1, "offline", 1 << 20, LOG_INFO, false, SOMAXCONN, 4096, 30, 0, 0, LISTEN_PORT, 0, NULL, NULL, NULL, 6 };
+
+/**
+ * A message formatted once for each wire format, shared by all recipients.
+ */
+struct wire_msg
+{
+    shared_buf text;  // text protocol line
+    shared_buf frame; // binary protocol frame
+};
+
+/**
+ * A message held back by the overflow policy, in the wire format of its
+ * client. `stored` goes to the off-line store if the client leaves before
+ * it is sent; NULL for notices.
+ */
+struct spilled_msg
+{
+    shared_buf wire;
+    shared_buf stored;
+};
+
+// Sorted user IDs of the members of a group.
+typedef std::shared_ptr<const std::vector<uint32_t>> member_list;
+
+struct group;
+struct user;
+
+/**
+ * A connection, from accept until it closes. Only its reactor thread, the
+ * `owner`, touches it.
+ */
+class client : public my_send_recv
+{
+public:
+    user *entry;             // directory entry once logged in, or NULL
+    struct sockaddr_storage addr;
+    std::deque<spilled_msg> spilled_msgs;
+    bool binary; // negotiated binary framing
+    bool out_watched;
+    int owner;
+    bool backlog;            // off-line messages are still being streamed
+    uint64_t backlog_sent;   // store number of the last message streamed
+    uint64_t backlog_prev;   // and of the last one before that chunk
+    uint64_t backlog_fetched; // at the home node, of the last one fetched
+    bool chat_open;                   // more pieces of a chat are expected
+    std::vector<user *> chat_peers;   // recipients of that chat
+    group *chat_group;                // or the group it goes to
+    member_list chat_members;         // members of the group when it started
+    size_t chat_bytes;                // bytes of it relayed so far
+    uint32_t chat_time;
+    bool send_queued;                 // io_uring: in the `dirty` list
+    bool send_inflight;               // io_uring: a SENDMSG is submitted
+    struct msghdr send_hdr;           // and these describe its data
+    struct iovec send_iov[SEND_IOVS];
+    timer_node timer;                 // login deadline, or idle and heartbeat check
+    uint64_t last_active;             // clock of the last data received
+    uint64_t last_heartbeat;          // clock of the last heartbeat sent
+
+    client(int fd, int owner, struct sockaddr_storage addr)
+    : my_send_recv(fd), entry(NULL), addr(addr), binary(false), out_watched(false), owner(owner), backlog(false), backlog_sent(0), backlog_prev(0), backlog_fetched(0),
+    chat_open(false), chat_group(NULL), chat_bytes(0), chat_time(0), send_queued(false), send_inflight(false), send_hdr(), last_active(0), last_heartbeat(0)
+    {
+        timer.data = this;
+    }
+};
+
+/**
+ * A user known to the server. The connection is only allocated while the
+ * user is on-line here, so users that are away or on another node take
+ * little room in the directory.
+ */
+struct user
+{
+    std::string name;
+    uint32_t id;
+    client *cl;        // connection while on-line here, or NULL
+    int owner;         // reactor thread of `cl`
+    int node;          // cluster node the user is on-line at
+    int push_node;     // node the off-line messages went to
+    uint64_t push_seq; // store number of the last one sent
+
+    explicit user(const std::string &name)
+    : name(name), id(0), cl(NULL), owner(-1), node(-1), push_node(-1), push_seq(0)
+    {
+
+    }
+};
+
+/**
+ * Users known to the server, shared by all reactor threads. A name is interned
+ * to a dense user ID through an open-addressing hash table, and the entries
+ * live in fixed-size slabs indexed by that ID. Entries are never removed and
+ * slabs never move, so a user pointer stays valid for the whole run. `cl`,
+ * `owner`, `node` and `push_*` of an entry, and its off-line messages in the
+ * store, may only be touched with lock_of() held.
+ */
+class user_directory
+{
+    // `id` is the user ID plus one, 0 marks an empty slot.
+    struct slot
+    {
+        uint32_t hash;
+        uint32_t id;
+    };
+
+    pthread_rwlock_t rwlock;
+    std::vector<slot> slots;
+    user *slabs[MAX_USERS >> SLAB_SHIFT];
+    uint32_t count;
+    std::mutex user_locks[USER_LOCKS];
+
+    static uint32_t hash_of(const char *name, size_t len)
+    {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < len; ++i) {
+            hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Slot holding `name`, or the empty slot where it would go.
+    size_t probe(const char *name, size_t len, uint32_t hash)
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            const slot &sl = slots[i];
+            if (sl.id == 0) {
+                return i;
+            }
+            if (sl.hash == hash) {
+                const std::string &name_at = at(sl.id - 1).name;
+                if (name_at.size() == len && memcmp(name_at.data(), name, len) == 0) {
+                    return i;
+                }
+            }
+        }
+    }
+
+    void grow()
+    {
+        std::vector<slot> old(slots.size() * 2, slot());
+        old.swap(slots);
+
+        size_t mask = slots.size() - 1;
+        for (auto &sl : old) {
+            if (sl.id != 0) {
+                size_t i = sl.hash & mask;
+                while (slots[i].id != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = sl;
+            }
+        }
+    }
+
+public:
+    user_directory()
+    : slots(1024, slot()), slabs(), count(0)
+    {
+        pthread_rwlock_init(&rwlock, NULL);
+    }
+
+    ~user_directory()
+    {
+        for (uint32_t id = 0; id < count; ++id) {
+            at(id).~user();
+        }
+        for (auto slab : slabs) {
+            operator delete(slab);
+        }
+    }
+
+    user &at(uint32_t id)
+    {
+        return slabs[id >> SLAB_SHIFT][id & ((1 << SLAB_SHIFT) - 1)];
+    }
+
+    user *find(const char *name, size_t len)
+    {
+        uint32_t hash = hash_of(name, len);
+
+        pthread_rwlock_rdlock(&rwlock);
+        const slot &sl = slots[probe(name, len, hash)];
+        user *u = (sl.id == 0) ? NULL : &at(sl.id - 1);
+        pthread_rwlock_unlock(&rwlock);
+        return u;
+    }
+
+    /**
+    * Return: The entry of `name` and true if it was created, or false if
+    *         the user existed. NULL if the directory is full.
+    */
+    std::pair<user *, bool> insert(const std::string &name)
+    {
+        uint32_t hash = hash_of(name.data(), name.size());
+
+        pthread_rwlock_wrlock(&rwlock);
+        size_t i = probe(name.data(), name.size(), hash);
+        if (slots[i].id != 0) {
+            user *found = &at(slots[i].id - 1);
+            pthread_rwlock_unlock(&rwlock);
+            return std::make_pair(found, false);
+        }
+
+        if (count == MAX_USERS) {
+            pthread_rwlock_unlock(&rwlock);
+            return std::make_pair(static_cast<user *>(NULL), false);
+        }
+
+        uint32_t id = count;
+        user *&slab = slabs[id >> SLAB_SHIFT];
+        if (slab == NULL) {
+            slab = static_cast<user *>(operator new(sizeof (user) << SLAB_SHIFT));
+        }
+        user *entry = new (&at(id)) user(name);
+        entry->id = id;
+        ++count;
+
+        slots[i].hash = hash;
+        slots[i].id = id + 1;
+        // Keep probe sequences short.
+        if (count * 10 > slots.size() * 7) {
+            grow();
+        }
+
+        pthread_rwlock_unlock(&rwlock);
+        return std::make_pair(entry, true);
+    }
+
+    std::mutex &lock_of(const user &u)
+    {
+        return user_locks[u.id % USER_LOCKS];
+    }
+
+    uint32_t size()
+    {
+        pthread_rwlock_rdlock(&rwlock);
+        uint32_t n = count;
+        pthread_rwlock_unlock(&rwlock);
+        return n;
+    }
+};
+
+/**
+ * A named group of users. The member list is replaced as a whole on every
+ * join or leave, so a message to the group fans out over a snapshot of it
+ * without holding any lock.
+ */
+struct group
+{
+    std::string name;
+    std::mutex mtx;
+    member_list members;
+
+    explicit group(const std::string &name)
+    : name(name), members(std::make_shared<const std::vector<uint32_t>>())
+    {
+
+    }
+
+    member_list snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return members;
+    }
+
+    /**
+    * Return: true if `id` joined, false if it was a member already.
+    */
+    bool join(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto pos = std::lower_bound(members->begin(), members->end(), id);
+        if (pos != members->end() && *pos == id) {
+            return false;
+        }
+
+        auto next = std::make_shared<std::vector<uint32_t>>();
+        next->reserve(members->size() + 1);
+        next->insert(next->end(), members->begin(), pos);
+        next->push_back(id);
+        next->insert(next->end(), pos, members->end());
+        members = next;
+        return true;
+    }
+
+    /**
+    * Return: true if `id` left, false if it was not a member.
+    */
+    bool leave(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto pos = std::lower_bound(members->begin(), members->end(), id);
+        if (pos == members->end() || *pos != id) {
+            return false;
+        }
+
+        auto next = std::make_shared<std::vector<uint32_t>>();
+        next->reserve(members->size() - 1);
+        next->insert(next->end(), members->begin(), pos);
+        next->insert(next->end(), pos + 1, members->end());
+        members = next;
+        return true;
+    }
+
+    static bool has_member(const member_list &members, uint32_t id)
+    {
+        return std::binary_search(members->begin(), members->end(), id);
+    }
+};
+
+/**
+ * Groups known to the server, shared by all reactor threads. Groups are never
+ * removed, so a group pointer stays valid for the whole run.
+ */
+class group_directory
+{
+    pthread_rwlock_t rwlock;
+    std::unordered_map<std::string, group *> groups;
+
+public:
+    group_directory()
+    {
+        pthread_rwlock_init(&rwlock, NULL);
+    }
+
+    ~group_directory()
+    {
+        for (auto &entry : groups) {
+            delete entry.second;
+        }
+    }
+
+    group *find(const std::string &name)
+    {
+        pthread_rwlock_rdlock(&rwlock);
+        auto it = groups.find(name);
+        group *g = (it == groups.end()) ? NULL : it->second;
+        pthread_rwlock_unlock(&rwlock);
+        return g;
+    }
+
+    /**
+    * Return: The group `name` and true if it was created, or false if it
+    *         existed.
+    */
+    std::pair<group *, bool> create(const std::string &name)
+    {
+        pthread_rwlock_wrlock(&rwlock);
+        group *&g = groups[name];
+        bool created = (g == NULL);
+        if (created) {
+            g = new group(name);
+        }
+        group *found = g;
+        pthread_rwlock_unlock(&rwlock);
+        return std::make_pair(found, created);
+    }
+
+    std::vector<group *> list()
+    {
+        std::vector<group *> all;
+        pthread_rwlock_rdlock(&rwlock);
+        for (auto &entry : groups) {
+            all.push_back(entry.second);
+        }
+        pthread_rwlock_unlock(&rwlock);
+        return all;
+    }
+};
+
+enum mail_type
+{
+    MAIL_DELIVER,  // chat message for `target`
+    MAIL_FANOUT,   // chat message for every user in `targets`
+    MAIL_NOTICE,   // server notice for `target`
+    MAIL_BROADCAST, // notice for every user of the shard except `target`
+    MAIL_LINK,      // frame `offline_msg` from cluster node `sender_shard`
+    MAIL_NODE_UP,   // the link to cluster node `sender_shard` came up
+    MAIL_NODE_DOWN, // or went down
+    MAIL_HANDOVER   // stop for a new process to take over
+};
+
+/**
+ * Work handed from one reactor thread to the thread owning the recipient.
+ */
+struct mail
+{
+    mail_type type;
+    user *target;
+    user *sender;
+    int sender_shard;
+    wire_msg msg;
+    shared_buf offline_msg;
+    mail *next;
+    std::vector<user *> targets;
+};
+
+enum conn_state
+{
+    CONN_FREE,  // fd is not a connection of this shard
+    CONN_LOGIN, // waiting for the `user` command
+    CONN_ONLINE // logged in
+};
+
+/**
+ * Entry of the connection table of a shard, indexed by fd.
+ */
+struct conn
+{
+    conn_state state;
+    client *cl;  // owned by the table
+    size_t pos;  // index in `online` while CONN_ONLINE
+};
+
+/**
+ * Statistics of one shard. Only its reactor thread updates them; the `stats`
+ * command adds them up over all shards.
+ */
+struct shard_metrics
+{
+    counter accepted;       // connections accepted
+    counter accept_pauses;  // pending connection cap or fd limit reached
+    counter login_timeouts; // closed before sending `user` in time
+    counter idle_evictions; // logged in users silent for too long
+    counter heartbeats;     // sent to quiet users
+    counter logins;
+    counter logins_refused; // name in use or too many users
+    counter leaves;
+    counter online;         // gauge: logged in users
+    counter pending;        // gauge: connections not logged in yet
+    counter commands;       // commands and frames run
+    counter chats;          // chats accepted for relay
+    counter pieces;         // message frames relayed
+    counter chat_bytes;
+    counter delivered;      // queued for an on-line recipient
+    counter stored;         // stored for an off-line or catching up recipient
+    counter dropped;        // dropped by the overflow policy
+    counter forwarded;      // handed to the shard of the recipient
+    counter remote;         // handed to the cluster node of the recipient
+    counter link_frames;    // frames run from other cluster nodes
+    counter mails;          // mails run from other shards
+    counter loops;          // event loop iterations
+    histogram fan_out;      // recipients per chat
+    histogram loop_events;  // events per iteration
+    histogram loop_time;    // nanoseconds spent on an iteration
+};
+
+/**
+ * One reactor thread and the connections it owns.
+ */
+struct shard
+{
+    int id;
+    int listenfd;
+    int epollfd;
+    int wakefd;
+    pthread_t tid;
+    std::vector<conn> conns;
+    std::vector<client *> online; // CONN_ONLINE users, for fan-out
+    mailbox<mail> inbox;
+    parsed_cmd cmd;
+    std::vector<std::vector<user *>> forward; // fan-out recipients, by owner
+    shard_metrics metrics;
+    bool accepting;                // false while accepting is paused
+    uint32_t accept_gen;           // io_uring: of the armed accept
+    uring *ring;                   // NULL when the shard runs on epoll
+    std::vector<uint32_t> gens;    // io_uring: generation of each fd
+    std::vector<client *> dirty;   // io_uring: clients with output to submit
+    std::vector<client *> left;    // clients that left, freed after the
+                                   // loop iteration
+    timer_wheel *wheel;            // timers of the connections
+    uint64_t now;                  // clock of the current loop iteration
+    bool stopping;                 // handing the connections over
+};
+
+user_directory directory;
+group_directory groups;
+offline_store offline;
+logger event_log;
+cluster federation;
+shard *shards[MAX_SHARDS];
+int shard_count = 0;
+
+// Shards stopped for a handover wait here.
+std::mutex park_mtx;
+std::condition_variable park_cv;
+int parked_shards = 0;
+
+// Set by SIGINT once the reactors run; the first shard then shuts down.
+volatile sig_atomic_t serving = 0;
+volatile sig_atomic_t interrupted = 0;
+
+static int accept_connection(shard &sh);
+static int start_client(shard &sh, int clientfd, const struct sockaddr_storage &client_addr);
+static int serve_client(shard &sh, client &cl);
+static int relay_msg(shard &sh, const parsed_cmd &cmd, client &cl, uint8_t flags);
+static int client_leave(shard &sh, client &cl);
+static int user_login(shard &sh, client &cl);
+
+/**
+ * Descrption: Put `cl` in the connection table of `sh` under its fd.
+ */
+static void add_conn(shard &sh, conn_state state, client *cl);
+
+/**
+ * Descrption: Remove `fd` from the connection table of `sh` and free its
+ *             client; right away if it had not logged in, otherwise at the
+ *             end of the loop iteration, as the caller may still use it.
+ */
+static void remove_conn(shard &sh, int fd);
+
+/**
+ * Descrption: Move logged in `cl` to the on-line connections of `sh`.
+ */
+static void set_online(shard &sh, client &cl);
+
+/**
+ * Descrption: Free the clients that left in this loop iteration.
+ */
+static void free_left(shard &sh);
+
+/**
+ * Descrption: Run every complete command in the input buffer of client.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int serve_commands(shard &sh, client &cl);
+
+/**
+ * Descrption: Relay FRAME_CHUNK `frame` of `len` bytes, the next piece of the
+ *             chat `cl` is sending.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int relay_chunk(shard &sh, client &cl, const char *frame, size_t len);
+
+/**
+ * Descrption: Relay `len` bytes of the chat `cl` is sending to its
+ *             recipients, as many frames as needed. The chat is cut short
+ *             once it exceeds the message size limit.
+ */
+static void relay_piece(shard &sh, client &cl, const char *msg, size_t len, uint8_t flags);
+
+/**
+ * Descrption: Deliver one message of the chat `cl` is sending to each
+ *             recipient. Recipients of another thread are handed over in
+ *             one mail per thread.
+ */
+static void fan_out(shard &sh, client &cl, const wire_msg &msg, const shared_buf &offline_msg);
+
+/**
+ * Descrption: Forget the recipients of the chat `cl` is sending.
+ */
+static void end_chat(client &cl);
+
+/**
+ * Descrption: Run group command `create`, `join` or `leave`.
+ */
+static void group_command(client &cl, const parsed_cmd &cmd);
+
+/**
+ * Descrption: Send the server metrics to `cl`, if it connects from this host.
+ */
+static void stats_command(client &cl);
+
+/**
+ * Descrption: Stop taking connections off the listening socket of `sh`, which
+ *             the kernel keeps queueing in the listen backlog.
+ */
+static void pause_accept(shard &sh);
+
+/**
+ * Descrption: Take connections again once the shard is below its cap on
+ *             connections not logged in yet.
+ */
+static void resume_accept(shard &sh);
+
+/**
+ * Descrption: Bring the timer wheel of `sh` to `sh.now` and handle the timers
+ *             that came due: close connections that did not log in in time,
+ *             evict idle users and send heartbeats.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int run_timers(shard &sh);
+
+/**
+ * Descrption: Arm the idle and heartbeat check of logged in `cl` for the
+ *             earliest time one of them may be due, or disarm it if neither
+ *             is enabled.
+ */
+static void arm_online_timer(shard &sh, client &cl);
+
+/**
+ * Descrption: Add up the metrics of all shards.
+ * Return: Metrics in the Prometheus text format.
+ */
+static std::string render_metrics();
+
+/**
+ * Descrption: Log in the not-yet-logged-in connection `cl` as user `name`,
+ *             then start streaming its off-line messages. `cl` is freed if
+ *             the login is refused.
+ * Return: `cl`, or NULL if the name is in use or there are too many users.
+ */
+static client *login(shard &sh, client &cl, const std::string &name);
+
+/**
+ * Descrption: Tell the connection `cl` why its login is refused.
+ */
+static void refuse_login(client &cl, const std::string &reason);
+static void print_client(client &cl);
+static std::string get_ip(client &cl);
+
+/**
+ * Descrption: Log error `err` of `what` on the connection of `cl`. A peer
+ *             that reset or closed the connection is only a debug event.
+ */
+static void log_io_error(client &cl, const char *what, int err);
+
+/**
+ * Descrption: Clean exit when SIGINT received. Only wakes the first shard,
+ *             which calls interrupt_exit(), unless the server is not serving
+ *             yet.
+ */
+static void sigint_safe_exit(int sig);
+
+/**
+ * Descrption: Close the listening socket, save the off-line index, flush
+ *             the log and exit without running static destructors.
+ */
+static void interrupt_exit();
+
+/**
+ * Descrption: Create epoll instance and mailbox wakeup of a shard accepting
+ *             on the shared listening socket `listenfd`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int start_shard(shard &sh, int listenfd);
+
+/**
+ * Descrption: Event loop of a reactor thread.
+ * Return: Only returns if epoll fails.
+ */
+static void *reactor_main(void *arg);
+
+/**
+ * Descrption: Set up the io_uring instance of a shard and its receive
+ *             buffers, from the reactor thread itself.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int start_uring(shard &sh);
+
+/**
+ * Descrption: Event loop of a reactor thread on io_uring. Connections are
+ *             accepted and read by multishot requests, and the output of
+ *             every client written to in an iteration goes to the kernel in
+ *             one submission along with the wait for the next completions.
+ * Return: Only returns if io_uring fails.
+ */
+static void *uring_main(shard &sh);
+
+/**
+ * Descrption: Run one io_uring completion.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int uring_complete(shard &sh, const struct io_uring_cqe &cqe);
+
+/**
+ * Descrption: Hand the `len` bytes received on `fd` to its connection and
+ *             run the commands they complete, or report the end of the input
+ *             if `err` is not -1 (0 for EOF).
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int uring_receive(shard &sh, int fd, const char *data, size_t len, int err);
+
+/**
+ * Descrption: Queue a multishot request for the connections of a shard, or
+ *             for the mailbox wakeups.
+ */
+static void arm_accept(shard &sh);
+static void arm_wake(shard &sh);
+
+/**
+ * Descrption: Queue a SENDMSG of the output queue of every client written
+ *             to since the last call.
+ */
+static void submit_sends(shard &sh);
+
+/**
+ * Descrption: Register `fd` to epoll instance of shard for readable events,
+ *             or queue a multishot receive on io_uring.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int watch_fd(shard &sh, int fd);
+
+/**
+ * Descrption: Remove `fd` from epoll instance of shard, or cancel its io_uring
+ *             requests. Must precede closing `fd`.
+ */
+static void unwatch_fd(shard &sh, int fd);
+
+/**
+ * Descrption: Watch client for writability only while its output queue has
+ *             pending bytes. On io_uring, queue it for submit_sends().
+ */
+static void update_watch(client &cl);
+
+/**
+ * Descrption: Send `msg` to client in its wire format without blocking. Must
+ *             be called by the owner thread. Messages refused by a congested
+ *             OVERFLOW_SPILL queue are kept in `spilled_msgs` along with
+ *             `stored`, and an OVERFLOW_DISCONNECT client is shut down.
+ * Return: Same as my_send_recv::send().
+ */
+static int send_msg(client &cl, const wire_msg &msg, const shared_buf &stored = shared_buf());
+
+/**
+ * Descrption: Send server notice `line` to client, see above.
+ * Return: Same as my_send_recv::send().
+ */
+static int send_msg(client &cl, const std::string &line);
+
+/**
+ * Descrption: Format server notice `line` for both wire formats.
+ */
+static wire_msg make_notice(const std::string &line);
+
+/**
+ * Descrption: Convert frames read from the off-line store into the text
+ *             protocol unless `binary`.
+ */
+static std::string backlog_to_wire(std::string &chunk, bool binary);
+
+/**
+ * Descrption: Write pending output of a writable client, then resend spilled
+ *             messages once the queue is below its low watermark.
+ * Return: 0 if succeed, or -1 if the client left.
+ */
+static int drain_client(shard &sh, client &cl);
+
+/**
+ * Descrption: Send the next chunk of the off-line messages of `cl` once the
+ *             previous one has been written to the socket. Chunks leave the
+ *             store only after they went out, so a dropped connection gets
+ *             them again on the next login. New messages for `cl` go to the
+ *             store as well until it is empty, so they keep their order.
+ */
+static void stream_backlog(shard &sh, client &cl);
+
+/**
+ * Descrption: Hand `m` to the mailbox of shard `id`, waking it up if needed.
+ */
+static void post_mail(int id, mail *m);
+
+/**
+ * Descrption: Run everything other shards posted to this one.
+ */
+static void process_mail(shard &sh);
+
+/**
+ * Descrption: Deliver chat message `msg` to `peer`, directly if this shard
+ *             owns the peer and through the owner's mailbox otherwise. If the
+ *             peer is off-line, `offline_msg` is stored and `sender` (owned
+ *             by `sender_shard`) is told so.
+ */
+static void deliver(shard &sh, user &peer, const wire_msg &msg, const shared_buf &offline_msg, user *sender, int sender_shard, std::vector<user *> *forward = NULL);
+
+/**
+ * Descrption: Send server notice `msg` to `u` if it is on-line at shard `id`.
+ */
+static void notify(shard &sh, user &u, int id, const wire_msg &msg);
+
+/**
+ * Descrption: Send `msg` to every on-line user except `skip`.
+ */
+static void broadcast(shard &sh, const wire_msg &msg, const user *skip);
+
+/**
+ * Descrption: Send `msg` to every user of this shard except `skip`.
+ */
+static void broadcast_local(shard &sh, const wire_msg &msg, const user *skip);
+
+/**
+ * Descrption: Append `name` to link frame payload `out`, as one length byte
+ *             and the name.
+ */
+static void append_link_name(std::string &out, const std::string &name);
+
+/**
+ * Descrption: Store off-line message `frame` for `u` on its home node,
+ *             which is this one unless the server is part of a cluster.
+ *             Call with lock_of(u) held.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int store_offline(user &u, const char *frame, size_t len);
+
+/**
+ * Descrption: Send the off-line messages kept here for `u` to cluster node
+ *             `node`, after those already sent there. They are removed once
+ *             `node` acknowledges them. Call with lock_of(u) held.
+ */
+static void push_backlog(user &u, int node);
+
+/**
+ * Descrption: Hand a frame from cluster node `node` to the shard owning the
+ *             user it is about, or to the first one. Runs on the cluster
+ *             thread.
+ */
+static void link_received(int node, uint8_t type, const char *data, size_t len);
+
+/**
+ * Descrption: Tell the first shard that the link to `node` came up or went
+ *             down. Runs on the cluster thread.
+ */
+static void link_changed(int node, bool up);
+
+/**
+ * Descrption: Run `frame`, a type byte and the payload, from cluster node
+ *             `node`.
+ */
+static void run_link_frame(shard &sh, int node, const std::string &frame);
+
+/**
+ * Descrption: Tell cluster node `node`, whose link just came up, about every
+ *             user known here and who of them is on-line here; or forget who
+ *             was on-line there if it went down.
+ */
+static void sync_node(int node, bool up);
+
+/**
+ * Descrption: Make the sender IDs of the message frames in `frames`, which
+ *             come from cluster node `node`, distinct from the IDs here.
+ * Return: 0 if succeed, or -1 if the frames are malformed.
+ */
+static int mark_remote_senders(std::string &frames, int node);
+
+/**
+ * Descrption: Stop the event loop of `sh` for a new process to take over.
+ *             On io_uring, every request in flight is cancelled first.
+ */
+static void begin_handover(shard &sh);
+
+/**
+ * Descrption: Once `sh` has nothing in flight, wait until the handover
+ *             ends the process; if it fails, serve on.
+ */
+static void park_shard(shard &sh);
+
+/**
+ * Descrption: Whether a client of `sh` has an io_uring SENDMSG in flight.
+ */
+static bool sends_in_flight(shard &sh);
+
+/**
+ * Descrption: Wait for a new server process on handover socket `arg`, stop
+ *             all shards, pass it the listening socket, the connections and
+ *             the state of the users, and exit. Runs on a thread of its own.
+ */
+static void *handover_main(void *arg);
+
+/**
+ * Descrption: Close the connections of `sh` whose compressed streams cannot
+ *             be handed over, through the normal leave path, so their
+ *             spilled messages are stored and the others learn they left.
+ *             Call with all shards parked.
+ */
+static void leave_unsaved(shard &sh);
+
+/**
+ * Descrption: Serialize users, groups and connections for a new process,
+ *             adding the descriptors to pass to `fds`. Call with all shards
+ *             parked.
+ * Return: The state.
+ */
+static std::string save_state(std::vector<int> &fds);
+
+/**
+ * Descrption: Take over from the server process listening at the handover
+ *             socket, if there is one, and wait for it to exit.
+ * Return: 1 if taken over, 0 if no server listens there, or -1 if fail.
+ */
+static int take_over(std::vector<int> &fds, std::string &state);
+
+/**
+ * Descrption: Rebuild the users, groups and connections saved by
+ *             save_state(). The connections get the descriptors from
+ *             `fds[first]` on, and the shards must exist.
+ * Return: 0 if succeed, or -1 if the state is malformed.
+ */
+static int restore_state(state_reader &in, const std::vector<int> &fds, size_t first);
+
+/**
+ * Descrption: Watch the connections restored for `sh` and arm their timers,
+ *             once its reactor thread runs on epoll or io_uring.
+ */
+static void adopt_conns(shard &sh);
+
+/**
+ * Descrption: Parse command line options into `options`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int parse_options(int argc, char *argv[]);
+
+/**
+ * Descrption: Determine and return IPv4 or IPv6 address object.
+ * Return: IPv4 or IPv6 address object (sin_addr or sin6_addr).
+ */
+static const void *get_in_addr(const struct sockaddr &sa);
+
+/**
+ * Descrption: Start listening to clients. All shards accept on the one
+ *             socket, so a second server on the same port fails to bind.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int start_server(int &sockfd);
+
+/**
+ * Descrption: Print client info and send welcome message to client.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int welcome(client &cl);
+
+int main(int argc, char *argv[])
+{
+    if (parse_options(argc, argv) < 0) {
+        exit(1);
+    }
+
+    // Handle SIGINT
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigint_safe_exit;
+    sa.sa_flags = 0;
+
+    sigaction(SIGINT, &sa, NULL);
+
+    using namespace std;
+
+    // Lines are written by a thread of their own, never by a reactor.
+    if (event_log.start(STDOUT_FILENO, options.min_log_level) < 0) {
+        cerr << "Fail to start logger." << endl;
+        exit(1);
+    }
+
+    // A server running at the handover socket passes its sockets and state
+    // on and exits.
+    vector<int> fds;
+    string state;
+    int taken = 0;
+    if (options.handover_path != NULL) {
+        taken = take_over(fds, state);
+        if (taken < 0) {
+            perror("take_over");
+            exit(1);
+        }
+    }
+    state_reader saved(state);
+    size_t listeners = (taken > 0) ? saved.get_u32() : 0;
+    if (listeners > fds.size()) {
+        cerr << "Invalid state taken over." << endl;
+        exit(1);
+    }
+
+    offline.set_logger(event_log);
+    offline.set_compression(options.compress_level);
+    if (offline.open(options.store_dir) < 0) {
+        cerr << "Fail to open off-line message store." << endl;
+        exit(1);
+    }
+
+    // Start server. A process from before the shards shared one socket
+    // may pass several; connections waiting in the others are lost.
+    int listenfd = (listeners > 0) ? fds[0] : -1;
+    for (size_t i = 1; i < listeners; ++i) {
+        close(fds[i]);
+    }
+    if (listenfd < 0 && start_server(listenfd) != 0) {
+        cerr << "Fail to start server." << endl;
+        exit(1);
+    }
+    for (int i = 0; i < options.threads; ++i) {
+        shards[i] = new shard();
+        shards[i]->id = i;
+        shard_count = i + 1;
+
+        if (start_shard(*shards[i], listenfd) != 0) {
+            cerr << "Fail to start server." << endl;
+            exit(1);
+        }
+    }
+
+    if (taken > 0) {
+        if (restore_state(saved, fds, listeners) < 0) {
+            cerr << "Invalid state taken over." << endl;
+            exit(1);
+        }
+        event_log.log(LOG_INFO, "Took over %s connection(s) from the previous server process.", to_string(fds.size() - listeners));
+    }
+
+    // Links post to the shards, which exist by now.
+    if (options.cluster_nodes != NULL) {
+        vector<string> nodes;
+        string list = options.cluster_nodes;
+        for (size_t pos = 0; pos <= list.size(); ) {
+            size_t comma = min(list.find(',', pos), list.size());
+            nodes.push_back(list.substr(pos, comma - pos));
+            pos = comma + 1;
+        }
+        // Every node reads the same key; a trailing newline is not part of it.
+        string key;
+        if (options.cluster_key != NULL) {
+            ifstream key_file(options.cluster_key);
+            if (!getline(key_file, key) || key.empty()) {
+                cerr << "Fail to read cluster key from " << options.cluster_key << "." << endl;
+                exit(1);
+            }
+        }
+        else {
+            event_log.log(LOG_WARN, "No cluster key (-k); links are only checked by address.");
+        }
+        if (federation.start(options.node, nodes, key, link_received, link_changed, event_log) < 0) {
+            cerr << "Fail to join the cluster." << endl;
+            exit(1);
+        }
+        event_log.log(LOG_INFO, "Joined the cluster as node %s.", to_string(options.node) + " of " + to_string(nodes.size()));
+    }
+
+    // The next process to start with the same -U takes over from this one.
+    if (options.handover_path != NULL) {
+        int sock = handover_listen(options.handover_path);
+        pthread_t tid;
+        if (sock < 0 || pthread_create(&tid, NULL, handover_main, reinterpret_cast<void *>(static_cast<intptr_t>(sock))) != 0) {
+            perror("handover_listen");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
+    event_log.log(LOG_INFO, "Start listening at port %s with %u reactor thread(s).", to_string(options.port), NULL, shard_count);
+
+    for (int i = 1; i < shard_count; ++i) {
+        if (pthread_create(&shards[i]->tid, NULL, reactor_main, shards[i]) != 0) {
+            cerr << "Fail to start reactor thread." << endl;
+            exit(1);
+        }
+    }
+    serving = 1;
+
+    reactor_main(shards[0]);
+
+    close(listenfd);
+    event_log.flush();
+    
+    return 1;
+}
+
+static void log_io_error(client &cl, const char *what, int err)
+{
+    log_level level = (err == ECONNRESET || err == EPIPE) ? LOG_DEBUG : LOG_WARN;
+    event_log.log(level, "Connection from %a: %s.", std::string(what) + ": " + strerror(err), reinterpret_cast<const struct sockaddr *>(&cl.addr));
+}
+
+static void sigint_safe_exit(int sig)
+{
+    if (!serving) {
+        _exit(1);
+    }
+
+    // Only async-signal-safe calls here; the rest runs on the first shard.
+    int err = errno;
+    interrupted = 1;
+    uint64_t one = 1;
+    if (write(shards[0]->wakefd, &one, sizeof (one)) < 0) {
+        // The eventfd is already signaled.
+    }
+    errno = err;
+}
+
+static void interrupt_exit()
+{
+    if (shards[0]->listenfd > 2) {
+        close(shards[0]->listenfd);
+    }
+    offline.save_index();
+    event_log.flush();
+    std::cerr << "Interrupt." << std::endl;
+
+    // The other threads still run; static destructors would free the users
+    // and unmap the store under them.
+    _exit(1);
+}
+
+static int start_shard(shard &sh, int listenfd)
+{
+    sh.listenfd = listenfd;
+    sh.wakefd = -1;
+    sh.accepting = true;
+    sh.accept_gen = 0;
+    sh.ring = NULL;
+    sh.now = metrics_clock();
+    sh.wheel = new timer_wheel(TIMER_TICK_NS, sh.now);
+    sh.stopping = false;
+
+    // Every socket is registered once; epoll_wait() only reports the
+    // descriptors that are ready, so a wakeup never walks all users.
+    sh.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    sh.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh.epollfd < 0 || sh.wakefd < 0 || watch_fd(sh, sh.listenfd) < 0 || watch_fd(sh, sh.wakefd) < 0) {
+        perror("start_shard");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *reactor_main(void *arg)
+{
+    shard &sh = *reinterpret_cast<shard *>(arg);
+
+    if (options.uring) {
+        if (start_uring(sh) == 0) {
+            return uring_main(sh);
+        }
+        event_log.log(LOG_WARN, "Fail to set up io_uring (%s). Reactor thread %u falls back to epoll.", strerror(errno), NULL, sh.id);
+    }
+    adopt_conns(sh);
+
+    struct epoll_event events[MAX_EVENTS];
+    int status = 0;
+    int nready = epoll_wait(sh.epollfd, events, MAX_EVENTS, sh.wheel->timeout_ms(metrics_clock()));
+    while (nready >= 0 || errno == EINTR) {
+        uint64_t start = metrics_clock();
+        sh.now = start;
+        status = 0;
+        for (int i = 0; i < nready && status >= 0; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == sh.listenfd) {
+                status = accept_connection(sh);
+                continue;
+            }
+
+            if (fd == sh.wakefd) {
+                uint64_t count;
+                if (read(sh.wakefd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+                    perror("read");
+                }
+                process_mail(sh);
+                continue;
+            }
+
+            // A stale event of a socket closed earlier in the same wakeup
+            // finds a free entry.
+            const conn &c = (static_cast<size_t>(fd) < sh.conns.size()) ? sh.conns[fd] : conn();
+            if (c.state == CONN_ONLINE) {
+                client &cl = *c.cl;
+                if ((events[i].events & EPOLLOUT) && drain_client(sh, cl) < 0) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    status = serve_client(sh, cl);
+                }
+            }
+            else if (c.state == CONN_LOGIN) {
+                status = user_login(sh, *c.cl);
+            }
+        }
+
+        if (status >= 0) {
+            status = run_timers(sh);
+        }
+        free_left(sh);
+
+        if (nready > 0) {
+            sh.metrics.loops.add();
+            sh.metrics.loop_events.record(nready);
+            sh.metrics.loop_time.record(metrics_clock() - start);
+        }
+
+        if (status < 0) {
+            break;
+        }
+        if (sh.stopping) {
+            park_shard(sh);
+        }
+
+        nready = epoll_wait(sh.epollfd, events, MAX_EVENTS, sh.wheel->timeout_ms(metrics_clock()));
+    }
+    
+    perror("epoll_wait");
+
+    // A dead reactor would strand its users; take the server down instead.
+    if (sh.id != 0) {
+        exit(1);
+    }
+
+    return NULL;
+}
+
+static int start_uring(shard &sh)
+{
+    // Multishot accept and receive and IORING_ASYNC_CANCEL_ANY have no probe
+    // of their own; IORING_OP_SEND_ZC came with the last of them, in 6.0.
+    static const uint8_t ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SEND_ZC
+    };
+
+    sh.ring = new uring();
+    if (sh.ring->init(URING_ENTRIES) < 0 || sh.ring->require(ops, sizeof (ops), IORING_FEAT_CQE_SKIP) < 0 ||
+        sh.ring->setup_buffers(URING_GROUP, URING_BUFS, IN_BUFLEN) < 0) {
+        int err = errno;
+        delete sh.ring;
+        sh.ring = NULL;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t uring_tag(uring_op op, uint32_t gen, int fd)
+{
+    return (static_cast<uint64_t>(op) << 56) | (static_cast<uint64_t>(gen & 0xffffff) << 32) | static_cast<uint32_t>(fd);
+}
+
+static void *uring_main(shard &sh)
+{
+    arm_accept(sh);
+    arm_wake(sh);
+    adopt_conns(sh);
+    submit_sends(sh);
+
+    int status = 0;
+    while (status >= 0) {
+        // Submits everything queued since the last wait, then waits. A
+        // stopping shard waits for its cancelled requests to finish.
+        int timeout = sh.stopping ? HANDOVER_POLL_MS : sh.wheel->timeout_ms(metrics_clock());
+        if (sh.ring->submit(1, timeout) < 0 && errno != EINTR && errno != EBUSY && errno != ETIME) {
+            break;
+        }
+
+        uint64_t start = metrics_clock();
+        sh.now = start;
+        size_t count = 0;
+        struct io_uring_cqe cqe;
+        while (status >= 0 && sh.ring->peek_cqe(cqe)) {
+            status = uring_complete(sh, cqe);
+            ++count;
+        }
+        if (status >= 0) {
+            status = run_timers(sh);
+        }
+        free_left(sh);
+
+        // Output of a stopping shard stays queued and is handed over.
+        if (sh.stopping && count == 0 && !sends_in_flight(sh)) {
+            park_shard(sh);
+        }
+        if (!sh.stopping) {
+            submit_sends(sh);
+        }
+
+        if (count > 0) {
+            sh.metrics.loops.add();
+            sh.metrics.loop_events.record(count);
+            sh.metrics.loop_time.record(metrics_clock() - start);
+        }
+    }
+
+    perror("io_uring_enter");
+
+    // A dead reactor would strand its users; take the server down instead.
+    if (sh.id != 0) {
+        exit(1);
+    }
+
+    return NULL;
+}
+
+static int uring_complete(shard &sh, const struct io_uring_cqe &cqe)
+{
+    uring_op op = static_cast<uring_op>(cqe.user_data >> 56);
+    uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32) & 0xffffff;
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+    // Requests of a connection closed since are ignored.
+    bool current = (static_cast<size_t>(fd) < sh.gens.size() && sh.gens[fd] == gen);
+
+    int status = 0;
+    switch (op) {
+    case URING_ACCEPT:
+        // Connections accepted before a pause took effect are served too.
+        if (cqe.res >= 0) {
+            struct sockaddr_storage client_addr = {};
+            socklen_t client_addr_size = sizeof (client_addr);
+            getpeername(cqe.res, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size);
+            status = start_client(sh, cqe.res, client_addr);
+        }
+        else if (cqe.res != -ECANCELED) {
+            event_log.log(LOG_WARN, "Fail to accept connection: %s.", strerror(-cqe.res));
+            if (cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM) {
+                pause_accept(sh);
+            }
+            else if (cqe.res == -EINVAL) {
+                // The request itself is refused; arming it again would spin.
+                event_log.log(LOG_ERROR, "Reactor thread %u stops accepting connections.", std::string(), NULL, sh.id);
+                sh.accepting = false;
+            }
+        }
+        if (!more && gen == (sh.accept_gen & 0xffffff) && sh.accepting) {
+            arm_accept(sh);
+        }
+        break;
+    case URING_WAKE:
+        uint64_t count;
+        if (read(sh.wakefd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+            perror("read");
+        }
+        process_mail(sh);
+        if (!more) {
+            arm_wake(sh);
+        }
+        break;
+    case URING_RECV:
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (current && cqe.res > 0) {
+                status = uring_receive(sh, fd, sh.ring->buffer(bid), cqe.res, -1);
+            }
+            sh.ring->recycle_buffer(bid);
+        }
+        else if (current && cqe.res <= 0 && cqe.res != -ENOBUFS && !(sh.stopping && cqe.res == -ECANCELED)) {
+            status = uring_receive(sh, fd, NULL, 0, -cqe.res);
+        }
+
+        // Out of buffers or stopped early; the connection reads on.
+        if (!more && (cqe.res > 0 || cqe.res == -ENOBUFS) && current && sh.gens[fd] == gen && sh.conns[fd].state != CONN_FREE) {
+            watch_fd(sh, fd);
+        }
+        break;
+    case URING_SEND:
+        if (current && sh.conns[fd].state == CONN_ONLINE) {
+            client &cl = *sh.conns[fd].cl;
+            cl.send_inflight = false;
+            if (cqe.res == -ECANCELED && sh.stopping) {
+                // Sent again if the handover fails.
+                update_watch(cl);
+                break;
+            }
+            if (cqe.res < 0) {
+                log_io_error(cl, "my_flush", -cqe.res);
+                client_leave(sh, cl);
+                break;
+            }
+            cl.sent(cqe.res);
+            drain_client(sh, cl);
+        }
+        break;
+    default:
+        break;
+    }
+
+    return status;
+}
+
+static int uring_receive(shard &sh, int fd, const char *data, size_t len, int err)
+{
+    if (err >= 0) {
+        const conn &c = sh.conns[fd];
+        if (c.state == CONN_FREE) {
+            return 0;
+        }
+        c.cl->feed_end(err);
+        return (c.state == CONN_ONLINE) ? serve_client(sh, *c.cl) : user_login(sh, *c.cl);
+    }
+
+    // A login moves the connection to the on-line state, and the input
+    // buffer may take only part of the data at a time.
+    size_t done = 0;
+    while (done < len && sh.conns[fd].state != CONN_FREE) {
+        const conn &c = sh.conns[fd];
+        done += c.cl->feed(data + done, len - done);
+        int status = (c.state == CONN_ONLINE) ? serve_client(sh, *c.cl) : user_login(sh, *c.cl);
+        if (status < 0) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+static void arm_accept(shard &sh)
+{
+    struct io_uring_sqe *sqe = sh.stopping ? NULL : sh.ring->get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sh.listenfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_tag(URING_ACCEPT, sh.accept_gen, sh.listenfd);
+}
+
+static void arm_wake(shard &sh)
+{
+    struct io_uring_sqe *sqe = sh.stopping ? NULL : sh.ring->get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sh.wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_tag(URING_WAKE, 0, sh.wakefd);
+}
+
+static void submit_sends(shard &sh)
+{
+    // Draining a client may queue it again, at the end of the list.
+    for (size_t i = 0; i < sh.dirty.size(); ++i) {
+        if (sh.dirty[i] == NULL) {
+            continue;
+        }
+        client &cl = *sh.dirty[i];
+        cl.send_queued = false;
+
+        // A completion pending for the client sends the rest.
+        if (cl.fd < 0 || cl.send_inflight) {
+            continue;
+        }
+        if (!cl.want_write()) {
+            drain_client(sh, cl);
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = sh.ring->get_sqe();
+        if (sqe == NULL) {
+            // Try again after the next wait.
+            cl.send_queued = true;
+            sh.dirty.erase(sh.dirty.begin(), sh.dirty.begin() + i);
+            return;
+        }
+
+        cl.send_hdr = msghdr();
+        cl.send_hdr.msg_iov = cl.send_iov;
+        cl.send_hdr.msg_iovlen = cl.pending_iov(cl.send_iov, SEND_IOVS);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = cl.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&cl.send_hdr);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(URING_SEND, sh.gens[cl.fd], cl.fd);
+        cl.send_inflight = true;
+    }
+
+    sh.dirty.clear();
+}
+
+static int client_leave(shard &sh, client &cl)
+{
+    using namespace std;
+
+    // Recipients of a chat still being sent learn it ends here.
+    if (!cl.chat_peers.empty() || cl.chat_group != NULL) {
+        relay_piece(sh, cl, "", 0, FRAME_CONT | FRAME_CUT);
+    }
+    cl.chat_open = false;
+    sh.metrics.leaves.add();
+
+    user &u = *cl.entry;
+    broadcast(sh, make_notice("User " + u.name + " is off-line.\n"), &u);
+
+    remove_conn(sh, cl.fd);
+    unwatch_fd(sh, cl.fd);
+
+    lock_guard<mutex> lock(directory.lock_of(u));
+    u.cl = NULL;
+    u.owner = -1;
+
+    // Off-line messages fetched from the home node and not sent yet go back
+    // there, ahead of the spilled ones.
+    if (federation.enabled()) {
+        string payload;
+        append_link_name(payload, u.name);
+        federation.send_all(LINK_OFFLINE, payload);
+        if (federation.home_of(u.name) != federation.self()) {
+            push_backlog(u, federation.home_of(u.name));
+        }
+    }
+
+    // Spilled chat messages were never delivered, keep them for next login.
+    // The unconfirmed chunk of the backlog stays in the store as well.
+    for (auto &msg : cl.spilled_msgs) {
+        if (msg.stored) {
+            store_offline(u, msg.stored->data(), msg.stored->size());
+        }
+    }
+    cl.spilled_msgs.clear();
+    cl.backlog = false;
+
+    cl.close();
+    sh.wheel->cancel(cl.timer);
+
+    if (cl.send_queued) {
+        std::replace(sh.dirty.begin(), sh.dirty.end(), &cl, static_cast<client *>(NULL));
+    }
+    cl.send_queued = false;
+    cl.send_inflight = false;
+
+    return 0;
+}
+
+static void add_conn(shard &sh, conn_state state, client *cl)
+{
+    size_t fd = static_cast<size_t>(cl->fd);
+    if (fd >= sh.conns.size()) {
+        sh.conns.resize(std::max(fd + 1, sh.conns.size() * 2), conn());
+    }
+
+    conn &c = sh.conns[fd];
+    c.state = state;
+    c.cl = cl;
+    if (state == CONN_ONLINE) {
+        c.pos = sh.online.size();
+        sh.online.push_back(cl);
+        sh.metrics.online.set(sh.online.size());
+    }
+    else {
+        sh.metrics.pending.add();
+    }
+}
+
+static void remove_conn(shard &sh, int fd)
+{
+    conn &c = sh.conns[fd];
+    if (c.state == CONN_ONLINE) {
+        // Swap with the last one to keep `online` dense.
+        client *last = sh.online.back();
+        sh.online[c.pos] = last;
+        sh.conns[last->fd].pos = c.pos;
+        sh.online.pop_back();
+        sh.metrics.online.set(sh.online.size());
+        sh.left.push_back(c.cl);
+    }
+    else if (c.state == CONN_LOGIN) {
+        sh.wheel->cancel(c.cl->timer);
+        delete c.cl;
+        sh.metrics.pending.set(sh.metrics.pending.get() - 1);
+    }
+
+    c = conn();
+
+    // A slot or a descriptor just freed up.
+    if (!sh.accepting) {
+        resume_accept(sh);
+    }
+}
+
+static void set_online(shard &sh, client &cl)
+{
+    // The same client goes on; only its entry in the table changes.
+    sh.wheel->cancel(cl.timer);
+    sh.conns[cl.fd] = conn();
+    sh.metrics.pending.set(sh.metrics.pending.get() - 1);
+    add_conn(sh, CONN_ONLINE, &cl);
+
+    if (!sh.accepting) {
+        resume_accept(sh);
+    }
+}
+
+static void free_left(shard &sh)
+{
+    for (auto cl : sh.left) {
+        delete cl;
+    }
+    sh.left.clear();
+}
+
+static void pause_accept(shard &sh)
+{
+    if (!sh.accepting) {
+        return;
+    }
+    sh.accepting = false;
+    sh.metrics.accept_pauses.add();
+    event_log.log(LOG_DEBUG, "Reactor thread %u pauses accepting connections.", std::string(), NULL, sh.id);
+
+    if (sh.ring != NULL) {
+        struct io_uring_sqe *sqe = sh.ring->get_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uring_tag(URING_ACCEPT, sh.accept_gen, sh.listenfd);
+            sqe->user_data = uring_tag(URING_CANCEL, 0, sh.listenfd);
+        }
+    }
+    else {
+        epoll_ctl(sh.epollfd, EPOLL_CTL_DEL, sh.listenfd, NULL);
+    }
+}
+
+static void resume_accept(shard &sh)
+{
+    if (sh.accepting || sh.metrics.pending.get() >= options.max_pending) {
+        return;
+    }
+    sh.accepting = true;
+    event_log.log(LOG_DEBUG, "Reactor thread %u resumes accepting connections.", std::string(), NULL, sh.id);
+
+    if (sh.ring != NULL) {
+        ++sh.accept_gen;
+        arm_accept(sh);
+    }
+    else if (watch_fd(sh, sh.listenfd) < 0) {
+        perror("resume_accept");
+    }
+}
+
+static int run_timers(shard &sh)
+{
+    sh.wheel->advance(sh.now);
+
+    timer_node *t;
+    while ((t = sh.wheel->next_expired()) != NULL) {
+        client &cl = *static_cast<client *>(t->data);
+        int fd = cl.fd;
+        const conn &c = sh.conns[fd];
+        if (c.state == CONN_LOGIN) {
+            event_log.log(LOG_INFO, "Connection from %a did not log in in time. Terminating connection...", std::string(), reinterpret_cast<const struct sockaddr *>(&cl.addr));
+            sh.metrics.login_timeouts.add();
+            unwatch_fd(sh, fd);
+            cl.close();
+            remove_conn(sh, fd);
+            continue;
+        }
+
+        uint64_t idle = options.idle_timeout * NS_PER_SEC;
+        if (idle > 0 && sh.now - cl.last_active >= idle) {
+            event_log.log(LOG_INFO, "User %s is idle. Terminating connection...", cl.entry->name);
+            sh.metrics.idle_evictions.add();
+            client_leave(sh, cl);
+            continue;
+        }
+
+        // A quiet user gets an empty line or notice; on a dead connection it
+        // stays unacknowledged and the socket times out.
+        uint64_t period = options.heartbeat * NS_PER_SEC;
+        if (period > 0 && sh.now - std::max(cl.last_active, cl.last_heartbeat) >= period) {
+            send_msg(cl, std::string("\n"));
+            cl.last_heartbeat = sh.now;
+            sh.metrics.heartbeats.add();
+        }
+        arm_online_timer(sh, cl);
+    }
+
+    return 0;
+}
+
+static void arm_online_timer(shard &sh, client &cl)
+{
+    uint64_t idle = options.idle_timeout * NS_PER_SEC;
+    uint64_t period = options.heartbeat * NS_PER_SEC;
+    if (idle == 0 && period == 0) {
+        sh.wheel->cancel(cl.timer);
+        return;
+    }
+
+    uint64_t when = UINT64_MAX;
+    if (idle > 0) {
+        when = cl.last_active + idle;
+    }
+    if (period > 0) {
+        when = std::min(when, std::max(cl.last_active, cl.last_heartbeat) + period);
+    }
+    sh.wheel->schedule(cl.timer, when);
+}
+
+static int watch_fd(shard &sh, int fd)
+{
+    if (sh.ring != NULL) {
+        if (static_cast<size_t>(fd) >= sh.gens.size()) {
+            sh.gens.resize(std::max(static_cast<size_t>(fd) + 1, sh.gens.size() * 2), 0);
+        }
+        // Watched again by park_shard() if the handover fails.
+        if (sh.stopping) {
+            return 0;
+        }
+
+        struct io_uring_sqe *sqe = sh.ring->get_sqe();
+        if (sqe == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_GROUP;
+        sqe->user_data = uring_tag(URING_RECV, sh.gens[fd], fd);
+        return 0;
+    }
+
+    // Only one of the shards sharing the listening socket is woken up for a
+    // new connection.
+    struct epoll_event ev = {};
+    ev.events = (fd == sh.listenfd) ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(sh.epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void unwatch_fd(shard &sh, int fd)
+{
+    if (fd > 0 && sh.ring != NULL) {
+        // Cancelled before the fd is closed and reused, so a send in flight
+        // does not write freed buffers to the next connection.
+        ++sh.gens[fd];
+        struct io_uring_sqe *sqe = sh.ring->get_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = uring_tag(URING_CANCEL, 0, fd);
+            sh.ring->submit(0);
+        }
+    }
+    else if (fd > 0) {
+        epoll_ctl(sh.epollfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+static void update_watch(client &cl)
+{
+    // A pending backlog is streamed whenever the socket is writable.
+    bool want_write = cl.want_write() || cl.backlog;
+    shard &sh = *shards[cl.owner];
+    if (sh.ring != NULL) {
+        if (cl.fd >= 0 && want_write && !cl.send_queued) {
+            cl.send_queued = true;
+            sh.dirty.push_back(&cl);
+        }
+        return;
+    }
+
+    if (cl.fd < 0 || want_write == cl.out_watched) {
+        return;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.fd = cl.fd;
+    if (epoll_ctl(sh.epollfd, EPOLL_CTL_MOD, cl.fd, &ev) == 0) {
+        cl.out_watched = want_write;
+    }
+}
+
+static int send_msg(client &cl, const wire_msg &msg, const shared_buf &stored)
+{
+    const shared_buf &wire = cl.binary ? msg.frame : msg.text;
+    if (!wire) {
+        // Nothing to send in this format.
+        return 0;
+    }
+
+    // Keep order: nothing may overtake messages already spilled.
+    if (!cl.spilled_msgs.empty()) {
+        cl.spilled_msgs.push_back(spilled_msg{ wire, stored });
+        return 1;
+    }
+
+    int status = cl.send(wire, MSG_NOSIGNAL);
+    if (status > 0) {
+        cl.spilled_msgs.push_back(spilled_msg{ wire, stored });
+    }
+    else if (status < 0 && errno == ECONNABORTED) {
+        // Let the event loop see EOF and run the usual leave path.
+        shutdown(cl.fd, SHUT_RDWR);
+        errno = ECONNABORTED;
+    }
+
+    update_watch(cl);
+    return status;
+}
+
+static int send_msg(client &cl, const std::string &line)
+{
+    // Only the format this client needs.
+    wire_msg msg;
+    if (cl.binary) {
+        std::string frame;
+        append_notice_frame(frame, line.data(), line.size());
+        msg.frame = make_shared_buf(std::move(frame));
+    }
+    else {
+        msg.text = make_shared_buf(line);
+    }
+
+    return send_msg(cl, msg);
+}
+
+static wire_msg make_notice(const std::string &line)
+{
+    std::string frame;
+    append_notice_frame(frame, line.data(), line.size());
+
+    wire_msg msg = { make_shared_buf(line), make_shared_buf(std::move(frame)) };
+    return msg;
+}
+
+static std::string backlog_to_wire(std::string &chunk, bool binary)
+{
+    using namespace std;
+
+    if (binary && !chunk.empty() && static_cast<uint8_t>(chunk[0]) < ' ') {
+        return move(chunk);
+    }
+
+    string out;
+    size_t pos = 0;
+    while (pos < chunk.size()) {
+        // Stores written before binary framing hold text lines.
+        if (static_cast<uint8_t>(chunk[pos]) >= ' ') {
+            size_t end = chunk.find('\n', pos);
+            end = (end == string::npos) ? chunk.size() : end + 1;
+            if (binary) {
+                append_notice_frame(out, chunk.data() + pos, end - pos);
+            }
+            else {
+                out.append(chunk, pos, end - pos);
+            }
+            pos = end;
+            continue;
+        }
+
+        if (chunk.size() - pos < FRAME_HDR) {
+            break;
+        }
+        frame_header hdr;
+        decode_frame_header(chunk.data() + pos, hdr);
+        size_t len = min(FRAME_HDR + static_cast<size_t>(hdr.length), chunk.size() - pos);
+        if (binary) {
+            out.append(chunk, pos, len);
+        }
+        else {
+            frame_to_text(chunk.data() + pos, len, out);
+        }
+        pos += len;
+    }
+
+    return out;
+}
+
+static int drain_client(shard &sh, client &cl)
+{
+    if (cl.flush() < 0) {
+        log_io_error(cl, "my_flush", errno);
+        client_leave(sh, cl);
+        return -1;
+    }
+
+    while (!cl.is_congested() && !cl.spilled_msgs.empty()) {
+        if (cl.send(cl.spilled_msgs.front().wire, MSG_NOSIGNAL) != 0) {
+            break;
+        }
+        cl.spilled_msgs.pop_front();
+    }
+
+    stream_backlog(sh, cl);
+    update_watch(cl);
+    return 0;
+}
+
+static void stream_backlog(shard &sh, client &cl)
+{
+    using namespace std;
+
+    // Only what the socket has taken counts as delivered. The first chunk
+    // confirms nothing, so it may queue up behind the welcome message.
+    if (!cl.backlog || (cl.want_write() && cl.backlog_sent > 0) || !cl.spilled_msgs.empty()) {
+        return;
+    }
+
+    // A chunk is removed from the store once the chunk after it has been
+    // written too; by then the kernel has sent it out. Messages are named
+    // by store number, as an acknowledgement from another node may remove
+    // some of them meanwhile.
+    const string &name = cl.entry->name;
+    unique_lock<mutex> lock(directory.lock_of(*cl.entry));
+    offline.consume_range(name, 0, cl.backlog_prev);
+    cl.backlog_prev = cl.backlog_sent;
+
+    string chunk;
+    uint64_t first, last;
+    size_t count = offline.read_after(name, cl.backlog_sent, min(static_cast<size_t>(BACKLOG_CHUNK), options.high_watermark), chunk, first, last);
+    if (count == 0) {
+        offline.consume_range(name, 0, cl.backlog_sent);
+        cl.backlog_sent = 0;
+        cl.backlog_prev = 0;
+        cl.backlog = false;
+    }
+    else {
+        cl.backlog_sent = last;
+    }
+    lock.unlock();
+
+    if (!cl.backlog) {
+        // Back to the system default.
+        int lowat = 0;
+        setsockopt(cl.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof (lowat));
+    }
+
+    int status = cl.backlog ? cl.send(make_shared_buf(backlog_to_wire(chunk, cl.binary)), MSG_NOSIGNAL) : 0;
+    if (status != 0) {
+        // Not queued; the same messages are read again on the next try.
+        cl.backlog_sent = cl.backlog_prev;
+        if (status < 0 && errno != ENOBUFS) {
+            // Let the event loop see EOF and run the usual leave path.
+            shutdown(cl.fd, SHUT_RDWR);
+        }
+    }
+
+    update_watch(cl);
+}
+
+static void post_mail(int id, mail *m)
+{
+    shard &dest = *shards[id];
+    if (dest.inbox.push(m)) {
+        uint64_t one = 1;
+        if (write(dest.wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+}
+
+static void process_mail(shard &sh)
+{
+    if (sh.id == 0 && interrupted) {
+        interrupt_exit();
+    }
+
+    mail *m = sh.inbox.take_all();
+    while (m != NULL) {
+        sh.metrics.mails.add();
+        switch (m->type) {
+        case MAIL_DELIVER:
+            deliver(sh, *m->target, m->msg, m->offline_msg, m->sender, m->sender_shard);
+            break;
+        case MAIL_FANOUT:
+            for (auto target : m->targets) {
+                deliver(sh, *target, m->msg, m->offline_msg, m->sender, m->sender_shard);
+            }
+            break;
+        case MAIL_NOTICE:
+            notify(sh, *m->target, sh.id, m->msg);
+            break;
+        case MAIL_BROADCAST:
+            broadcast_local(sh, m->msg, m->target);
+            break;
+        case MAIL_LINK:
+            run_link_frame(sh, m->sender_shard, *m->offline_msg);
+            break;
+        case MAIL_NODE_UP:
+        case MAIL_NODE_DOWN:
+            sync_node(m->sender_shard, m->type == MAIL_NODE_UP);
+            break;
+        case MAIL_HANDOVER:
+            begin_handover(sh);
+            break;
+        }
+
+        mail *next = m->next;
+        delete m;
+        m = next;
+    }
+}
+
+static void deliver(shard &sh, user &peer, const wire_msg &msg, const shared_buf &offline_msg, user *sender, int sender_shard, std::vector<user *> *forward)
+{
+    std::unique_lock<std::mutex> lock(directory.lock_of(peer));
+
+    // A chat from a user here may go to another node, once; what comes from
+    // another node is delivered or stored.
+    if (peer.cl == NULL && peer.node >= 0 && sender != NULL) {
+        int node = peer.node;
+        lock.unlock();
+
+        sh.metrics.remote.add();
+        std::string payload;
+        append_link_name(payload, peer.name);
+        payload += *msg.frame;
+        federation.send(node, LINK_CHAT, payload);
+        return;
+    }
+
+    if (peer.cl != NULL && peer.owner != sh.id) {
+        int owner = peer.owner;
+        lock.unlock();
+
+        sh.metrics.forwarded.add();
+        if (forward != NULL) {
+            forward[owner].push_back(&peer);
+            return;
+        }
+        post_mail(owner, new mail{ MAIL_DELIVER, &peer, sender, sender_shard, msg, offline_msg, NULL });
+        return;
+    }
 
-}
+    // On-line here; only this thread frees the connection.
+    client *cl = peer.cl;
+    if (cl != NULL && cl->backlog) {
+        // Queue up behind the off-line messages still being streamed.
+        int stored = offline.append(peer.name, msg.frame->data(), msg.frame->size());
+        lock.unlock();
+        sh.metrics.stored.add();
 
-#define LISTEN_PORT 1733
-#define BUFLEN 65536
+        if (stored < 0 && sender != NULL) {
+            notify(sh, *sender, sender_shard, make_notice("Fail to store the message for " + peer.name + ".\n"));
+        }
+        stream_backlog(sh, *cl);
+        return;
+    }
 
-int sockfd = 0;
-char welcome_msg[] = "Welcome to my netprog hw3 chat server\n";
+    if (cl != NULL) {
+        lock.unlock();
 
-class client : public my_send_recv
+        int status = send_msg(*cl, msg, offline_msg);
+        if (status >= 0) {
+            sh.metrics.delivered.add();
+            return;
+        }
+        if (errno == ENOBUFS) {
+            // Dropped by the overflow policy of a slow receiver.
+            sh.metrics.dropped.add();
+            return;
+        }
+        if (errno != EPIPE && errno != ECONNABORTED) {
+            log_io_error(*cl, "my_send", errno);
+        }
+
+        lock.lock();
+    }
+
+    int stored = store_offline(peer, offline_msg->data(), offline_msg->size());
+    lock.unlock();
+    sh.metrics.stored.add();
+
+    if (sender == NULL) {
+        return;
+    }
+    if (stored < 0) {
+        notify(sh, *sender, sender_shard, make_notice("Fail to store the message for " + peer.name + ".\n"));
+        return;
+    }
+
+    // Once per message, not for each piece of it, and not for every member
+    // of a group.
+    if (!(frame_flags(offline_msg->data()) & (FRAME_CONT | FRAME_GROUP))) {
+        notify(sh, *sender, sender_shard, make_notice("User " + peer.name + " is off-line. The message will be passed when he comes back.\n"));
+    }
+}
+
+static void notify(shard &sh, user &u, int id, const wire_msg &msg)
 {
-public:
-    std::string name;
-    struct sockaddr_storage addr;
-    std::vector<std::string> offline_msgs;
+    if (id != sh.id) {
+        post_mail(id, new mail{ MAIL_NOTICE, &u, NULL, -1, msg, NULL, NULL });
+        return;
+    }
 
-    client(int fd, std::string name, struct sockaddr_storage addr)
-    : my_send_recv(fd), name(name), addr(addr)
-    {
+    // The user may have left, or even logged in again on another shard.
+    std::unique_lock<std::mutex> lock(directory.lock_of(u));
+    client *cl = (u.owner == sh.id) ? u.cl : NULL;
+    lock.unlock();
 
+    if (cl != NULL) {
+        send_msg(*cl, msg);
     }
-};
+}
 
-static int accept_connection(int sockfd, std::vector<client> &nonlogin_clients);
-static int serve_client(fd_set &set, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client);
-static int relay_msg(std::vector<std::string> &cmd, const char *cmd_orig, client &cl, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client);
-static int client_leave(client &cl, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client);
-static int user_login(fd_set &set, std::vector<client> &nonlogin_clients, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client);
-static void print_client(client &cl);
-static std::string get_ip(client &cl);
-static std::string get_port(client&cl);
+static void broadcast(shard &sh, const wire_msg &msg, const user *skip)
+{
+    for (int i = 0; i < shard_count; ++i) {
+        if (i != sh.id) {
+            post_mail(i, new mail{ MAIL_BROADCAST, const_cast<user *>(skip), NULL, -1, msg, NULL, NULL });
+        }
+    }
 
-/**
- * Descrption: Clean exit when SIGINT received.
- */
-static void sigint_safe_exit(int sig);
+    broadcast_local(sh, msg, skip);
+}
 
-/**
- * Descrption: Determine and return IPv4 or IPv6 address object.
- * Return: IPv4 or IPv6 address object (sin_addr or sin6_addr).
- */
-static const void *get_in_addr(const struct sockaddr &sa);
+static void broadcast_local(shard &sh, const wire_msg &msg, const user *skip)
+{
+    for (auto cl : sh.online) {
+        if (cl->entry != skip) {
+            send_msg(*cl, msg);
+        }
+    }
+}
 
-/**
- * Descrption: Get port number from sockaddr object.
- * Return: Unsigned short, host byte order port number.
- */
-static uint16_t get_in_port(const struct sockaddr &sa);
+static void append_link_name(std::string &out, const std::string &name)
+{
+    size_t len = std::min(name.size(), static_cast<size_t>(255));
+    out.push_back(static_cast<char>(len));
+    out.append(name, 0, len);
+}
 
-/**
- * Descrption: Start server and listening to clients.
- * Return: 0 if succeed, or -1 if fail.
- */
-static int start_server();
+static int store_offline(user &u, const char *frame, size_t len)
+{
+    int home = federation.home_of(u.name);
+    if (home == federation.self()) {
+        return offline.append(u.name, frame, len);
+    }
 
-/**
- * Descrption: Print client info and send welcome message to client.
- * Return: 0 if succeed, or -1 if fail.
- */
-static int welcome(client &cl);
+    std::string payload;
+    append_link_name(payload, u.name);
+    payload.append(frame, len);
+    return federation.send(home, LINK_STORE, payload);
+}
 
-int main()
+static void push_backlog(user &u, int node)
 {
-    // Handle SIGINT
-    struct sigaction sa;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_handler = sigint_safe_exit;
-    sa.sa_flags = 0;
+    // Messages sent to another node, or over a link that went down since,
+    // go again; the receiver may get some twice but loses none.
+    uint64_t after = (u.push_node == node) ? u.push_seq : 0;
+
+    std::string chunk;
+    uint64_t first, last;
+    while (offline.read_after(u.name, after, BACKLOG_CHUNK, chunk, first, last) > 0) {
+        std::string payload;
+        append_link_name(payload, u.name);
+        uint64_t range[2] = { htobe64(first), htobe64(last) };
+        payload.append(reinterpret_cast<const char *>(range), sizeof (range));
+        payload += chunk;
+        if (federation.send(node, LINK_BACKLOG, payload) < 0) {
+            break;
+        }
+        after = last;
+        chunk.clear();
+    }
 
-    sigaction(SIGINT, &sa, NULL);
+    u.push_node = node;
+    u.push_seq = after;
+}
+
+static void link_received(int node, uint8_t type, const char *data, size_t len)
+{
+    if (len < 1 || len - 1 < static_cast<uint8_t>(data[0])) {
+        event_log.log(LOG_WARN, "Invalid frame from node %u.", std::string(), NULL, node);
+        return;
+    }
+
+    // Frames about a user on-line here keep their order on its shard.
+    int id = 0;
+    user *u = directory.find(data + 1, static_cast<uint8_t>(data[0]));
+    if (u != NULL) {
+        std::lock_guard<std::mutex> lock(directory.lock_of(*u));
+        id = (u->cl != NULL) ? u->owner : 0;
+    }
+
+    std::string frame(1, static_cast<char>(type));
+    frame.append(data, len);
+    post_mail(id, new mail{ MAIL_LINK, NULL, NULL, node, wire_msg(), make_shared_buf(std::move(frame)), NULL });
+}
+
+static void link_changed(int node, bool up)
+{
+    post_mail(0, new mail{ up ? MAIL_NODE_UP : MAIL_NODE_DOWN, NULL, NULL, node, wire_msg(), NULL, NULL });
+}
 
+static void run_link_frame(shard &sh, int node, const std::string &frame)
+{
     using namespace std;
 
-    // Start server
-    int status = start_server();
-    if (status != 0) {
-        if (sockfd > 2) {
-            close(sockfd);
-        }
-        cerr << "Fail to start server." << endl;
-        exit(1);
+    sh.metrics.link_frames.add();
+    uint8_t type = static_cast<uint8_t>(frame[0]);
+    size_t name_len = static_cast<uint8_t>(frame[1]);
+    string name = frame.substr(2, name_len);
+    string rest = frame.substr(2 + name_len);
+
+    // Users of other nodes get an entry here too, so chats can name them.
+    user *peer = directory.find(name.data(), name.size());
+    if (peer == NULL) {
+        peer = directory.insert(name).first;
+    }
+    if (peer == NULL) {
+        return;
     }
 
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(sockfd, &set);
-    int maxfd = sockfd + 1;
+    unique_lock<mutex> lock(directory.lock_of(*peer));
+    switch (type) {
+    case LINK_USER:
+    case LINK_ONLINE:
+        if (type == LINK_USER && (rest.empty() || rest[0] != 1)) {
+            break;
+        }
+        if (peer->cl != NULL) {
+            // Logged in at two nodes at once; chats from here go to the
+            // connection here.
+            event_log.log(LOG_WARN, "User %s is logged in at node %u as well.", name, NULL, node);
+        }
+        peer->node = node;
+        lock.unlock();
+        if (type == LINK_ONLINE) {
+            broadcast(sh, make_notice("User " + name + " is on-line, IP address: " + rest + "\n"), NULL);
+        }
+        break;
+    case LINK_OFFLINE:
+        if (peer->node == node) {
+            peer->node = -1;
+        }
+        lock.unlock();
+        broadcast(sh, make_notice("User " + name + " is off-line.\n"), NULL);
+        break;
+    case LINK_CHAT: {
+        lock.unlock();
+        frame_header hdr;
+        cmd_token from, group, msg;
+        if (mark_remote_senders(rest, node) < 0 || parse_message_frame(rest.data(), rest.size(), hdr, from, group, msg) < 0) {
+            event_log.log(LOG_WARN, "Invalid frame from node %u.", string(), NULL, node);
+            break;
+        }
 
-    vector<client> nonlogin_clients;
-    map<string, client> clients;
-    map<int, client *> fd_to_client;
+        string text;
+        if (msg.len > 0 || !(hdr.flags & FRAME_CONT)) {
+            append_message_text(text, FRAME_MESSAGE, hdr.time, from.str(), group.str(), msg.ptr, msg.len);
+        }
+        string stored = rest;
+        hdr.type = FRAME_OFFLINE;
+        encode_frame_header(hdr, &stored[0]);
 
-    status = select(maxfd, &set, NULL, NULL, NULL);
-    while (status >= 0) {
-        if (FD_ISSET(sockfd, &set)) {
-            status = accept_connection(sockfd, nonlogin_clients);
+        wire_msg online_msg = { text.empty() ? shared_buf() : make_shared_buf(move(text)), make_shared_buf(move(rest)) };
+        deliver(sh, *peer, online_msg, make_shared_buf(move(stored)), NULL, -1);
+        break;
+    }
+    case LINK_STORE:
+    case LINK_BACKLOG: {
+        string range;
+        if (type == LINK_BACKLOG) {
+            if (rest.size() < 2 * sizeof (uint64_t)) {
+                event_log.log(LOG_WARN, "Invalid frame from node %u.", string(), NULL, node);
+                break;
+            }
+            range = rest.substr(0, 2 * sizeof (uint64_t));
+            rest.erase(0, 2 * sizeof (uint64_t));
+        }
+        if (mark_remote_senders(rest, node) < 0) {
+            event_log.log(LOG_WARN, "Invalid frame from node %u.", string(), NULL, node);
+            break;
         }
 
-        if (status < 0) {
+        // Streamed from here if the user is on-line here, and kept if this
+        // is the home node. Otherwise the user left before the messages
+        // came; they stay with the sender, which never gets an ack.
+        client *cl = (peer->owner == sh.id) ? peer->cl : NULL;
+        bool local = (cl != NULL);
+        if (!local && type == LINK_BACKLOG && federation.home_of(name) != federation.self()) {
+            event_log.log(LOG_DEBUG, "Off-line messages of %s came after the user left.", name);
             break;
         }
+        // A chunk sent again after a link failure or a second fetch is
+        // acknowledged but not kept twice.
+        uint64_t last = 0;
+        if (type == LINK_BACKLOG) {
+            memcpy(&last, range.data() + sizeof (uint64_t), sizeof (last));
+            last = be64toh(last);
+        }
+        bool fetched = (local && type == LINK_BACKLOG && federation.home_of(name) == node);
+        if (fetched && last <= cl->backlog_fetched) {
+            rest.clear();
+        }
+        int stored = 0;
+        for (size_t pos = 0; pos < rest.size(); ) {
+            frame_header hdr;
+            decode_frame_header(rest.data() + pos, hdr);
+            stored |= offline.append(name, rest.data() + pos, FRAME_HDR + hdr.length);
+            pos += FRAME_HDR + hdr.length;
+        }
 
-        status = serve_client(set, clients, fd_to_client);
+        // Safe in the store here; the sender may remove its copies.
+        if (fetched && stored == 0 && last > cl->backlog_fetched) {
+            cl->backlog_fetched = last;
+        }
+        if (type == LINK_BACKLOG && stored == 0) {
+            string payload;
+            append_link_name(payload, name);
+            federation.send(node, LINK_ACK, payload + range);
+        }
 
-        if (status < 0) {
+        // A message racing a login at another node follows the user there.
+        if (!local && type == LINK_STORE && peer->node >= 0 && peer->node != node) {
+            push_backlog(*peer, peer->node);
+        }
+        if (local) {
+            cl->backlog = true;
+            lock.unlock();
+            stream_backlog(sh, *cl);
+        }
+        break;
+    }
+    case LINK_FETCH:
+        // Everything goes again, in case the user logged in anew there.
+        if (peer->cl == NULL) {
+            peer->push_node = -1;
+            push_backlog(*peer, node);
+        }
+        break;
+    case LINK_ACK: {
+        uint64_t range[2];
+        if (rest.size() != sizeof (range)) {
+            event_log.log(LOG_WARN, "Invalid frame from node %u.", string(), NULL, node);
             break;
         }
+        memcpy(range, rest.data(), sizeof (range));
+        offline.consume_range(name, be64toh(range[0]), be64toh(range[1]));
+        break;
+    }
+    default:
+        break;
+    }
+}
 
-        status = user_login(set, nonlogin_clients, clients, fd_to_client);
+static void sync_node(int node, bool up)
+{
+    if (!up) {
+        // Users there are off-line as far as this node can tell.
+        for (uint32_t id = 0; id < directory.size(); ++id) {
+            user &u = directory.at(id);
+            std::lock_guard<std::mutex> lock(directory.lock_of(u));
+            if (u.node == node) {
+                u.node = -1;
+            }
+            // What was sent there may be lost; it goes again on the next
+            // fetch.
+            if (u.push_node == node) {
+                u.push_node = -1;
+            }
+        }
+        return;
+    }
 
-        if (status < 0) {
-            break;
+    for (uint32_t id = 0; id < directory.size(); ++id) {
+        user &u = directory.at(id);
+        std::string payload;
+        append_link_name(payload, u.name);
+        std::lock_guard<std::mutex> lock(directory.lock_of(u));
+        bool online = (u.cl != NULL);
+        payload.push_back(online ? 1 : 0);
+        federation.send(node, LINK_USER, payload);
+
+        // Off-line messages lost with the link go again: fetched from the
+        // home node if the user is here, and back to it if left here.
+        if (federation.home_of(u.name) == node) {
+            if (online) {
+                payload.pop_back();
+                federation.send(node, LINK_FETCH, payload);
+            }
+            else {
+                push_backlog(u, node);
+            }
+        }
+    }
+}
+
+static int mark_remote_senders(std::string &frames, int node)
+{
+    // IDs here are below MAX_USERS; those of node N are moved above by
+    // (N + 1) * MAX_USERS, and frames passed on from a third node keep theirs.
+    for (size_t pos = 0; pos < frames.size(); ) {
+        frame_header hdr;
+        if (frames.size() - pos < FRAME_HDR) {
+            return -1;
+        }
+        decode_frame_header(frames.data() + pos, hdr);
+        if (frames.size() - pos - FRAME_HDR < hdr.length) {
+            return -1;
+        }
+        if (hdr.sender < MAX_USERS) {
+            hdr.sender += static_cast<uint32_t>(node + 1) * MAX_USERS;
+            encode_frame_header(hdr, &frames[pos]);
         }
+        pos += FRAME_HDR + hdr.length;
+    }
 
-        FD_ZERO(&set);
-        FD_SET(sockfd, &set);
-        maxfd = sockfd + 1;
+    return 0;
+}
 
-        for (auto &cl : clients) {
-            if (cl.second.fd > 0) {
-                FD_SET(cl.second.fd, &set);
-                if (maxfd <= cl.second.fd) {
-                    maxfd = cl.second.fd + 1;
-                }
+static void begin_handover(shard &sh)
+{
+    sh.stopping = true;
+    if (sh.ring == NULL) {
+        return;
+    }
+
+    // The kernel must not touch buffers or sockets once they are handed over.
+    struct io_uring_sqe *sqe = sh.ring->get_sqe();
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = uring_tag(URING_CANCEL, 0, 0);
+    }
+}
+
+static void park_shard(shard &sh)
+{
+    std::unique_lock<std::mutex> lock(park_mtx);
+    ++parked_shards;
+    park_cv.notify_all();
+    park_cv.wait(lock, [&sh] { return !sh.stopping; });
+    --parked_shards;
+    lock.unlock();
+
+    if (sh.ring == NULL) {
+        return;
+    }
+
+    // Requests cancelled for the handover are made again.
+    ++sh.accept_gen;
+    if (sh.accepting) {
+        arm_accept(sh);
+    }
+    arm_wake(sh);
+    for (size_t fd = 0; fd < sh.conns.size(); ++fd) {
+        if (sh.conns[fd].state != CONN_FREE) {
+            watch_fd(sh, static_cast<int>(fd));
+        }
+    }
+}
+
+static bool sends_in_flight(shard &sh)
+{
+    for (auto cl : sh.online) {
+        if (cl->send_inflight) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *handover_main(void *arg)
+{
+    using namespace std;
+
+    int listen_sock = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+    while (true) {
+        int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
+            perror("accept");
+            return NULL;
         }
+        event_log.log(LOG_INFO, "A new server process is taking over.");
 
-        for (auto &cl : nonlogin_clients) {
-            if (cl.fd > 0) {
-                FD_SET(cl.fd, &set);
-                if (maxfd <= cl.fd) {
-                    maxfd = cl.fd + 1;
-                }
+        for (int i = 0; i < shard_count; ++i) {
+            post_mail(i, new mail{ MAIL_HANDOVER, NULL, NULL, -1, wire_msg(), NULL, NULL });
+        }
+        unique_lock<mutex> lock(park_mtx);
+        park_cv.wait(lock, [] { return parked_shards == shard_count; });
+
+        for (int i = 0; i < shard_count; ++i) {
+            leave_unsaved(*shards[i]);
+        }
+
+        // Mail that reached a shard after it stopped is run on its behalf,
+        // until none is left. Frames still arriving from other cluster nodes
+        // are lost, as on a link failure.
+        uint64_t run = 0, before;
+        do {
+            before = run;
+            run = 0;
+            for (int i = 0; i < shard_count; ++i) {
+                process_mail(*shards[i]);
+                run += shards[i]->metrics.mails.get();
             }
+        } while (run != before);
+
+        vector<int> fds;
+        string state = save_state(fds);
+        offline.save_index();
+        if (send_handover(sock, fds, state) == 0) {
+            event_log.log(LOG_INFO, "Handed %s connection(s) over. Exiting...", to_string(fds.size() - 1));
+            event_log.flush();
+            _exit(0);
         }
 
-        status = select(maxfd, &set, NULL, NULL, NULL);
+        event_log.log(LOG_ERROR, "Fail to hand over to the new server process: %s. Serving on.", strerror(errno));
+        close(sock);
+        for (int i = 0; i < shard_count; ++i) {
+            shards[i]->stopping = false;
+        }
+        park_cv.notify_all();
     }
-    
-    perror("select");
+}
 
-    close(sockfd);
-    
-    return 1;
+static void put_ids(state_writer &out, const std::vector<uint32_t> &ids)
+{
+    out.put_u32(static_cast<uint32_t>(ids.size()));
+    for (auto id : ids) {
+        out.put_u32(id);
+    }
 }
 
-static void sigint_safe_exit(int sig)
+static std::vector<uint32_t> get_ids(state_reader &in)
 {
-    if (sockfd > 2) {
-        close(sockfd);
+    std::vector<uint32_t> ids;
+    uint32_t count = in.get_u32();
+    for (uint32_t i = 0; i < count && !in.failed(); ++i) {
+        ids.push_back(in.get_u32());
     }
-    std::cerr << "Interrupt." << std::endl;
-    exit(1);
+    return ids;
 }
 
-static int client_leave(client &cl, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client)
+static void leave_unsaved(shard &sh)
+{
+    std::string out_dict, in_dict, in_raw;
+    for (size_t fd = 0; fd < sh.conns.size(); ++fd) {
+        conn &c = sh.conns[fd];
+        if (c.state == CONN_FREE || c.cl->save_compression(out_dict, in_dict, in_raw) == 0) {
+            continue;
+        }
+
+        client &cl = *c.cl;
+        if (c.state == CONN_LOGIN) {
+            event_log.log(LOG_WARN, "Connection from %a stopped inside a compressed block, not handed over.", std::string(), reinterpret_cast<const struct sockaddr *>(&cl.addr));
+            unwatch_fd(sh, cl.fd);
+            cl.close();
+            remove_conn(sh, static_cast<int>(fd));
+            continue;
+        }
+
+        // The user logs in again to the new process.
+        event_log.log(LOG_WARN, "User %s stopped inside a compressed block, not handed over.", cl.entry->name);
+        client_leave(sh, cl);
+    }
+}
+
+static std::string save_state(std::vector<int> &fds)
 {
     using namespace std;
 
-    int status = 0;
+    string state;
+    state_writer out(state);
+
+    // The shards share one listening socket.
+    out.put_u32(1);
+    fds.push_back(shards[0]->listenfd);
+
+    // In ID order, so every user gets its ID back; group members and sender
+    // IDs already seen by binary clients stay valid.
+    uint32_t users = directory.size();
+    out.put_u32(users);
+    for (uint32_t id = 0; id < users; ++id) {
+        out.put_str(directory.at(id).name);
+    }
+
+    vector<group *> all = groups.list();
+    out.put_u32(static_cast<uint32_t>(all.size()));
+    for (auto g : all) {
+        out.put_str(g->name);
+        put_ids(out, *g->snapshot());
+    }
+
+    // What a compressed stream remembers; the next messages refer to it.
+    struct streams
+    {
+        string out_dict;
+        string in_dict;
+        string in_raw;
+    };
+
+    vector<const conn *> conns;
+    vector<streams> conn_streams;
+    for (int i = 0; i < shard_count; ++i) {
+        for (auto &c : shards[i]->conns) {
+            if (c.state == CONN_FREE) {
+                continue;
+            }
+            // leave_unsaved() closed the connections this could fail for.
+            streams zs;
+            if (c.cl->save_compression(zs.out_dict, zs.in_dict, zs.in_raw) < 0) {
+                continue;
+            }
+            conns.push_back(&c);
+            conn_streams.push_back(move(zs));
+        }
+    }
+
+    out.put_u32(static_cast<uint32_t>(conns.size()));
+    for (size_t i = 0; i < conns.size(); ++i) {
+        const conn *c = conns[i];
+        client &cl = *c->cl;
+        fds.push_back(cl.fd);
+        out.put_u8(static_cast<uint8_t>(c->state));
+        out.put_u32(static_cast<uint32_t>((c->state == CONN_ONLINE) ? cl.owner : 0));
+        out.put_u32((c->state == CONN_ONLINE) ? cl.entry->id : 0);
+        out.put_str(string(reinterpret_cast<const char *>(&cl.addr), sizeof (cl.addr)));
+        string in, pending;
+        cl.save_buffers(in, pending);
+        out.put_str(in);
+        out.put_str(pending);
+        if (c->state != CONN_ONLINE) {
+            continue;
+        }
+
+        out.put_u8(cl.binary ? 1 : 0);
+        out.put_u8(cl.is_compressed() ? 1 : 0);
+        out.put_str(conn_streams[i].out_dict);
+        out.put_str(conn_streams[i].in_dict);
+        out.put_str(conn_streams[i].in_raw);
+        out.put_u32(static_cast<uint32_t>(cl.spilled_msgs.size()));
+        for (auto &msg : cl.spilled_msgs) {
+            out.put_str(*msg.wire);
+            out.put_u8(msg.stored ? 1 : 0);
+            out.put_str(msg.stored ? *msg.stored : string());
+        }
+        out.put_u8(cl.backlog ? 1 : 0);
+        out.put_u64(cl.backlog_sent);
+        out.put_u64(cl.backlog_prev);
+        out.put_u64(cl.backlog_fetched);
+
+        // A chat still being sent goes on in the new process.
+        out.put_u8(cl.chat_open ? 1 : 0);
+        vector<uint32_t> peers;
+        for (auto peer : cl.chat_peers) {
+            peers.push_back(peer->id);
+        }
+        put_ids(out, peers);
+        out.put_str((cl.chat_group != NULL) ? cl.chat_group->name : string());
+        put_ids(out, cl.chat_members ? *cl.chat_members : vector<uint32_t>());
+        out.put_u64(cl.chat_bytes);
+        out.put_u32(cl.chat_time);
+    }
+
+    return state;
+}
+
+static int take_over(std::vector<int> &fds, std::string &state)
+{
+    int sock = handover_connect(options.handover_path);
+    if (sock < 0) {
+        return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+    }
+
+    if (recv_handover(sock, fds, state) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    // The old process exits right after; its off-line store and cluster
+    // link port are free then.
+    if (wait_peer_exit(sock) < 0) {
+        perror("wait_peer_exit");
+    }
+    close(sock);
+
+    return 1;
+}
+
+static int restore_state(state_reader &in, const std::vector<int> &fds, size_t first)
+{
+    using namespace std;
+
+    uint32_t users = in.get_u32();
+    for (uint32_t id = 0; id < users && !in.failed(); ++id) {
+        directory.insert(in.get_str());
+    }
 
-    string leave = "User " + cl.name + " is off-line.\n";
-    for (auto it_lmsg = clients.begin(); it_lmsg != clients.end(); ++it_lmsg) {
-        client &cl_lmsg = it_lmsg->second;
-        if (cl_lmsg.fd < 0 || &cl_lmsg == &cl) {
+    uint32_t group_count = in.get_u32();
+    for (uint32_t i = 0; i < group_count && !in.failed(); ++i) {
+        group *g = groups.create(in.get_str()).first;
+        g->members = make_shared<const vector<uint32_t>>(get_ids(in));
+    }
+
+    uint32_t count = in.get_u32();
+    if (in.failed() || directory.size() != users || count != fds.size() - first) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        int fd = fds[first + i];
+        conn_state state = static_cast<conn_state>(in.get_u8());
+        shard &sh = *shards[in.get_u32() % shard_count];
+        uint32_t id = in.get_u32();
+        string addr = in.get_str();
+        string input = in.get_str();
+        string pending = in.get_str();
+        if (in.failed() || (state == CONN_ONLINE && id >= users) || (state != CONN_ONLINE && state != CONN_LOGIN)) {
+            return -1;
+        }
+
+        client *cl = new client(fd, sh.id, sockaddr_storage());
+        memcpy(&cl->addr, addr.data(), min(addr.size(), sizeof (cl->addr)));
+        if (cl->set_nonblocking(options.high_watermark, options.low_watermark, options.policy) < 0) {
+            perror("restore_state");
+        }
+        cl->restore_buffers(input, pending);
+        if (state == CONN_LOGIN) {
+            add_conn(sh, CONN_LOGIN, cl);
+            continue;
+        }
+
+        user &u = directory.at(id);
+        u.cl = cl;
+        u.owner = sh.id;
+        cl->entry = &u;
+        cl->binary = (in.get_u8() != 0);
+        bool compressed = (in.get_u8() != 0);
+        string out_dict = in.get_str();
+        string in_dict = in.get_str();
+        string in_raw = in.get_str();
+        if (compressed && cl->restore_compression(options.compress_level, out_dict, in_dict, in_raw) < 0) {
+            perror("restore_state");
+        }
+        uint32_t spilled = in.get_u32();
+        for (uint32_t j = 0; j < spilled && !in.failed(); ++j) {
+            shared_buf wire = make_shared_buf(in.get_str());
+            bool has_stored = (in.get_u8() != 0);
+            string stored = in.get_str();
+            cl->spilled_msgs.push_back(spilled_msg{ wire, has_stored ? make_shared_buf(move(stored)) : shared_buf() });
+        }
+        cl->backlog = (in.get_u8() != 0);
+        cl->backlog_sent = in.get_u64();
+        cl->backlog_prev = in.get_u64();
+        cl->backlog_fetched = in.get_u64();
+
+        cl->chat_open = (in.get_u8() != 0);
+        for (auto peer : get_ids(in)) {
+            if (peer < users) {
+                cl->chat_peers.push_back(&directory.at(peer));
+            }
+        }
+        string group_name = in.get_str();
+        cl->chat_group = group_name.empty() ? NULL : groups.find(group_name);
+        vector<uint32_t> members = get_ids(in);
+        if (cl->chat_group != NULL) {
+            cl->chat_members = make_shared<const vector<uint32_t>>(move(members));
+        }
+        cl->chat_bytes = in.get_u64();
+        cl->chat_time = in.get_u32();
+        add_conn(sh, CONN_ONLINE, cl);
+    }
+
+    return in.failed() ? -1 : 0;
+}
+
+static void adopt_conns(shard &sh)
+{
+    sh.now = metrics_clock();
+    for (size_t fd = 0; fd < sh.conns.size(); ++fd) {
+        const conn &c = sh.conns[fd];
+        if (c.state == CONN_FREE) {
+            continue;
+        }
+
+        client &cl = *c.cl;
+        if (sh.ring != NULL) {
+            cl.set_deferred();
+        }
+        if (watch_fd(sh, static_cast<int>(fd)) < 0) {
+            perror("adopt_conns");
+        }
+
+        // Timers start over.
+        if (c.state == CONN_LOGIN) {
+            if (options.login_timeout > 0) {
+                sh.wheel->schedule(cl.timer, sh.now + options.login_timeout * NS_PER_SEC);
+            }
             continue;
         }
+        cl.last_active = sh.now;
+        cl.last_heartbeat = sh.now;
+        arm_online_timer(sh, cl);
+        update_watch(cl);
+
+        // Inflated input that was waiting for room in the buffer.
+        if (cl.input_pending()) {
+            serve_commands(sh, cl);
+        }
+    }
+
+    if (sh.metrics.pending.get() >= options.max_pending) {
+        pause_accept(sh);
+    }
+}
 
-        int len = static_cast<int>(leave.size());
-        status = cl_lmsg.send(leave.c_str(), &len, MSG_NOSIGNAL);
-        if (status < 0) {
-            if (errno == EPIPE) {
-                status = 0;
+static int parse_options(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "H:L:P:t:d:M:l:uB:C:T:I:K:p:n:c:k:U:z:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            options.high_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            options.low_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            if (strcmp(optarg, "drop") == 0) {
+                options.policy = OVERFLOW_DROP;
+            }
+            else if (strcmp(optarg, "disconnect") == 0) {
+                options.policy = OVERFLOW_DISCONNECT;
+            }
+            else if (strcmp(optarg, "spill") == 0) {
+                options.policy = OVERFLOW_SPILL;
             }
             else {
-                perror("my_send");
-                return status;
+                std::cerr << "Unknown overflow policy " << optarg << "." << std::endl;
+                return -1;
+            }
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            if (options.threads < 1 || options.threads > MAX_SHARDS) {
+                std::cerr << "Thread count must be between 1 and " << MAX_SHARDS << "." << std::endl;
+                return -1;
+            }
+            break;
+        case 'd':
+            options.store_dir = optarg;
+            break;
+        case 'M':
+            options.max_message = strtoul(optarg, NULL, 10);
+            if (options.max_message == 0) {
+                std::cerr << "Message size limit must be positive." << std::endl;
+                return -1;
+            }
+            break;
+        case 'l':
+            if (parse_log_level(optarg, options.min_log_level) < 0) {
+                std::cerr << "Unknown log level " << optarg << "." << std::endl;
+                return -1;
+            }
+            break;
+        case 'u':
+            options.uring = true;
+            break;
+        case 'B':
+            options.listen_backlog = atoi(optarg);
+            if (options.listen_backlog < 1) {
+                std::cerr << "Listen backlog must be positive." << std::endl;
+                return -1;
+            }
+            break;
+        case 'C':
+            options.max_pending = strtoul(optarg, NULL, 10);
+            if (options.max_pending == 0) {
+                std::cerr << "Pending connection cap must be positive." << std::endl;
+                return -1;
+            }
+            break;
+        case 'T':
+            options.login_timeout = static_cast<unsigned>(strtoul(optarg, NULL, 10));
+            break;
+        case 'I':
+            options.idle_timeout = static_cast<unsigned>(strtoul(optarg, NULL, 10));
+            break;
+        case 'K':
+            options.heartbeat = static_cast<unsigned>(strtoul(optarg, NULL, 10));
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            if (options.port < 1 || options.port > 65535) {
+                std::cerr << "Port must be between 1 and 65535." << std::endl;
+                return -1;
+            }
+            break;
+        case 'n':
+            options.node = atoi(optarg);
+            break;
+        case 'c':
+            options.cluster_nodes = optarg;
+            break;
+        case 'k':
+            options.cluster_key = optarg;
+            break;
+        case 'U':
+            options.handover_path = optarg;
+            break;
+        case 'z':
+            options.compress_level = atoi(optarg);
+            if (options.compress_level < 0 || options.compress_level > 9) {
+                std::cerr << "Compression level must be between 0 and 9." << std::endl;
+                return -1;
             }
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-H high_watermark] [-L low_watermark] [-P drop|disconnect|spill] [-t threads] [-d store_dir] [-M max_message] [-l debug|info|warn|error] [-u] [-B listen_backlog] [-C max_pending] [-T login_timeout] [-I idle_timeout] [-K heartbeat] [-p port] [-n node -c host:port,host:port... [-k key_file]] [-U handover_socket] [-z 0-9]" << std::endl;
+            return -1;
         }
     }
 
-    fd_to_client.erase(cl.fd);
-    cl.close();
-
-    return status;
+    return 0;
 }
 
 static const void *get_in_addr(const struct sockaddr &sa)
@@ -213,23 +3021,17 @@ static const void *get_in_addr(const struct sockaddr &sa)
   return &(reinterpret_cast<const struct sockaddr_in6 *>(&sa)->sin6_addr);
 }
 
-static uint16_t get_in_port(const struct sockaddr &sa)
-{
-    if (sa.sa_family == AF_INET) {
-        return ntohs(reinterpret_cast<const struct sockaddr_in *>(&sa)->sin_port);
-    }
-    return ntohs(reinterpret_cast<const struct sockaddr_in6 *>(&sa)->sin6_port);
-}
-
-static int start_server()
+static int start_server(int &sockfd)
 {
     // Create socket
     int addr_family = AF_INET6;
-    sockfd = socket(PF_INET6, SOCK_STREAM, 0);
+    // Non-blocking, so a burst of connections is accepted until the queue
+    // is empty.
+    sockfd = socket(PF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         std::cout << "Fail to open IPv6 socket. Fallback to IPv4 socket." << std::endl;
         addr_family = AF_INET;
-        sockfd = socket(PF_INET, SOCK_STREAM, 0);
+        sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (sockfd < 0) {
             perror("socket");
             return -1;
@@ -247,7 +3049,7 @@ static int start_server()
             close(sockfd);
 
             addr_family = AF_INET;
-            sockfd = socket(PF_INET, SOCK_STREAM, 0);
+            sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
             if (sockfd < 0) {
                 perror("socket");
                 return -1;
@@ -255,17 +3057,24 @@ static int start_server()
         }
     }
 
+    // A restart may bind while connections of the last run linger in
+    // TIME_WAIT. Unlike SO_REUSEPORT, this lets no second server listen.
+    int yes = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) != 0) {
+        perror("setsockopt");
+    }
+
     if (addr_family == AF_INET6) {
         struct sockaddr_in6 any_addr = {};
         any_addr.sin6_family = AF_INET6;
-        any_addr.sin6_port = htons(LISTEN_PORT);
+        any_addr.sin6_port = htons(options.port);
 
         status = bind(sockfd, reinterpret_cast<const struct sockaddr *>(&any_addr), sizeof (any_addr));
     }
     else {
         struct sockaddr_in any_addr = {};
         any_addr.sin_family = AF_INET;
-        any_addr.sin_port = htons(LISTEN_PORT);
+        any_addr.sin_port = htons(options.port);
 
         status = bind(sockfd, reinterpret_cast<const struct sockaddr *>(&any_addr), sizeof (any_addr));
     }
@@ -275,23 +3084,15 @@ static int start_server()
         return -1;
     }
 
-    status = listen(sockfd, 10);
+    status = listen(sockfd, options.listen_backlog);
     if (status < 0) {
         perror("listen");
         return -1;
     }
 
-    std::cout << "Start listening at port " << LISTEN_PORT << "." << std::endl;
-
     return 0;
 }
 
-static std::string get_port(client&cl)
-{
-    struct sockaddr &client_addr = *reinterpret_cast<struct sockaddr *>(&cl.addr);
-    return std::to_string(get_in_port(client_addr));
-}
-
 static std::string get_ip(client &cl)
 {
     struct sockaddr &client_addr = *reinterpret_cast<struct sockaddr *>(&cl.addr);
@@ -310,239 +3111,616 @@ static std::string get_ip(client &cl)
 
 static void print_client(client &cl)
 {
-    std::cout << "Connection from " << get_ip(cl) << " port " <<
-    get_port(cl) << " protocol SOCK_STREAM(TCP) accepted." << std::endl;
+    event_log.log(LOG_INFO, "Connection from %a port %p protocol SOCK_STREAM(TCP) accepted.", std::string(), reinterpret_cast<const struct sockaddr *>(&cl.addr));
 }
 
 static int welcome(client &cl)
 {
 
-    std::cout << "User " << cl.name << " from " << get_ip(cl) << " logged in." << std::endl;
+    event_log.log(LOG_INFO, "User %s from %a logged in.", cl.entry->name, reinterpret_cast<const struct sockaddr *>(&cl.addr));
     
-    int msglen = static_cast<int>(strlen(welcome_msg));
-    return cl.send(welcome_msg, &msglen, MSG_NOSIGNAL);
+    return send_msg(cl, welcome_msg);
 }
 
-static int accept_connection(int sockfd, std::vector<client> &nonlogin_clients)
+static int accept_connection(shard &sh)
 {
-    struct sockaddr_storage client_addr = {};
-    socklen_t client_addr_size = sizeof (client_addr);
+    // Take a burst of connections in one wakeup, but leave the rest of a
+    // storm for the next one so logged in users are not starved.
+    for (int i = 0; i < ACCEPT_BATCH && sh.accepting; ++i) {
+        struct sockaddr_storage client_addr = {};
+        socklen_t client_addr_size = sizeof (client_addr);
+
+        int clientfd = accept4(sh.listenfd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
 
-    // Accept client connecting.
-    int clientfd = accept(sockfd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size);
-    if (clientfd < 0) {
-        perror("accept");
-        return -1;
+            // Out of descriptors or memory: wait for a connection to close
+            // rather than spin on the ready listening socket.
+            event_log.log(LOG_WARN, "Fail to accept connection: %s.", strerror(errno));
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                pause_accept(sh);
+            }
+            break;
+        }
+
+        if (start_client(sh, clientfd, client_addr) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int start_client(shard &sh, int clientfd, const struct sockaddr_storage &client_addr)
+{
+    client *cl = new client(clientfd, sh.id, client_addr);
+    if (cl->set_nonblocking(options.high_watermark, options.low_watermark, options.policy) < 0 ||
+    watch_fd(sh, clientfd) < 0) {
+        log_io_error(*cl, "start_client", errno);
+        cl->close();
+        delete cl;
+        return 0;
+    }
+
+    if (sh.ring != NULL) {
+        cl->set_deferred();
     }
 
-    nonlogin_clients.push_back({ clientfd, "", client_addr });
-    print_client(nonlogin_clients.back());
+    // Without heartbeats a dead peer is only noticed by a failing send;
+    // with them, unacknowledged data gives up after two periods.
+    if (options.heartbeat > 0) {
+        unsigned user_timeout = options.heartbeat * 2000;
+        setsockopt(clientfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof (user_timeout));
+    }
+    if (options.login_timeout > 0) {
+        sh.wheel->schedule(cl->timer, sh.now + options.login_timeout * NS_PER_SEC);
+    }
+
+    add_conn(sh, CONN_LOGIN, cl);
+    sh.metrics.accepted.add();
+    print_client(*cl);
+
+    if (sh.metrics.pending.get() >= options.max_pending) {
+        pause_accept(sh);
+    }
 
     return 0;
 }
 
-static int serve_client(fd_set &set, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client)
+static int serve_client(shard &sh, client &cl)
 {
-    using namespace std;
+    // Read once, then run every complete command the read brought in.
+    int status = cl.fill();
+    if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
 
-    int status = 0;
+    // Checked when the timer fires, so traffic never moves it.
+    cl.last_active = sh.now;
 
-    for (auto it = clients.begin(); it != clients.end(); ++it) {
-        client &cl = it->second;
-        if (cl.fd < 0 || !FD_ISSET(cl.fd, &set)) {
-            continue;
-        }
+    if (status < 0) {
+        log_io_error(cl, "my_fill", errno);
+        client_leave(sh, cl);
+        return 0;
+    }
 
-        char cmd_orig[MAX_CMD];
-        int cmdlen = MAX_CMD;
-        status = cl.recv_cmd(cmd_orig, &cmdlen);
+    bool closed = (status == 0);
+    status = serve_commands(sh, cl);
+
+    if (closed && cl.fd > 0) {
+        event_log.log(LOG_INFO, "Connection closed by user %s.", cl.entry->name);
+        client_leave(sh, cl);
+    }
+
+    return status;
+}
+
+static int serve_commands(shard &sh, client &cl)
+{
+    using namespace std;
+
+    char cmd_orig[MAX_FRAME];
+    while (cl.fd > 0) {
+        // The mode may switch between two commands of the same read.
+        bool binary = cl.binary;
+        int cmdlen = binary ? MAX_FRAME : MAX_CMD;
+        int status = binary ? cl.next_frame(cmd_orig, &cmdlen) : cl.next_cmd(cmd_orig, &cmdlen);
         if (status < 0) {
-            perror("my_recv_cmd");
-        }
-        if (status > 0) {
-            if (cmdlen == 0) {
-                cout << "Connection closed by user " << cl.name << "." << endl;
-            }
-            else {
-                cout << "Invalid command received from user " << cl.name << ". Terminating connection..." << endl;
+            // Inflated input may still wait for room in the buffer.
+            if (cl.input_pending() && cl.fill() > 0) {
+                continue;
             }
+            return 0;
+        }
+        sh.metrics.commands.add();
 
-            client_leave(cl, clients, fd_to_client);
-            continue;
+        parsed_cmd &cmd = sh.cmd;
+        frame_header hdr = {};
+        if (status == 0 && binary) {
+            decode_frame_header(cmd_orig, hdr);
         }
-        
-        vector<string> cmd = parse_command(cmd_orig);
-        if (cmd.size() == 0) {
+        bool known = !binary || hdr.type == FRAME_CHAT || hdr.type == FRAME_CHUNK || hdr.type == FRAME_COMMAND;
+        if (status > 0 || !known || (hdr.type == FRAME_CHAT && parse_chat_frame(cmd_orig, cmdlen, cmd) < 0)) {
+            event_log.log(LOG_WARN, "Invalid command received from user %s. Terminating connection...", cl.entry->name);
+            client_leave(sh, cl);
+            return 0;
+        }
+        if (hdr.type == FRAME_CHUNK) {
+            status = relay_chunk(sh, cl, cmd_orig, cmdlen);
+            if (status < 0) {
+                return status;
+            }
             continue;
         }
-        
-        if (cmd[0] == "chat") {
-            status = relay_msg(cmd, cmd_orig, cl, clients, fd_to_client);
+        // A command frame carries a text command.
+        int skip = (hdr.type == FRAME_COMMAND) ? FRAME_HDR : 0;
+        if (hdr.type != FRAME_CHAT && (tokenize_command(cmd_orig + skip, cmdlen - skip, cmd) < 0 || cmd.count == 0)) {
+            continue;
         }
 
-        if (status < 0) {
-            break;
+        if (cmd.words[0] == "chat" || cmd.words[0] == "gchat") {
+            status = relay_msg(sh, cmd, cl, hdr.flags);
+            if (status < 0) {
+                return status;
+            }
+        }
+        else if (cmd.words[0] == "create" || cmd.words[0] == "join" || cmd.words[0] == "leave") {
+            group_command(cl, cmd);
+        }
+        else if (cmd.words[0] == "stats") {
+            stats_command(cl);
+        }
+        else if (cmd.words[0] == "binary") {
+            // Last text line; the client reads frames after it.
+            send_msg(cl, "Binary framing on.\n");
+            cl.binary = true;
+        }
+        else if (cmd.words[0] == "compress" && !cl.is_compressed()) {
+            // Last plain bytes; whatever follows the command is compressed.
+            // A spilled answer would be sent compressed, so it must be queued.
+            if (send_msg(cl, "Compression on.\n") != 0 || cl.start_deflate(options.compress_level) < 0 || cl.start_inflate() < 0) {
+                event_log.log(LOG_WARN, "Fail to start compression for user %s. Terminating connection...", cl.entry->name);
+                client_leave(sh, cl);
+                return 0;
+            }
         }
     }
 
-    return status;
+    return 0;
 }
 
-static int relay_msg(std::vector<std::string> &cmd, const char *cmd_orig, client &cl, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client)
+static int relay_msg(shard &sh, const parsed_cmd &cmd, client &cl, uint8_t flags)
 {
     using namespace std;
 
-    int status = 0;
+    if (!cmd.has_msg || cl.chat_open) {
+        event_log.log(LOG_WARN, "Invalid command received. Terminating connection...");
+        client_leave(sh, cl);
+        return 0;
+    }
 
-    size_t cmd_len = strlen(cmd_orig);
-    unsigned int msg_start = 0;
-    unsigned int msg_end = 0;
-    for (unsigned int i = 6; i < cmd_len && cmd_orig[i] != '\n'; ++i) {
-        if (cmd_orig[i] == '"') {
-            if (msg_start > 0) {
-                msg_end = i;
-                break;
+    // Pieces following a refused chat are read and dropped.
+    cl.chat_open = (flags & FRAME_MORE) != 0;
+    end_chat(cl);
+
+    if (cmd.words[0] == "gchat") {
+        if (cmd.count != 2) {
+            send_msg(cl, "Please provide one group.\n");
+            return 0;
+        }
+
+        string name = cmd.words[1].str();
+        group *g = groups.find(name);
+        if (g == NULL) {
+            send_msg(cl, "Group " + name + " does not exist.\n");
+            return 0;
+        }
+
+        // One lookup; the members are fixed for the whole chat.
+        member_list members = g->snapshot();
+        if (!group::has_member(members, cl.entry->id)) {
+            send_msg(cl, "You are not in group " + name + ".\n");
+            return 0;
+        }
+
+        cl.chat_group = g;
+        cl.chat_members = move(members);
+        sh.metrics.fan_out.record(cl.chat_members->size() - 1);
+    }
+    else {
+        for (int i = 1; i < cmd.count; ++i) {
+            user *peer = directory.find(cmd.words[i].ptr, cmd.words[i].len);
+            if (peer == NULL) {
+                send_msg(cl, "User " + cmd.words[i].str() + " does not exist.\n");
+                cl.chat_peers.clear();
+                return 0;
             }
-            msg_start = i;
+
+            cl.chat_peers.push_back(peer);
+        }
+
+        if (cl.chat_peers.empty()) {
+            return 0;
         }
+        sh.metrics.fan_out.record(cl.chat_peers.size());
     }
-    if (msg_start == 0 || msg_end == 0) {
-        cout << "Invalid command received. Terminating connection..." << endl;
-        client_leave(cl, clients, fd_to_client);
-        return status;
+
+    sh.metrics.chats.add();
+    cl.chat_bytes = 0;
+    cl.chat_time = static_cast<uint32_t>(time(NULL));
+    relay_piece(sh, cl, cmd.msg.ptr, cmd.msg.len, flags & FRAME_MORE);
+
+    return 0;
+}
+
+static int relay_chunk(shard &sh, client &cl, const char *frame, size_t len)
+{
+    frame_header hdr;
+    decode_frame_header(frame, hdr);
+    if (!cl.chat_open) {
+        event_log.log(LOG_WARN, "Invalid command received. Terminating connection...");
+        client_leave(sh, cl);
+        return 0;
+    }
+
+    cl.chat_open = (hdr.flags & FRAME_MORE) != 0;
+    if (!cl.chat_peers.empty() || cl.chat_group != NULL) {
+        relay_piece(sh, cl, frame + FRAME_HDR, len - FRAME_HDR, FRAME_CONT | (hdr.flags & FRAME_MORE));
     }
 
-    string msg(cmd_orig + msg_start + 1, msg_end - msg_start - 1);
-    vector<client *> msg_peers;
+    return 0;
+}
 
-    for (unsigned int i = 1; i < cmd.size(); ++i) {
-        if (cmd[i][0] == '"') {
-            break;
+static void relay_piece(shard &sh, client &cl, const char *msg, size_t len, uint8_t flags)
+{
+    using namespace std;
+
+    bool cut = (len > options.max_message - cl.chat_bytes);
+    if (cut) {
+        len = options.max_message - cl.chat_bytes;
+        flags = (flags & ~FRAME_MORE) | FRAME_CUT;
+    }
+    cl.chat_bytes += len;
+
+    // Every relayed frame, names included, has to fit MAX_FRAME.
+    string group_name = (cl.chat_group != NULL) ? cl.chat_group->name : string();
+    size_t room = MAX_FRAME - FRAME_HDR - 1 - min(cl.entry->name.size(), static_cast<size_t>(255));
+    if (!group_name.empty()) {
+        room -= 1 + group_name.size();
+    }
+
+    size_t pos = 0;
+    do {
+        size_t piece_len = min(len - pos, room);
+        uint8_t piece_flags = flags | ((pos > 0) ? FRAME_CONT : 0);
+        if (pos + piece_len < len) {
+            piece_flags = (piece_flags | FRAME_MORE) & ~FRAME_CUT;
         }
+        const char *piece = msg + pos;
+        pos += piece_len;
 
-        auto peer = clients.find(cmd[i]);
-        if (peer == clients.end()) {
-            string nonexist = "User " + cmd[i] + " does not exist.\n";
-            int len = static_cast<int>(nonexist.size());
-            cl.send(nonexist.c_str(), &len, MSG_NOSIGNAL);
-            msg_peers.clear();
-            break;
+        // Format once; every recipient queue shares the same buffers.
+        string text, frame, stored;
+        if (piece_len > 0 || !(piece_flags & FRAME_CONT)) {
+            append_message_text(text, FRAME_MESSAGE, cl.chat_time, cl.entry->name, group_name, piece, piece_len);
         }
+        append_message_frame(frame, FRAME_MESSAGE, cl.chat_time, cl.entry->id, cl.entry->name, group_name, piece, piece_len, piece_flags);
+        append_message_frame(stored, FRAME_OFFLINE, cl.chat_time, cl.entry->id, cl.entry->name, group_name, piece, piece_len, piece_flags);
 
-        msg_peers.push_back(&peer->second);
+        wire_msg online_msg = { text.empty() ? shared_buf() : make_shared_buf(move(text)), make_shared_buf(move(frame)) };
+        fan_out(sh, cl, online_msg, make_shared_buf(move(stored)));
+        sh.metrics.pieces.add();
+    } while (pos < len);
+    sh.metrics.chat_bytes.add(len);
+
+    if (cut) {
+        send_msg(cl, "Message is too long.\n");
+    }
+    if (cut || !(flags & FRAME_MORE)) {
+        end_chat(cl);
     }
+}
 
-    msg = "message " + to_string(time(NULL)) + " " + cl.name + " \"" + msg + "\"\n";
-    string offline_msg = msg;
-    offline_msg.replace(0, 7, "offline");
-    for (auto peer : msg_peers) {
-        if (peer->fd > 0) {
-            int len = static_cast<int>(msg.size());
-            status = peer->send(msg.c_str(), &len, MSG_NOSIGNAL);
-            if (status < 0) {
-                perror("my_send");
-                break;
+static void fan_out(shard &sh, client &cl, const wire_msg &msg, const shared_buf &offline_msg)
+{
+    if (sh.forward.size() < static_cast<size_t>(shard_count)) {
+        sh.forward.resize(shard_count);
+    }
+
+    for (size_t i = 0; i < cl.chat_peers.size(); ++i) {
+        deliver(sh, *cl.chat_peers[i], msg, offline_msg, cl.entry, sh.id, sh.forward.data());
+    }
+    if (cl.chat_group != NULL) {
+        for (uint32_t id : *cl.chat_members) {
+            if (id != cl.entry->id) {
+                deliver(sh, directory.at(id), msg, offline_msg, cl.entry, sh.id, sh.forward.data());
             }
         }
-        if (peer->fd < 0 || (status < 0 && errno == EPIPE)) {
-            string offline = "User " + peer->name + " is off-line. The message will be passed when he comes back.\n";
-            int len = static_cast<int>(offline.size());
-            status = cl.send(offline.c_str(), &len, MSG_NOSIGNAL);
-            if (status < 0) {
-                perror("my_send");
-                break;
-            }
-            else {
-                status = 0;
-            }
+    }
 
-            peer->offline_msgs.push_back(offline_msg);
+    for (int i = 0; i < shard_count; ++i) {
+        if (!sh.forward[i].empty()) {
+            mail *m = new mail{ MAIL_FANOUT, NULL, cl.entry, sh.id, msg, offline_msg, NULL };
+            m->targets.swap(sh.forward[i]);
+            post_mail(i, m);
         }
     }
+}
 
-    return status;
+static void end_chat(client &cl)
+{
+    cl.chat_peers.clear();
+    cl.chat_group = NULL;
+    cl.chat_members.reset();
 }
 
-static int user_login(fd_set &set, std::vector<client> &nonlogin_clients, std::map<std::string, client> &clients, std::map<int, client *> &fd_to_client)
+static void group_command(client &cl, const parsed_cmd &cmd)
 {
     using namespace std;
 
-    int status = 0;
+    if (cmd.count != 2 || cmd.words[1].len > 255) {
+        send_msg(cl, "Please provide one group name.\n");
+        return;
+    }
 
-    for (auto it = nonlogin_clients.begin(); it != nonlogin_clients.end(); ) {
-        client &cl = *it;
-        if (!FD_ISSET(it->fd, &set)) {
-            ++it;
-            continue;
+    string name = cmd.words[1].str();
+    if (cmd.words[0] == "create") {
+        auto created = groups.create(name);
+        if (!created.second) {
+            send_msg(cl, "Group " + name + " exists.\n");
+            return;
+        }
+
+        created.first->join(cl.entry->id);
+        send_msg(cl, "Group " + name + " created.\n");
+        return;
+    }
+
+    group *g = groups.find(name);
+    if (g == NULL) {
+        send_msg(cl, "Group " + name + " does not exist.\n");
+    }
+    else if (cmd.words[0] == "join") {
+        send_msg(cl, g->join(cl.entry->id) ? "Joined group " + name + ".\n" : "You are in group " + name + " already.\n");
+    }
+    else {
+        send_msg(cl, g->leave(cl.entry->id) ? "Left group " + name + ".\n" : "You are not in group " + name + ".\n");
+    }
+}
+
+static void stats_command(client &cl)
+{
+    using namespace std;
+
+    // Only for whoever runs the server.
+    const struct sockaddr &sa = reinterpret_cast<const struct sockaddr &>(cl.addr);
+    bool local = false;
+    if (sa.sa_family == AF_INET) {
+        local = (ntohl(reinterpret_cast<const struct sockaddr_in &>(sa).sin_addr.s_addr) >> 24) == 127;
+    }
+    else if (sa.sa_family == AF_INET6) {
+        const struct in6_addr &addr = reinterpret_cast<const struct sockaddr_in6 &>(sa).sin6_addr;
+        local = IN6_IS_ADDR_LOOPBACK(&addr) || (IN6_IS_ADDR_V4MAPPED(&addr) && addr.s6_addr[12] == 127);
+    }
+    if (!local) {
+        send_msg(cl, "Statistics are only available from the server host.\n");
+        return;
+    }
+
+    string text = render_metrics();
+
+    // A notice frame holds one line.
+    wire_msg msg;
+    if (cl.binary) {
+        string frames;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            append_notice_frame(frames, text.data() + pos, end - pos);
+            pos = end + 1;
+        }
+        msg.frame = make_shared_buf(move(frames));
+    }
+    else {
+        msg.text = make_shared_buf(move(text));
+    }
+    send_msg(cl, msg);
+}
+
+static std::string render_metrics()
+{
+    using namespace std;
+
+    auto total = [](counter shard_metrics::*field) {
+        uint64_t sum = 0;
+        for (int i = 0; i < shard_count; ++i) {
+            sum += (shards[i]->metrics.*field).get();
         }
+        return sum;
+    };
+    auto merged = [](histogram shard_metrics::*field) {
+        histogram_snapshot snap;
+        for (int i = 0; i < shard_count; ++i) {
+            (shards[i]->metrics.*field).add_to(snap);
+        }
+        return snap;
+    };
+
+    size_t offline_users, offline_bytes;
+    size_t offline_msgs = offline.pending(offline_users, offline_bytes);
+
+    string out;
+    append_metric(out, "chat_connections_accepted_total", "counter", "Connections accepted.", total(&shard_metrics::accepted));
+    append_metric(out, "chat_connections_pending", "gauge", "Connections not logged in yet.", total(&shard_metrics::pending));
+    append_metric(out, "chat_accept_pauses_total", "counter", "Times a reactor thread stopped accepting at the pending connection cap or the descriptor limit.", total(&shard_metrics::accept_pauses));
+    append_metric(out, "chat_login_timeouts_total", "counter", "Connections closed for not logging in in time.", total(&shard_metrics::login_timeouts));
+    append_metric(out, "chat_idle_evictions_total", "counter", "Users disconnected for being idle.", total(&shard_metrics::idle_evictions));
+    append_metric(out, "chat_heartbeats_total", "counter", "Heartbeats sent to quiet users.", total(&shard_metrics::heartbeats));
+    append_metric(out, "chat_logins_total", "counter", "Successful logins.", total(&shard_metrics::logins));
+    append_metric(out, "chat_logins_refused_total", "counter", "Logins refused because the name is in use or there are too many users.", total(&shard_metrics::logins_refused));
+    append_metric(out, "chat_leaves_total", "counter", "Logged in users that left.", total(&shard_metrics::leaves));
+    append_metric(out, "chat_users_online", "gauge", "Logged in users.", total(&shard_metrics::online));
+    append_metric(out, "chat_users_known", "gauge", "Users that logged in since the server started.", directory.size());
+    append_metric(out, "chat_commands_total", "counter", "Commands and frames received from logged in users.", total(&shard_metrics::commands));
+    append_metric(out, "chat_messages_total", "counter", "Chats relayed.", total(&shard_metrics::chats));
+    append_metric(out, "chat_message_frames_total", "counter", "Pieces of chats relayed, one per frame.", total(&shard_metrics::pieces));
+    append_metric(out, "chat_message_bytes_total", "counter", "Bytes of chat messages relayed.", total(&shard_metrics::chat_bytes));
+    append_metric(out, "chat_deliveries_total", "counter", "Messages queued for an on-line recipient.", total(&shard_metrics::delivered));
+    append_metric(out, "chat_deliveries_stored_total", "counter", "Messages stored for a recipient that is off-line or still receiving its off-line messages.", total(&shard_metrics::stored));
+    append_metric(out, "chat_deliveries_dropped_total", "counter", "Messages dropped by the overflow policy.", total(&shard_metrics::dropped));
+    append_metric(out, "chat_deliveries_forwarded_total", "counter", "Messages handed to the thread of the recipient.", total(&shard_metrics::forwarded));
+    append_metric(out, "chat_remote_total", "counter", "Message frames handed to the cluster node of the recipient.", total(&shard_metrics::remote));
+    append_metric(out, "chat_link_frames_total", "counter", "Frames run from other cluster nodes.", total(&shard_metrics::link_frames));
+    append_metric(out, "chat_offline_messages", "gauge", "Off-line messages not delivered yet.", offline_msgs);
+    append_metric(out, "chat_offline_users", "gauge", "Users with off-line messages.", offline_users);
+    append_metric(out, "chat_offline_bytes", "gauge", "Bytes the off-line messages take in the store.", offline_bytes);
+    append_metric(out, "chat_mails_total", "counter", "Work items passed between reactor threads.", total(&shard_metrics::mails));
+    append_metric(out, "chat_log_dropped_total", "counter", "Log records dropped because the log ring was full.", event_log.dropped());
+    append_metric(out, "chat_loop_iterations_total", "counter", "Event loop iterations that handled events.", total(&shard_metrics::loops));
+    append_histogram(out, "chat_fanout_recipients", "Recipients per chat.", merged(&shard_metrics::fan_out));
+    append_histogram(out, "chat_loop_events", "Events handled per event loop iteration.", merged(&shard_metrics::loop_events));
+    append_histogram(out, "chat_loop_seconds", "Time spent handling the events of an event loop iteration.", merged(&shard_metrics::loop_time), 1e-9);
+
+    return out;
+}
+
+static int user_login(shard &sh, client &cl)
+{
+    using namespace std;
+
+    int status = cl.fill();
+    if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    bool closed = (status <= 0);
+    if (status < 0) {
+        log_io_error(cl, "my_fill", errno);
+    }
 
-        char cmd_orig[MAX_CMD];
+    char cmd_orig[MAX_CMD];
+    while (status >= 0) {
         int cmdlen = MAX_CMD;
-        status = cl.recv_cmd(cmd_orig, &cmdlen);
+        status = cl.next_cmd(cmd_orig, &cmdlen);
         if (status < 0) {
-            perror("my_recv_cmd");
+            break;
         }
         if (status > 0) {
-            if (cmdlen == 0) {
-                cout << "Connection closed by peer." << endl;
-            }
-            else {
-                cout << "Invalid command received. Terminating connection..." << endl;
-            }
-            cl.close();
-            it = nonlogin_clients.erase(it);
-            continue;
+            event_log.log(LOG_WARN, "Invalid command received. Terminating connection...");
+            closed = true;
+            break;
         }
-        
-        vector<string> cmd = parse_command(cmd_orig);
-        if (cmd.size() == 0) {
-            ++it;
+
+        parsed_cmd &cmd = sh.cmd;
+        if (tokenize_command(cmd_orig, cmdlen, cmd) < 0 || cmd.count < 2 || cmd.words[0] != "user") {
             continue;
         }
-        if (cmd[0] == "user") {
-            cl.name = cmd[1];
-            auto inserted = clients.insert(make_pair(cmd[1], cl));
 
-            // user exists
-            if (!inserted.second) {
-                if (inserted.first->second.fd > 0) {
-                    string reason = "User " + cmd[1] + " has logged in.\n";
-                    int len = reason.size();
-                    cl.send(reason.c_str(), &len, MSG_NOSIGNAL);
+        client *cl_login = login(sh, cl, cmd.words[1].str());
+        if (cl_login == NULL) {
+            sh.metrics.logins_refused.add();
+            return 0;
+        }
+        sh.metrics.logins.add();
 
-                    cl.close();
-                    it = nonlogin_clients.erase(it);
-                    continue;
-                }
-                
-                inserted.first->second.fd = cl.fd;
-            }
+        // Commands pipelined after `user` are already in the buffer.
+        status = serve_commands(sh, *cl_login);
+        if (closed && cl_login->fd > 0) {
+            event_log.log(LOG_INFO, "Connection closed by user %s.", cl_login->entry->name);
+            client_leave(sh, *cl_login);
+        }
+        return status;
+    }
 
-            fd_to_client.insert(make_pair(cl.fd, &(inserted.first->second)));
-            client &cl_inserted = inserted.first->second;
+    if (closed) {
+        if (status < 0) {
+            event_log.log(LOG_INFO, "Connection closed by peer.");
+        }
+        int fd = cl.fd;
+        unwatch_fd(sh, fd);
+        cl.close();
+        remove_conn(sh, fd);
+    }
 
-            welcome(cl_inserted);
-            for (auto &msg : cl_inserted.offline_msgs) {
-                int len = static_cast<int>(msg.size());
-                status = cl_inserted.send(msg.c_str(), &len, MSG_NOSIGNAL);
-                if (status < 0) {
-                    break;
-                }
-            }
-            cl_inserted.offline_msgs.clear();
+    return 0;
+}
 
-            string login_notify = "User " + cmd[1] + " is on-line, IP address: " + get_ip(cl_inserted) + "\n";
-            for (auto it = clients.begin(); it != clients.end(); ++it) {
-                int len = static_cast<int>(login_notify.size());
-                it->second.send(login_notify.c_str(), &len, MSG_NOSIGNAL);
-            }
+static void refuse_login(client &cl, const std::string &reason)
+{
+    // Written right away; the connection is closed next, before any queue
+    // would be flushed.
+    if (::send(cl.fd, reason.data(), reason.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        log_io_error(cl, "send", errno);
+    }
+}
 
-            it = nonlogin_clients.erase(it);
-            continue;
-        }
+static client *login(shard &sh, client &cl, const std::string &name)
+{
+    using namespace std;
 
-        ++it;
+    int fd = cl.fd;
+    user *u = directory.insert(name).first;
+    if (u == NULL) {
+        string reason = "Too many users.\n";
+        refuse_login(cl, reason);
+
+        unwatch_fd(sh, fd);
+        cl.close();
+        remove_conn(sh, fd);
+        return NULL;
     }
 
-    return status;
-}
\ No newline at end of file
+    unique_lock<mutex> lock(directory.lock_of(*u));
+
+    // user exists
+    if (u->cl != NULL || u->node >= 0) {
+        lock.unlock();
+
+        string reason = "User " + name + " has logged in.\n";
+        refuse_login(cl, reason);
+
+        unwatch_fd(sh, fd);
+        cl.close();
+        remove_conn(sh, fd);
+        return NULL;
+    }
+
+    // The connection goes on-line as it is, with the bytes already buffered.
+    u->cl = &cl;
+    u->owner = sh.id;
+    cl.entry = u;
+    cl.backlog = true;
+    lock.unlock();
+
+    set_online(sh, cl);
+    cl.last_active = sh.now;
+    cl.last_heartbeat = sh.now;
+    arm_online_timer(sh, cl);
+
+    // Keep little unsent data in the kernel while streaming, so the socket
+    // paces the backlog and a dropped connection loses little of it.
+    int lowat = BACKLOG_CHUNK;
+    setsockopt(cl.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof (lowat));
+
+    welcome(cl);
+    stream_backlog(sh, cl);
+
+    // Other nodes learn where the user is; the home node sends what it kept.
+    if (federation.enabled()) {
+        string payload;
+        append_link_name(payload, name);
+        int home = federation.home_of(name);
+        if (home != federation.self()) {
+            federation.send(home, LINK_FETCH, payload);
+        }
+        federation.send_all(LINK_ONLINE, payload + get_ip(cl));
+    }
+
+    broadcast(sh, make_notice("User " + name + " is on-line, IP address: " + get_ip(cl) + "\n"), NULL);
+
+    return &cl;
+}
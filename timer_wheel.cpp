@@ -0,0 +1,170 @@
+#include "timer_wheel.hpp"
+
+#include <climits>
+
+static void link_after(timer_node &head, timer_node &t)
+{
+    t.prev = &head;
+    t.next = head.next;
+    head.next->prev = &t;
+    head.next = &t;
+}
+
+timer_wheel::timer_wheel(uint64_t tick_ns, uint64_t now)
+: occupied(), start(now), tick_ns(tick_ns), now_tick(0), count(0)
+{
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        for (int i = 0; i < WHEEL_SLOTS; ++i) {
+            slots[level][i].prev = slots[level][i].next = &slots[level][i];
+        }
+    }
+    expired.prev = expired.next = &expired;
+}
+
+void timer_wheel::place(timer_node &t)
+{
+    if (t.expires <= now_tick) {
+        link_after(expired, t);
+        return;
+    }
+
+    uint64_t delta = t.expires - now_tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (static_cast<uint64_t>(1) << (WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    // Beyond the reach of the top level: park in the slot that comes round
+    // last.
+    uint64_t slot_tick = t.expires;
+    if (delta >= (static_cast<uint64_t>(1) << (WHEEL_BITS * WHEEL_LEVELS))) {
+        slot_tick = now_tick + ((static_cast<uint64_t>(WHEEL_SLOTS) - 1) << (WHEEL_BITS * level));
+    }
+
+    int i = static_cast<int>(slot_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    link_after(slots[level][i], t);
+    occupied[level] |= static_cast<uint64_t>(1) << i;
+}
+
+void timer_wheel::cascade(int level)
+{
+    int i = static_cast<int>(now_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    timer_node &head = slots[level][i];
+    timer_node *t = head.next;
+    head.prev = head.next = &head;
+    occupied[level] &= ~(static_cast<uint64_t>(1) << i);
+
+    while (t != &head) {
+        timer_node *next = t->next;
+        place(*t);
+        t = next;
+    }
+}
+
+void timer_wheel::schedule(timer_node &t, uint64_t when)
+{
+    cancel(t);
+    t.expires = (when > start) ? (when - start + tick_ns - 1) / tick_ns : 0;
+    place(t);
+    ++count;
+}
+
+void timer_wheel::cancel(timer_node &t)
+{
+    if (!t.armed()) {
+        return;
+    }
+
+    timer_node *prev = t.prev;
+    prev->next = t.next;
+    t.next->prev = prev;
+    t.prev = t.next = NULL;
+    --count;
+
+    // The last timer of a slot clears its bit.
+    if (prev->next == prev && prev >= &slots[0][0] && prev < &slots[0][0] + WHEEL_LEVELS * WHEEL_SLOTS) {
+        size_t index = static_cast<size_t>(prev - &slots[0][0]);
+        occupied[index / WHEEL_SLOTS] &= ~(static_cast<uint64_t>(1) << (index % WHEEL_SLOTS));
+    }
+}
+
+void timer_wheel::advance(uint64_t now)
+{
+    uint64_t target = tick_of(now);
+    while (now_tick < target) {
+        bool empty = true;
+        for (int level = 0; level < WHEEL_LEVELS; ++level) {
+            empty = empty && occupied[level] == 0;
+        }
+        if (empty) {
+            now_tick = target;
+            break;
+        }
+
+        ++now_tick;
+
+        // Levels whose lower level wrapped around move down, the highest
+        // first, as it may fill the slot of the level below that is due now.
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (now_tick & ((static_cast<uint64_t>(1) << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            ++top;
+        }
+        for (int level = top; level >= 1; --level) {
+            cascade(level);
+        }
+
+        int i = static_cast<int>(now_tick) & (WHEEL_SLOTS - 1);
+        timer_node &head = slots[0][i];
+        while (head.next != &head) {
+            timer_node &t = *head.next;
+            head.next = t.next;
+            t.next->prev = &head;
+            link_after(expired, t);
+        }
+        occupied[0] &= ~(static_cast<uint64_t>(1) << i);
+    }
+}
+
+timer_node *timer_wheel::next_expired()
+{
+    // Oldest first.
+    timer_node *t = expired.prev;
+    if (t == &expired) {
+        return NULL;
+    }
+
+    cancel(*t);
+    return t;
+}
+
+int timer_wheel::timeout_ms(uint64_t now) const
+{
+    if (count == 0) {
+        return -1;
+    }
+    if (expired.next != &expired) {
+        return 0;
+    }
+
+    // Ticks to the next non-empty slot of level 0, but no later than its
+    // wrap-around if timers wait on the levels above.
+    int cur = static_cast<int>(now_tick) & (WHEEL_SLOTS - 1);
+    uint64_t ticks = WHEEL_SLOTS - cur;
+    int shift = (cur + 1) & (WHEEL_SLOTS - 1);
+    uint64_t rot = (shift == 0) ? occupied[0] : (occupied[0] >> shift) | (occupied[0] << (WHEEL_SLOTS - shift));
+    if (rot != 0) {
+        uint64_t next = static_cast<uint64_t>(__builtin_ctzll(rot)) + 1;
+        bool above = false;
+        for (int level = 1; level < WHEEL_LEVELS; ++level) {
+            above = above || occupied[level] != 0;
+        }
+        ticks = (above && next > ticks) ? ticks : next;
+    }
+
+    uint64_t when = start + (now_tick + ticks) * tick_ns;
+    if (when <= now) {
+        return 0;
+    }
+    uint64_t ms = (when - now + 999999) / 1000000;
+    return (ms > INT_MAX) ? INT_MAX : static_cast<int>(ms);
+}
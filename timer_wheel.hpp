@@ -0,0 +1,116 @@
+#ifndef __TIMER_WHEEL_HPP__
+#define __TIMER_WHEEL_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Levels of the wheel and slots per level, as bits.
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+/**
+ * A timer, embedded in the object it belongs to. A copy is never armed, so
+ * objects holding one may be copied freely.
+ */
+struct timer_node
+{
+    timer_node *prev; // NULL while not armed
+    timer_node *next;
+    uint64_t expires; // tick
+    void *data;       // for the owner
+
+    timer_node() : prev(NULL), next(NULL), expires(0), data(NULL)
+    {
+    }
+
+    timer_node(const timer_node &other) : prev(NULL), next(NULL), expires(0), data(other.data)
+    {
+    }
+
+    timer_node &operator=(const timer_node &other)
+    {
+        data = other.data;
+        return *this;
+    }
+
+    bool armed() const
+    {
+        return prev != NULL;
+    }
+};
+
+/**
+ * Hierarchical timing wheel for one thread. Level 0 has a slot per tick,
+ * each level above a slot per WHEEL_SLOTS slots of the level below; a timer
+ * goes to the lowest level whose range reaches it, and moves down a level
+ * each time the level below wraps around. Arming and cancelling are O(1)
+ * whatever the number of timers, and only the slots that come due are
+ * visited. Timers further out than the top level reaches are parked in its
+ * last slot and placed again when it comes round.
+ */
+class timer_wheel
+{
+    timer_node slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+    uint64_t occupied[WHEEL_LEVELS];             // bit per non-empty slot
+    timer_node expired;                          // due, not taken yet
+    uint64_t start;                              // clock at tick 0
+    uint64_t tick_ns;
+    uint64_t now_tick;
+    size_t count;
+
+    void place(timer_node &t);
+    void cascade(int level);
+
+public:
+    timer_wheel(uint64_t tick_ns, uint64_t now);
+
+    /**
+    * Description: Tick of clock time `now`, in nanoseconds.
+    */
+    uint64_t tick_of(uint64_t now) const
+    {
+        return (now - start) / tick_ns;
+    }
+
+    /**
+    * Description: Arm `t` to expire at clock time `when` (nanoseconds),
+    *              moving it if it is armed already. A time that has passed
+    *              expires on the next advance().
+    */
+    void schedule(timer_node &t, uint64_t when);
+
+    /**
+    * Description: Disarm `t`, if armed.
+    */
+    void cancel(timer_node &t);
+
+    /**
+    * Description: Bring the wheel to clock time `now`; timers that came due
+    *              are then returned by next_expired().
+    */
+    void advance(uint64_t now);
+
+    /**
+    * Description: Take the next timer that came due, now disarmed.
+    * Return: The timer, or NULL if there are no more.
+    */
+    timer_node *next_expired();
+
+    /**
+    * Description: How long the caller may sleep at clock time `now` before
+    *              the wheel needs to advance.
+    * Return: Milliseconds, or -1 if no timer is armed.
+    */
+    int timeout_ms(uint64_t now) const;
+
+    /**
+    * Description: Armed timers, including those due but not taken yet.
+    */
+    size_t size() const
+    {
+        return count;
+    }
+};
+
+#endif
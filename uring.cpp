@@ -0,0 +1,250 @@
+#include "uring.hpp"
+
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+uring::uring()
+: ring_fd(-1), features(0), sq_ptr(MAP_FAILED), sq_size(0), sq_head(NULL), sq_tail(NULL), sq_mask(0), sq_entries(0), sq_array(NULL),
+sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqes_size(0), sq_local(0), cq_ptr(MAP_FAILED), cq_size(0), cq_head(NULL),
+cq_tail(NULL), cq_mask(0), cqes(NULL), buf_base(static_cast<char *>(MAP_FAILED)), buf_count(0), buf_size(0), buf_group(0)
+{
+
+}
+
+uring::~uring()
+{
+    if (buf_base != MAP_FAILED) {
+        munmap(buf_base, static_cast<size_t>(buf_count) * buf_size);
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != MAP_FAILED) {
+        munmap(sq_ptr, sq_size);
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+}
+
+int uring::init(unsigned entries)
+{
+    struct io_uring_params p;
+
+    // Completions are only run when this thread asks for them, which saves
+    // the kernel from interrupting it; older kernels lack both flags.
+    memset(&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    ring_fd = sys_io_uring_setup(entries, &p);
+    if (ring_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof (p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        ring_fd = sys_io_uring_setup(entries, &p);
+    }
+    if (ring_fd < 0) {
+        return -1;
+    }
+
+    features = p.features;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof (uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = (cq_size > sq_size) ? cq_size : sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    }
+    else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+
+    sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe *>(mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    char *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<uint32_t *>(sq + p.sq_off.head);
+    sq_tail = reinterpret_cast<uint32_t *>(sq + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<uint32_t *>(sq + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_array = reinterpret_cast<uint32_t *>(sq + p.sq_off.array);
+    sq_local = *sq_tail;
+
+    char *cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<uint32_t *>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<uint32_t *>(cq + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<uint32_t *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+int uring::require(const uint8_t *ops, size_t count, uint32_t feats)
+{
+    if ((features & feats) != feats) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Room for every opcode a kernel may know of.
+    const unsigned nr_ops = 256;
+    std::vector<char> buf(sizeof (struct io_uring_probe) + nr_ops * sizeof (struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, nr_ops) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int uring::setup_buffers(uint16_t group, uint32_t count, uint32_t size)
+{
+    void *base = mmap(NULL, static_cast<size_t>(count) * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    buf_base = static_cast<char *>(base);
+    buf_count = count;
+    buf_size = size;
+    buf_group = group;
+
+    // All of them in one request, numbered from 0.
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int32_t>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(buf_base);
+    sqe->len = size;
+    sqe->buf_group = group;
+    sqe->off = 0;
+    if (submit(1) < 0) {
+        return -1;
+    }
+
+    struct io_uring_cqe cqe;
+    if (!peek_cqe(cqe)) {
+        errno = EIO;
+        return -1;
+    }
+    if (cqe.res < 0) {
+        errno = -cqe.res;
+        return -1;
+    }
+
+    return 0;
+}
+
+uint32_t uring::unsubmitted() const
+{
+    return sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring::get_sqe()
+{
+    if (unsubmitted() >= sq_entries) {
+        submit(0);
+        if (unsubmitted() >= sq_entries) {
+            return NULL;
+        }
+    }
+
+    uint32_t index = sq_local & sq_mask;
+    sq_array[index] = index;
+    ++sq_local;
+
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof (*sqe));
+    return sqe;
+}
+
+int uring::submit(unsigned wait_nr, int timeout_ms)
+{
+    uint32_t to_submit = unsubmitted();
+    __atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+
+    // Always ask for completions; with deferred task running they are only
+    // posted then.
+    if (wait_nr == 0 || timeout_ms < 0) {
+        return sys_io_uring_enter(ring_fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof (arg));
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    return sys_io_uring_enter(ring_fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+}
+
+bool uring::peek_cqe(struct io_uring_cqe &cqe)
+{
+    uint32_t head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void uring::recycle_buffer(uint16_t bid)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+
+    // Nothing to report unless it fails.
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    sqe->len = buf_size;
+    sqe->buf_group = buf_group;
+    sqe->off = bid;
+}
@@ -0,0 +1,115 @@
+#ifndef __URING_HPP__
+#define __URING_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern "C" {
+#include <linux/io_uring.h>
+}
+
+/**
+ * Minimal io_uring instance on the raw system calls. Meant for one thread:
+ * the thread that calls init() must be the only one to use it.
+ *
+ * Requests are queued with get_sqe() and go to the kernel together on the
+ * next submit(), which may also wait for completions. A group of buffers can
+ * be provided for IOSQE_BUFFER_SELECT receives; the kernel picks a buffer per
+ * completion and the caller hands it back with recycle_buffer() once it is
+ * done with the data.
+ */
+class uring
+{
+    int ring_fd;
+    uint32_t features;
+
+    // Submission queue
+    void *sq_ptr;
+    size_t sq_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t sq_local; // tail of the entries not published yet
+
+    // Completion queue
+    void *cq_ptr;
+    size_t cq_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers
+    char *buf_base;
+    uint32_t buf_count;
+    uint32_t buf_size;
+    uint16_t buf_group;
+
+    uint32_t unsubmitted() const;
+
+public:
+    uring();
+    ~uring();
+
+    /**
+    * Description: Create the instance with room for `entries` requests.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int init(unsigned entries);
+
+    /**
+    * Description: Check that the kernel supports all of the `count` request
+    *              opcodes `ops` and has all of the IORING_FEAT_* `feats`.
+    * Return: 0 if it does, or -1 if not (errno EOPNOTSUPP) or if fail.
+    */
+    int require(const uint8_t *ops, size_t count, uint32_t feats);
+
+    /**
+    * Description: Provide `count` buffers of `size` bytes to the kernel as
+    *              buffer group `group`. Call before any other request.
+    * Return: 0 if succeed, or -1 if fail.
+    */
+    int setup_buffers(uint16_t group, uint32_t count, uint32_t size);
+
+    /**
+    * Description: Next free submission entry, cleared. Submits what is
+    *              queued first if the queue is full.
+    * Return: The entry, or NULL if the queue stays full.
+    */
+    struct io_uring_sqe *get_sqe();
+
+    /**
+    * Description: Hand the queued requests to the kernel, then wait until at
+    *              least `wait_nr` completions are ready, or for at most
+    *              `timeout_ms` milliseconds if it is not negative.
+    * Return: Number of requests submitted, or -1 if fail (errno ETIME if the
+    *         wait timed out).
+    */
+    int submit(unsigned wait_nr = 0, int timeout_ms = -1);
+
+    /**
+    * Description: Take the oldest completion into `cqe`.
+    * Return: true if there was one.
+    */
+    bool peek_cqe(struct io_uring_cqe &cqe);
+
+    /**
+    * Description: Data of provided buffer `bid`.
+    */
+    const char *buffer(uint16_t bid) const
+    {
+        return buf_base + static_cast<size_t>(bid) * buf_size;
+    }
+
+    /**
+    * Description: Give provided buffer `bid` back to the kernel, with the next
+    *              submission.
+    */
+    void recycle_buffer(uint16_t bid);
+};
+
+#endif